@@ -0,0 +1,247 @@
+#pragma once
+#include <angelscript.h>
+#include <arm64/compiler.hpp>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <x86-64/compiler.hpp>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace JIT::Bench
+{
+#if defined(__aarch64__)
+    using HostCompiler = ARM64_Compiler;
+    static constexpr inline const char* host_architecture = "arm64";
+#else
+    using HostCompiler = X86_64_Compiler;
+    static constexpr inline const char* host_architecture = "x86-64";
+#endif
+
+    // On x86-64 this is the time stamp counter, on ARM64 the virtual timer, which ticks at a fixed frequency.
+    // Under qemu-user both counters are emulated, so only compare numbers produced on the same machine
+    inline uint64_t read_cycle_counter()
+    {
+#if defined(_MSC_VER) || defined(__x86_64__)
+        return static_cast<uint64_t>(__rdtsc());
+#elif defined(__aarch64__)
+        uint64_t value;
+        asm volatile("mrs %0, cntvct_el0" : "=r"(value));
+        return value;
+#else
+        return static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+    }
+
+    struct Measure {
+        double nanoseconds = 0.0;
+        double cycles      = 0.0;
+
+        Measure& min(const Measure& other)
+        {
+            if (other.nanoseconds < nanoseconds)
+                *this = other;
+            return *this;
+        }
+    };
+
+    class Stopwatch
+    {
+    private:
+        std::chrono::steady_clock::time_point _M_begin;
+        uint64_t _M_begin_cycles;
+
+    public:
+        Stopwatch()
+        {
+            restart();
+        }
+
+        void restart()
+        {
+            _M_begin        = std::chrono::steady_clock::now();
+            _M_begin_cycles = read_cycle_counter();
+        }
+
+        Measure elapsed() const
+        {
+            uint64_t cycles = read_cycle_counter();
+            auto end        = std::chrono::steady_clock::now();
+            auto elapsed    = std::chrono::duration_cast<std::chrono::nanoseconds>(end - _M_begin);
+
+            Measure result;
+            result.nanoseconds = static_cast<double>(elapsed.count());
+            result.cycles      = static_cast<double>(cycles - _M_begin_cycles);
+            return result;
+        }
+    };
+
+    // Hardware event counter of the calling thread. Only implemented on Linux through perf_event_open,
+    // on other systems and when perf events are not permitted (see kernel.perf_event_paranoid) valid() is false
+    class PerfCounter
+    {
+    private:
+        int _M_fd = -1;
+
+        PerfCounter(uint32_t type, uint64_t config)
+        {
+#if defined(__linux__)
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.type           = type;
+            attr.size           = sizeof(attr);
+            attr.config         = config;
+            attr.disabled       = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv     = 1;
+            _M_fd               = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+#else
+            (void) type;
+            (void) config;
+#endif
+        }
+
+    public:
+        PerfCounter(const PerfCounter&)            = delete;
+        PerfCounter& operator=(const PerfCounter&) = delete;
+
+        ~PerfCounter()
+        {
+#if defined(__linux__)
+            if (_M_fd >= 0)
+                close(_M_fd);
+#endif
+        }
+
+        static PerfCounter itlb_misses()
+        {
+#if defined(__linux__)
+            return PerfCounter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_ITLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                                           (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+#else
+            return PerfCounter(0, 0);
+#endif
+        }
+
+        bool valid() const
+        {
+            return _M_fd >= 0;
+        }
+
+        void start()
+        {
+#if defined(__linux__)
+            if (_M_fd >= 0)
+            {
+                ioctl(_M_fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(_M_fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+#endif
+        }
+
+        uint64_t stop()
+        {
+            uint64_t value = 0;
+#if defined(__linux__)
+            if (_M_fd >= 0)
+            {
+                ioctl(_M_fd, PERF_EVENT_IOC_DISABLE, 0);
+                if (read(_M_fd, &value, sizeof(value)) != sizeof(value))
+                    value = 0;
+            }
+#endif
+            return value;
+        }
+    };
+
+    inline void message_callback(const asSMessageInfo* msg, void*)
+    {
+        printf("Script message: %s (%d:%d)\n", msg->message, msg->row, msg->col);
+    }
+
+    // Passing nullptr as compiler creates an engine which runs everything in the interpreter
+    inline asIScriptEngine* create_engine(asIJITCompiler* compiler)
+    {
+        asIScriptEngine* engine = asCreateScriptEngine();
+        engine->SetMessageCallback(asFUNCTION(message_callback), 0, asCALL_CDECL);
+
+        if (compiler)
+        {
+            engine->SetEngineProperty(asEP_INCLUDE_JIT_INSTRUCTIONS, 1);
+            engine->SetJITCompiler(compiler);
+        }
+        return engine;
+    }
+
+    inline const char* find_option(int argc, char** argv, const char* name, const char* default_value = nullptr)
+    {
+        for (int i = 1; i < argc - 1; i++)
+        {
+            if (std::strcmp(argv[i], name) == 0)
+                return argv[i + 1];
+        }
+        return default_value;
+    }
+
+    inline bool has_flag(int argc, char** argv, const char* name)
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            if (std::strcmp(argv[i], name) == 0)
+                return true;
+        }
+        return false;
+    }
+
+    inline unsigned long long option_value(int argc, char** argv, const char* name, unsigned long long default_value)
+    {
+        const char* value = find_option(argc, argv, name);
+        return value ? std::strtoull(value, nullptr, 10) : default_value;
+    }
+
+    // Writes the same text to stdout and, if requested with --output, to a file
+    class Report
+    {
+    private:
+        FILE* _M_file = nullptr;
+
+    public:
+        Report(const char* path)
+        {
+            if (path)
+            {
+                _M_file = std::fopen(path, "w");
+                if (_M_file == nullptr)
+                    printf("Cannot open file '%s', the report is printed to stdout only\n", path);
+            }
+        }
+
+        ~Report()
+        {
+            if (_M_file)
+                std::fclose(_M_file);
+        }
+
+        template<typename... Args>
+        void print(const char* format, Args... args)
+        {
+            printf(format, args...);
+            if (_M_file)
+                std::fprintf(_M_file, format, args...);
+        }
+    };
+}// namespace JIT::Bench
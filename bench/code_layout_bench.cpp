@@ -0,0 +1,178 @@
+// Code layout benchmark for the executable memory of the compiled functions.
+//
+// Builds a set of filler modules and discards every second one, so the shared allocator has holes, then builds
+// a module with many small functions and calls all of them in a shuffled order. The same is done with the shared
+// allocator, with one arena per module and with one arena per module backed by large pages. The report contains
+// the time per call, iTLB misses per 1000 calls (Linux only) and the memory reserved for the code.
+//
+// Usage: ./AngelScriptJITCodeLayoutBench [--functions N] [--fillers N] [--iterations N] [--repeat N] [--seed N]
+//                                        [--budget BYTES] [--output FILE]
+//
+// With --budget the code arena evicts the least recently entered functions when the benchmark calls collect(),
+// evicted functions run in the interpreter, the number of evictions is printed in the last column.
+//
+// Large pages are only used if the system provides them (for example vm.nr_hugepages on Linux), otherwise the
+// allocator falls back to regular pages and the last two rows should be close to each other.
+
+#include "bench_common.hpp"
+#include <algorithm>
+#include <numeric>
+#include <random>
+#include <vector>
+
+using namespace JIT::Bench;
+
+struct LayoutCase {
+    const char* name;
+    JIT::CodeArena::Mode mode;
+    bool large_pages;
+};
+
+static const LayoutCase cases[] = {
+        {"shared", JIT::CodeArena::Mode::Shared, false},
+        {"module arena", JIT::CodeArena::Mode::PerModule, false},
+        {"module arena + large pages", JIT::CodeArena::Mode::PerModule, true},
+};
+
+static std::string generate_functions(const char* prefix, unsigned int functions)
+{
+    std::string code;
+    for (unsigned int i = 0; i < functions; i++)
+    {
+        std::string index = std::to_string(i);
+        code += "int " + std::string(prefix) + index + "(int a)\n{\n    int b = a * " + std::to_string(i % 7 + 2) +
+                ";\n    if (b > " + index + ") b -= a;\n    return b + " + index + ";\n}\n";
+    }
+    return code;
+}
+
+static std::string generate_module(unsigned int functions, unsigned int seed)
+{
+    std::string code = "int g_sink = 0;\n" + generate_functions("function_", functions);
+
+    std::vector<unsigned int> order(functions);
+    std::iota(order.begin(), order.end(), 0);
+    std::shuffle(order.begin(), order.end(), std::mt19937(seed));
+
+    code += "void run(uint n)\n{\n    int sink = 0;\n    for (uint i = 0; i < n; i++)\n    {\n";
+    for (unsigned int index : order)
+    {
+        code += "        sink += function_" + std::to_string(index) + "(int(i));\n";
+    }
+    code += "    }\n    g_sink = sink;\n}\n";
+    return code;
+}
+
+static bool build(asIScriptEngine* engine, const char* name, const std::string& code)
+{
+    asIScriptModule* module = engine->GetModule(name, asGM_ALWAYS_CREATE);
+    module->AddScriptSection(name, code.c_str(), code.size());
+    if (module->Build() < 0)
+    {
+        printf("Failed to build module '%s'\n", name);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    unsigned int functions  = static_cast<unsigned int>(option_value(argc, argv, "--functions", 2000));
+    unsigned int fillers    = static_cast<unsigned int>(option_value(argc, argv, "--fillers", 16));
+    unsigned int iterations = static_cast<unsigned int>(option_value(argc, argv, "--iterations", 200));
+    unsigned int repeat     = static_cast<unsigned int>(option_value(argc, argv, "--repeat", 3));
+    unsigned int seed       = static_cast<unsigned int>(option_value(argc, argv, "--seed", 1));
+    size_t budget           = static_cast<size_t>(option_value(argc, argv, "--budget", 0));
+    Report report(find_option(argc, argv, "--output"));
+
+    if (repeat == 0)
+        repeat = 1;
+
+    std::string code        = generate_module(functions, seed);
+    std::string filler_code = generate_functions("filler_", functions / 4 + 1);
+
+    PerfCounter itlb = PerfCounter::itlb_misses();
+    if (!itlb.valid())
+        printf("iTLB counter is not available, the miss columns are zero\n");
+
+    report.print("Architecture: %s, functions: %u, fillers: %u, iterations: %u, repeat: %u\n", host_architecture,
+                 functions, fillers, iterations, repeat);
+    report.print("%-28s %12s %16s %14s %14s %8s %10s\n", "layout", "ns/call", "iTLB miss/1000", "used bytes",
+                 "reserved bytes", "blocks", "evictions");
+
+    for (const LayoutCase& layout : cases)
+    {
+        HostCompiler compiler;
+        JIT::CodeArena::Options options;
+        options.mode        = layout.mode;
+        options.large_pages = layout.large_pages;
+        options.budget      = budget;
+        compiler.context().options(options);
+
+        asIScriptEngine* engine = create_engine(&compiler);
+
+        // Leave holes in the executable memory before the measured module is compiled
+        for (unsigned int i = 0; i < fillers; i++)
+        {
+            std::string name = "filler_" + std::to_string(i);
+            if (!build(engine, name.c_str(), filler_code))
+                return -1;
+        }
+
+        for (unsigned int i = 0; i < fillers; i += 2)
+        {
+            engine->DiscardModule(("filler_" + std::to_string(i)).c_str());
+        }
+
+        if (!build(engine, "layout", code))
+            return -1;
+
+        // Evicts the functions over the budget before the measurement
+        compiler.context().collect();
+
+        asIScriptContext* context   = engine->CreateContext();
+        asIScriptFunction* function = engine->GetModule("layout")->GetFunctionByName("run");
+
+        Measure best;
+        uint64_t best_misses = 0;
+
+        // The first execution is a warm up
+        for (unsigned int i = 0; i <= repeat; i++)
+        {
+            context->Prepare(function);
+            context->SetArgDWord(0, iterations);
+
+            itlb.start();
+            Stopwatch stopwatch;
+            int status      = context->Execute();
+            Measure measure = stopwatch.elapsed();
+            uint64_t misses = itlb.stop();
+
+            if (status != asEXECUTION_FINISHED)
+            {
+                printf("Layout '%s' failed with status %d\n", layout.name, status);
+                return -1;
+            }
+
+            if (i == 1 || (i > 1 && measure.nanoseconds < best.nanoseconds))
+            {
+                best        = measure;
+                best_misses = misses;
+            }
+        }
+
+        // No context is executing, the code of the evicted functions can be freed
+        compiler.context().collect();
+
+        double calls                      = static_cast<double>(iterations) * functions;
+        JIT::CodeArena::Statistics memory = compiler.context().statistics();
+        report.print("%-28s %12.3f %16.3f %14zu %14zu %8zu %10zu\n", layout.name, best.nanoseconds / calls,
+                     1000.0 * static_cast<double>(best_misses) / calls, memory.used_bytes, memory.reserved_bytes,
+                     memory.blocks, memory.evictions);
+
+        context->Release();
+        engine->ShutDownAndRelease();
+    }
+
+    return 0;
+}
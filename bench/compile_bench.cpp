@@ -0,0 +1,214 @@
+// Compile throughput benchmark.
+//
+// Generates a module with N functions of M statements, builds it with the JIT attached and reports how many functions
+// and byte code bytes per second pass through CompileFunction, together with the time spent in every phase of the
+// compilation: init() (prologue and label discovery), emission of the handlers, the peephole pass, embedConstPool,
+// finalize and JitRuntime::add. The last run also prints how many instructions every peephole pass removed or rewrote,
+// how many loop variables it kept in registers, how many instructions the constant folding replaced or removed, how
+// many null checks and stores to temporaries were proven redundant and how many objects were placed into the native
+// stack frame. --no-peephole disables the passes and --no-analysis the analyses of the byte code to compare the
+// throughput and the size of the code.
+//
+// Usage: ./AngelScriptJITCompileBench [--functions N] [--statements M] [--branch-density PERCENT]
+//                                     [--mix INT,FLOAT,DOUBLE,INT64] [--repeat N] [--seed N] [--no-peephole]
+//                                     [--no-analysis] [--output FILE]
+//
+// --mix sets the relative weight of statements of each type, for example --mix 4,2,1,1.
+// Configure with -DANGELSCRIPTJIT_WITH_LOG=OFF, otherwise the logging dominates the measured time.
+
+#include "bench_common.hpp"
+#include <random>
+
+using namespace JIT::Bench;
+
+struct GeneratorConfig {
+    unsigned int functions      = 200;
+    unsigned int statements     = 100;
+    unsigned int branch_density = 10;
+    unsigned int mix[4]         = {4, 2, 1, 1};
+    unsigned int seed           = 1;
+};
+
+class ModuleGenerator
+{
+private:
+    static constexpr inline const char* types[4]      = {"int", "float", "double", "int64"};
+    static constexpr inline const char* prefixes[4]   = {"i", "f", "d", "l"};
+    static constexpr inline unsigned int variables    = 6;
+    static constexpr inline const char* operators[]   = {"+", "-", "*", "/"};
+    static constexpr inline const char* comparisons[] = {"<", ">", "==", "!="};
+
+    const GeneratorConfig& _M_config;
+    std::mt19937 _M_random;
+    std::discrete_distribution<unsigned int> _M_type;
+
+    unsigned int random(unsigned int max)
+    {
+        return std::uniform_int_distribution<unsigned int>(0, max - 1)(_M_random);
+    }
+
+    std::string variable(unsigned int type)
+    {
+        return std::string(prefixes[type]) + std::to_string(random(variables));
+    }
+
+    std::string assignment()
+    {
+        unsigned int type = _M_type(_M_random);
+        const char* op    = operators[random(4)];
+        return variable(type) + " = " + variable(type) + " " + op + " " + variable(type) + ";";
+    }
+
+    std::string statement()
+    {
+        if (random(100) < _M_config.branch_density)
+        {
+            unsigned int type = _M_type(_M_random);
+            return "if (" + variable(type) + " " + comparisons[random(4)] + " " + variable(type) + ") { " +
+                   assignment() + " } else { " + assignment() + " }";
+        }
+        return assignment();
+    }
+
+public:
+    ModuleGenerator(const GeneratorConfig& config)
+        : _M_config(config), _M_random(config.seed),
+          _M_type({static_cast<double>(config.mix[0]), static_cast<double>(config.mix[1]),
+                   static_cast<double>(config.mix[2]), static_cast<double>(config.mix[3])})
+    {}
+
+    std::string generate()
+    {
+        std::string code;
+        for (unsigned int function = 0; function < _M_config.functions; function++)
+        {
+            code += "int function_" + std::to_string(function) + "(int arg)\n{\n";
+
+            for (unsigned int type = 0; type < 4; type++)
+            {
+                for (unsigned int index = 0; index < variables; index++)
+                {
+                    code += std::string("    ") + types[type] + " " + prefixes[type] + std::to_string(index) + " = " +
+                            (type == 0 ? "arg" : std::string(types[type]) + "(arg)") + " + " +
+                            std::to_string(index + 1) + ";\n";
+                }
+            }
+
+            for (unsigned int index = 0; index < _M_config.statements; index++)
+            {
+                code += "    " + statement() + "\n";
+            }
+
+            code += "    return i0 + int(f0) + int(d0) + int(l0);\n}\n\n";
+        }
+        return code;
+    }
+};
+
+static void parse_mix(const char* value, GeneratorConfig& config)
+{
+    if (value == nullptr)
+        return;
+
+    unsigned int index = 0;
+    for (const char* current = value; *current && index < 4; index++)
+    {
+        char* end         = nullptr;
+        config.mix[index] = static_cast<unsigned int>(std::strtoul(current, &end, 10));
+        current           = (*end == ',') ? end + 1 : end;
+    }
+}
+
+static double milliseconds(uint64_t nanoseconds)
+{
+    return static_cast<double>(nanoseconds) / 1000000.0;
+}
+
+int main(int argc, char** argv)
+{
+    GeneratorConfig config;
+    config.functions  = static_cast<unsigned int>(option_value(argc, argv, "--functions", config.functions));
+    config.statements = static_cast<unsigned int>(option_value(argc, argv, "--statements", config.statements));
+    config.branch_density =
+            static_cast<unsigned int>(option_value(argc, argv, "--branch-density", config.branch_density));
+    config.seed = static_cast<unsigned int>(option_value(argc, argv, "--seed", config.seed));
+    parse_mix(find_option(argc, argv, "--mix"), config);
+
+    unsigned int repeat = static_cast<unsigned int>(option_value(argc, argv, "--repeat", 3));
+    Report report(find_option(argc, argv, "--output"));
+
+    std::string code = ModuleGenerator(config).generate();
+
+    HostCompiler compiler;
+    if (has_flag(argc, argv, "--no-peephole"))
+        compiler.peephole(JIT::PeepholeOptions{false, false, false, false});
+    if (has_flag(argc, argv, "--no-analysis"))
+        compiler.analysis(JIT::AnalysisOptions{false, false, false, false});
+
+    asIScriptEngine* engine = create_engine(&compiler);
+
+    report.print("Architecture: %s, functions: %u, statements: %u, branch density: %u%%, mix: %u,%u,%u,%u\n",
+                 host_architecture, config.functions, config.statements, config.branch_density, config.mix[0],
+                 config.mix[1], config.mix[2], config.mix[3]);
+    report.print("%-8s %12s %12s %14s %14s %12s %12s %12s %12s %12s %12s %12s\n", "run", "build ms", "jit ms",
+                 "functions/s", "bc bytes/s", "mc bytes", "init ms", "emit ms", "peephole ms", "pool ms", "finalize ms",
+                 "add ms");
+
+    for (unsigned int run = 0; run < repeat; run++)
+    {
+        compiler.reset_statistics();
+
+        asIScriptModule* module = engine->GetModule("CompileBench", asGM_ALWAYS_CREATE);
+        module->AddScriptSection("generated", code.c_str(), code.size());
+
+        Stopwatch stopwatch;
+        int result      = module->Build();
+        Measure measure = stopwatch.elapsed();
+
+        if (result < 0)
+        {
+            printf("Failed to build the generated module\n");
+            return -1;
+        }
+
+        auto& statistics   = compiler.statistics();
+        uint64_t jit_time  = statistics.init_time + statistics.emit_time + statistics.peephole_time +
+                             statistics.const_pool_time + statistics.finalize_time + statistics.runtime_add_time;
+        double jit_seconds = static_cast<double>(jit_time) / 1000000000.0;
+
+        report.print("%-8u %12.3f %12.3f %14.1f %14.1f %12zu %12.3f %12.3f %12.3f %12.3f %12.3f %12.3f\n", run,
+                     measure.nanoseconds / 1000000.0, milliseconds(jit_time),
+                     jit_seconds > 0.0 ? static_cast<double>(statistics.functions) / jit_seconds : 0.0,
+                     jit_seconds > 0.0 ? static_cast<double>(statistics.byte_code_bytes) / jit_seconds : 0.0,
+                     statistics.machine_code_bytes, milliseconds(statistics.init_time),
+                     milliseconds(statistics.emit_time), milliseconds(statistics.peephole_time),
+                     milliseconds(statistics.const_pool_time),
+                     milliseconds(statistics.finalize_time), milliseconds(statistics.runtime_add_time));
+
+        if (run + 1 == repeat && jit_time > 0)
+        {
+            auto percent = [jit_time](uint64_t value) { return 100.0 * static_cast<double>(value) / jit_time; };
+            report.print("\nShare of CompileFunction: init %.1f%%, emit %.1f%%, peephole %.1f%%, const pool %.1f%%, "
+                         "finalize %.1f%%, runtime add %.1f%%; CompileFunction is %.1f%% of Build()\n",
+                         percent(statistics.init_time), percent(statistics.emit_time),
+                         percent(statistics.peephole_time), percent(statistics.const_pool_time),
+                         percent(statistics.finalize_time), percent(statistics.runtime_add_time),
+                         100.0 * static_cast<double>(jit_time) / measure.nanoseconds);
+            report.print("Peephole: %zu forwarded loads, %zu removed moves, %zu folded stack adjustments, "
+                         "%zu variables of %zu loops in registers (%zu accesses)\n",
+                         statistics.peephole.forwarded_loads, statistics.peephole.removed_moves,
+                         statistics.peephole.folded_stack, statistics.peephole.cached_variables,
+                         statistics.peephole.cached_loops, statistics.peephole.replaced_accesses);
+            report.print("Analysis: %zu folded instructions, %zu folded jumps, %zu dead instructions, "
+                         "%zu removed null checks, %zu removed stores, %zu stack objects\n",
+                         statistics.analysis.folded_instructions, statistics.analysis.folded_jumps,
+                         statistics.analysis.dead_instructions, statistics.analysis.removed_null_checks,
+                         statistics.analysis.removed_stores, statistics.analysis.stack_objects);
+        }
+
+        module->Discard();
+    }
+
+    engine->ShutDownAndRelease();
+    return 0;
+}
@@ -0,0 +1,229 @@
+// Per-opcode microbenchmark for the exec_asBC_* handlers.
+//
+// Every case is a small script loop whose body is dominated by one byte code instruction. The loop is executed
+// by the interpreter and by the JIT of the host architecture, an empty loop is used as baseline and subtracted,
+// so the table shows the cost of one execution of the body.
+//
+// Usage: ./AngelScriptJITOpcodeBench [--iterations N] [--repeat N] [--filter NAME] [--output FILE]
+//
+// Configure with -DANGELSCRIPTJIT_WITH_LOG=OFF, otherwise the compiler prints every compiled instruction.
+// To measure the ARM64 backend on a x86-64 machine, build with an aarch64 toolchain and run the executable
+// through qemu-user (qemu-aarch64 -L <sysroot> ./AngelScriptJITOpcodeBench). The emulated numbers are only
+// useful to compare the JIT against the interpreter, not against native runs.
+
+#include "bench_common.hpp"
+#include <algorithm>
+#include <vector>
+
+using namespace JIT::Bench;
+
+struct OpcodeCase {
+    const char* name;
+    const char* opcode;
+    const char* body;
+};
+
+static const char* script_template = R"(
+int g_int = 7;
+int g_sink = 0;
+
+int add(int x, int y)
+{
+    return x + y;
+}
+
+void run(uint n)
+{
+    int a = g_int; int b = 3; int c = 0;
+    uint ua = 11;
+    int64 la = a; int64 lb = b; int64 lc = 0;
+    float fa = 2.5f; float fb = 1.25f; float fc = 0;
+    double da = 2.5; double db = 1.25; double dc = 0;
+    bool ba = a > b; bool bc = false;
+
+    for (uint i = 0; i < n; i++)
+    {
+        %s
+    }
+
+    g_sink = c + int(lc) + int(fc) + int(dc) + (bc ? 1 : 0);
+}
+)";
+
+// The first case is the baseline and must stay empty
+static const OpcodeCase cases[] = {
+        {"loop", "-", ""},
+        {"add int", "ADDi", "c = a + b;"},
+        {"sub int", "SUBi", "c = a - b;"},
+        {"mul int", "MULi", "c = a * b;"},
+        {"div int", "DIVi", "c = a / b;"},
+        {"mod int", "MODi", "c = a % b;"},
+        {"add int imm", "ADDIi", "c = a + 5;"},
+        {"sub int imm", "SUBIi", "c = a - 5;"},
+        {"mul int imm", "MULIi", "c = a * 5;"},
+        {"increment", "IncVi", "c++;"},
+        {"negate", "NEGi", "c = -a;"},
+        {"and", "BAND", "c = a & b;"},
+        {"or", "BOR", "c = a | b;"},
+        {"xor", "BXOR", "c = a ^ b;"},
+        {"shl", "BSLL", "c = a << b;"},
+        {"shr", "BSRL", "c = a >>> b;"},
+        {"sar", "BSRA", "c = a >> b;"},
+        {"compare int", "CMPi", "if (a < b) c++;"},
+        {"compare int imm", "CMPIi", "if (a < 5) c++;"},
+        {"not", "NOT", "bc = !ba;"},
+        {"copy var", "CpyVtoV4", "c = a; a = b; b = c;"},
+        {"read global", "CpyGtoV4", "c = g_int;"},
+        {"write global", "CpyVtoG4", "g_int = a;"},
+        {"add int64", "ADDi64", "lc = la + lb;"},
+        {"mul int64", "MULi64", "lc = la * lb;"},
+        {"div int64", "DIVi64", "lc = la / lb;"},
+        {"add float", "ADDf", "fc = fa + fb;"},
+        {"sub float", "SUBf", "fc = fa - fb;"},
+        {"mul float", "MULf", "fc = fa * fb;"},
+        {"div float", "DIVf", "fc = fa / fb;"},
+        {"mod float", "MODf", "fc = fa % fb;"},
+        {"add float imm", "ADDIf", "fc = fa + 1.5f;"},
+        {"compare float", "CMPf", "if (fa < fb) c++;"},
+        {"add double", "ADDd", "dc = da + db;"},
+        {"mul double", "MULd", "dc = da * db;"},
+        {"div double", "DIVd", "dc = da / db;"},
+        {"mod double", "MODd", "dc = da % db;"},
+        {"compare double", "CMPd", "if (da < db) c++;"},
+        {"int to float", "iTOf", "fc = float(a);"},
+        {"float to int", "fTOi", "c = int(fa);"},
+        {"int to double", "iTOd", "dc = double(a);"},
+        {"double to int", "dTOi", "c = int(da);"},
+        {"uint to double", "uTOd", "dc = double(ua);"},
+        {"float to double", "fTOd", "dc = fa;"},
+        {"pow int", "POWi", "c = a ** b;"},
+        {"pow float", "POWf", "fc = fa ** fb;"},
+        {"call", "CALL", "c = add(a, b);"},
+        {"switch", "JMPP",
+         "switch (int(i & 7)) { case 0: c++; break; case 1: c--; break; case 2: c += 2; break; case 3: c -= 2; break; "
+         "case 4: c += 3; break; case 5: c -= 3; break; default: c = 0; }"},
+};
+
+
+static bool run_case(asIScriptEngine* engine, const OpcodeCase& test, unsigned int iterations, unsigned int repeat,
+                     Measure& result)
+{
+    std::string code(std::strlen(script_template) + std::strlen(test.body), '\0');
+    int length = std::snprintf(code.data(), code.size(), script_template, test.body);
+    code.resize(static_cast<size_t>(length));
+
+    asIScriptModule* module = engine->GetModule(test.name, asGM_ALWAYS_CREATE);
+    module->AddScriptSection(test.name, code.c_str());
+    if (module->Build() < 0)
+    {
+        printf("Failed to build case '%s'\n", test.name);
+        module->Discard();
+        return false;
+    }
+
+    asIScriptContext* context   = engine->CreateContext();
+    asIScriptFunction* function = module->GetFunctionByName("run");
+
+    // The first execution is a warm up
+    for (unsigned int i = 0; i <= repeat; i++)
+    {
+        context->Prepare(function);
+        context->SetArgDWord(0, iterations);
+
+        Stopwatch stopwatch;
+        int status      = context->Execute();
+        Measure measure = stopwatch.elapsed();
+
+        if (status != asEXECUTION_FINISHED)
+        {
+            printf("Case '%s' failed with status %d\n", test.name, status);
+            context->Release();
+            module->Discard();
+            return false;
+        }
+
+        if (i == 1)
+            result = measure;
+        else if (i > 1)
+            result.min(measure);
+    }
+
+    context->Release();
+    module->Discard();
+
+    result.nanoseconds /= iterations;
+    result.cycles /= iterations;
+    return true;
+}
+
+
+int main(int argc, char** argv)
+{
+    unsigned int iterations = static_cast<unsigned int>(option_value(argc, argv, "--iterations", 5000000));
+    unsigned int repeat     = static_cast<unsigned int>(option_value(argc, argv, "--repeat", 3));
+    const char* filter      = find_option(argc, argv, "--filter");
+    Report report(find_option(argc, argv, "--output"));
+
+    if (repeat == 0)
+        repeat = 1;
+
+    HostCompiler compiler;
+    asIScriptEngine* interpreter = create_engine(nullptr);
+    asIScriptEngine* jit         = create_engine(&compiler);
+
+    Measure interpreter_baseline, jit_baseline;
+    if (!run_case(interpreter, cases[0], iterations, repeat, interpreter_baseline) ||
+        !run_case(jit, cases[0], iterations, repeat, jit_baseline))
+    {
+        return -1;
+    }
+
+    report.print("Architecture: %s, iterations: %u, repeat: %u\n", host_architecture, iterations, repeat);
+    report.print("Baseline loop: interpreter %.2f ns (%.1f cycles), JIT %.2f ns (%.1f cycles) per iteration\n\n",
+                 interpreter_baseline.nanoseconds, interpreter_baseline.cycles, jit_baseline.nanoseconds,
+                 jit_baseline.cycles);
+
+    report.print("%-18s %-10s %14s %14s %14s %14s %9s\n", "case", "opcode", "interp ns/op", "jit ns/op",
+                 "interp cyc/op", "jit cyc/op", "speedup");
+
+    std::vector<const OpcodeCase*> slower;
+
+    for (size_t i = 1; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        const OpcodeCase& test = cases[i];
+        if (filter && std::strstr(test.name, filter) == nullptr && std::strstr(test.opcode, filter) == nullptr)
+            continue;
+
+        Measure interpreter_result, jit_result;
+        if (!run_case(interpreter, test, iterations, repeat, interpreter_result) ||
+            !run_case(jit, test, iterations, repeat, jit_result))
+        {
+            continue;
+        }
+
+        interpreter_result.nanoseconds =
+                std::max(interpreter_result.nanoseconds - interpreter_baseline.nanoseconds, 0.0);
+        interpreter_result.cycles = std::max(interpreter_result.cycles - interpreter_baseline.cycles, 0.0);
+        jit_result.nanoseconds         = std::max(jit_result.nanoseconds - jit_baseline.nanoseconds, 0.0);
+        jit_result.cycles              = std::max(jit_result.cycles - jit_baseline.cycles, 0.0);
+
+        double speedup = jit_result.nanoseconds > 0.0 ? interpreter_result.nanoseconds / jit_result.nanoseconds : 0.0;
+        report.print("%-18s %-10s %14.3f %14.3f %14.1f %14.1f %8.2fx%s\n", test.name, test.opcode,
+                     interpreter_result.nanoseconds, jit_result.nanoseconds, interpreter_result.cycles,
+                     jit_result.cycles, speedup, jit_result.nanoseconds > interpreter_result.nanoseconds ? " !" : "");
+
+        if (jit_result.nanoseconds > interpreter_result.nanoseconds)
+            slower.push_back(&test);
+    }
+
+    if (!slower.empty())
+    {
+        report.print("\nHandlers slower than the interpreter (marked with !):");
+        for (const OpcodeCase* test : slower) report.print(" %s", test->opcode);
+        report.print("\n");
+    }
+
+    jit->ShutDownAndRelease();
+    interpreter->ShutDownAndRelease();
+    return 0;
+}
@@ -24,13 +24,20 @@
 #pragma once
 #include <angelscript.h>
 #include <asmjit/a64.h>
+#include <bytecode_analysis.hpp>
+#include <inliner.hpp>
+#include <jit_context.hpp>
+#include <tiering.hpp>
+#include <arm64/peephole.hpp>
 #include <functional>
+#include <memory>
 #include <vector>
 
 
 #include <string>
 #include <map>
 #include <set>
+#include <unordered_map>
 
 namespace JIT
 {
@@ -46,21 +53,94 @@ namespace JIT
             Label label;
         };
 
+        // JitEntry instruction and the label of its code, the offset is written into the argument after finalize
+        struct EntryInfo {
+            asDWORD* byte_code_address;
+            Label label;
+        };
+
+        // Table of the JMP instructions which follow a JMPP
+        struct JumpTable {
+            asDWORD* byte_code_address;
+            asUINT size;
+            Label label;
+        };
+
+        // Innermost loop of the byte code, node is the branch of the back edge after the emission
+        struct LoopInfo {
+            asDWORD* header;
+            asDWORD* back_edge;
+            BaseNode* node;
+        };
+
+        // Poll of a SUSPEND instruction in trap mode and its exit stub, emitted after the code of the function
+        struct SafepointStub {
+            asDWORD* byte_code_address;
+            Label poll;
+            Label stub;
+        };
+
+        // Constant elements stored by a list initialiser, copied at once from data embedded after the code
+        struct ListConstants {
+            asDWORD* begin;
+            asDWORD* end;
+            asDWORD* last_set;
+            short buffer;
+            asDWORD offset;
+            asUINT last_size;
+            std::vector<asBYTE> data;
+            Label label;
+        };
+
+        // Block which follows a mostly taken conditional jump, the jump is inverted to the block and jump continues at
+        // the target. layout_blocks moves the block behind the function and removes jump
+        struct ColdBlock {
+            BaseNode* jump;
+            Label block;
+            Label target;
+        };
+
         struct CompileInfo {
-            Assembler assembler;
+            a64::Builder assembler;
             ConstPool* const_pool;
             Label* const_pool_label;
 
             std::vector<LabelInfo> labels;
+            std::vector<JumpTable> jump_tables;
+            std::vector<EntryInfo> jit_entries;
+            std::vector<LoopInfo> loops;
+            std::vector<SafepointStub> safepoints;
+            std::vector<ListConstants> list_constants;
+            std::vector<ConstantFold> constants;
+            std::vector<bool> valid_pointers;
+            std::vector<bool> dead_stores;
+            StackObjects stack_objects;
+            std::vector<ColdBlock> cold_blocks;
+
+            // The profile of the function, set in both tiers if tiering is enabled. The second tier reads the offset
+            // of the code at a JitEntry from the entry table instead of the argument
+            TierProfile* tier   = nullptr;
+            bool optimized      = false;
+            asUINT* entry_table = nullptr;
+
+            // Loaded branch profile of the function, the second tier uses the profile of the first tier instead
+            const BranchProfiles::Function* branch_profile = nullptr;
+
+            size_t next_list_constants = 0;
 
             asDWORD* address;
             asDWORD* begin;
             asDWORD* end;
 
             asUINT byte_codes;
-            asUINT header_size;
+            Label header_label;
 
+            asIScriptEngine* engine;
+            asIScriptFunction* function;
+            asUINT inlined_size = 0;
             asEBCInstr instruction;
+            CodeArena::Usage* usage;
+            CodeArena::RuntimeData* runtime_data;
 
             template<typename T>
             asmjit::a64::Mem insert_constant(T value)
@@ -71,28 +151,152 @@ namespace JIT
             }
         };
 
-        JitRuntime _M_rt;
-        void (ARM64_Compiler::*exec[static_cast<size_t>(asBC_MAXBYTECODE)])(CompileInfo*);
-        const char* code_names[static_cast<size_t>(asBC_MAXBYTECODE)];
-        bool _M_with_suspend;
+        std::shared_ptr<JitContext> _M_context;
+
+        // The dispatch tables are shared by all instances and filled by the first constructor
+        static void (ARM64_Compiler::*exec[static_cast<size_t>(asBC_MAXBYTECODE)])(CompileInfo*);
+        static const char* code_names[static_cast<size_t>(asBC_MAXBYTECODE)];
+
+    public:
+        // Ignore: SUSPEND is a no-op and the script cannot be suspended while it runs in the JIT code
+        // Exit: every SUSPEND returns to the VM
+        // Poll: SUSPEND returns to the VM only if the context requested it, for example through
+        // asIScriptContext::Suspend from another thread or with a line callback set
+        // Trap: SUSPEND is a load from the guard page of Safepoint, falls back to Poll if the platform has no
+        // safepoint handler
+        enum class SuspendMode
+        {
+            Ignore,
+            Exit,
+            Poll,
+            Trap,
+        };
+
+    private:
+        SuspendMode _M_suspend_mode;
 
         std::map<std::string, std::set<unsigned int>> _M_skip_instructions;
 
     public:
-        ARM64_Compiler(bool with_suspend = false);
+        // Accumulated counters of every CompileFunction call, times are in nanoseconds
+        struct CompileStatistics {
+            size_t functions          = 0;
+            size_t byte_code_bytes    = 0;
+            size_t machine_code_bytes = 0;
+
+            uint64_t init_time        = 0;
+            uint64_t emit_time        = 0;
+            uint64_t peephole_time    = 0;
+            uint64_t const_pool_time  = 0;
+            uint64_t finalize_time    = 0;
+            uint64_t runtime_add_time = 0;
+
+            PeepholeStatistics peephole;
+            size_t inlined_calls = 0;
+            AnalysisStatistics analysis;
+
+            size_t optimized_functions = 0;
+            size_t speculated_calls    = 0;
+            size_t cold_blocks         = 0;
+        };
+
+    private:
+        CompileStatistics _M_statistics;
+        PeepholeOptions _M_peephole;
+        InlineOptions _M_inline;
+        AnalysisOptions _M_analysis;
+        std::vector<AnalysisReport> _M_analysis_reports;
+        std::vector<InlineDecision> _M_inline_decisions;
+        TierOptions _M_tier;
+
+        // Functions compiled with tiering, indexed by the code of the first tier
+        std::unordered_map<void*, TierProfile> _M_tiers;
+        BranchProfiles _M_branch_profiles;
+
+    public:
+        // Compilers created with the same context share the runtime and the compiled code,
+        // nullptr creates a private context
+        ARM64_Compiler(bool with_suspend = false, std::shared_ptr<JitContext> context = nullptr);
+        ARM64_Compiler(SuspendMode suspend_mode, std::shared_ptr<JitContext> context = nullptr);
 
         int CompileFunction(asIScriptFunction* function, asJITFunction* output) override;
         void ReleaseJITFunction(asJITFunction func) override;
 
         void push_instruction_index_for_skip(const std::string& name, unsigned int index);
 
+        const CompileStatistics& statistics() const;
+        void reset_statistics();
+
+        // The peephole passes run over the emitted instructions before they are serialised
+        void peephole(const PeepholeOptions& options);
+        const PeepholeOptions& peephole() const;
+
+        // Inlining of small script functions at the call sites, the decisions are only recorded with log set and
+        // cleared by reset_statistics()
+        void inliner(const InlineOptions& options);
+        const InlineOptions& inliner() const;
+        const std::vector<InlineDecision>& inline_decisions() const;
+
+        // Analyses of the byte code which run before the emission, the reports are only recorded with log set and
+        // cleared by reset_statistics()
+        void analysis(const AnalysisOptions& options);
+        const AnalysisOptions& analysis() const;
+        const std::vector<AnalysisReport>& analysis_reports() const;
+
+        // Speculative second tier, see TierOptions. tier_up() compiles the second tier of the functions which were
+        // entered hot_entries times and returns their number, it must not run concurrently with CompileFunction.
+        // invalidate() returns the function, or every function with nullptr, to the first tier for good, for example
+        // after a module added classes which break the speculation
+        void tiering(const TierOptions& options);
+        const TierOptions& tiering() const;
+        size_t tier_up();
+        void invalidate(asIScriptFunction* function = nullptr);
+        std::vector<TierReport> tier_reports() const;
+
+        // save_branch_profile() writes the edge counters of the first tiers, see BranchProfiles. The functions which
+        // are compiled after load_branch_profile() are laid out with the loaded profile, also without tiering
+        bool save_branch_profile(const char* path) const;
+        bool load_branch_profile(const char* path);
+
+        // Runtime and memory of the compiled functions, use it to configure the code arena
+        JitContext& context();
+
     private:
+        static void register_instructions();
+
+        int compile(asIScriptFunction* function, void** output, TierProfile* optimize);
         asUINT process_instruction(CompileInfo* info);
         void init(CompileInfo* info);
         void restore_registers(CompileInfo* info);
         void save_registers(CompileInfo* info, bool ret = false);
+        void exit_if_suspended(CompileInfo* info, bool next_instruction = true);
+        void copy_handle(CompileInfo* info, asITypeInfo* type, asDWORD plain_flags);
+        void add_to_usage_counter(CompileInfo* info, int value);
 
         size_t find_label_for_jump(CompileInfo* info);
+        size_t find_label(CompileInfo* info, asDWORD* byte_code_address);
+        void embed_jump_tables(CompileInfo* info);
+        void write_jit_entries(CompileInfo* info, CodeHolder& code);
+        void find_loops(CompileInfo* info);
+        void cache_loops(CompileInfo* info);
+        bool inline_call(CompileInfo* info, asIScriptFunction* function);
+        bool speculate_call(CompileInfo* info, asIScriptFunction* function);
+        void profile_call(CompileInfo* info);
+        bool speculate_pointer_call(CompileInfo* info);
+        void profile_pointer_call(CompileInfo* info);
+        void fail_guard(CompileInfo* info, Guard* guard, Label exit);
+        void conditional_jump(CompileInfo* info, a64::CondCode condition, bool low = false);
+        bool is_cold_fall_through(CompileInfo* info, asDWORD* target);
+        void layout_blocks(CompileInfo* info);
+        bool apply_constant_fold(CompileInfo* info);
+        bool skip_null_check(CompileInfo* info);
+        bool skip_dead_store(CompileInfo* info);
+        bool is_stack_object(CompileInfo* info);
+        void check_null_pointer(CompileInfo* info, const a64::Gp& pointer);
+        void embed_safepoint_stubs(CompileInfo* info);
+        void find_list_constants(CompileInfo* info);
+        void embed_list_constants(CompileInfo* info);
+        asUINT copy_list_constants(CompileInfo* info, ListConstants& constants);
         void bind_label_if_required(CompileInfo* info);
 
         asUINT instruction_size(asEBCInstr instruction);
@@ -0,0 +1,40 @@
+// MIT License
+
+// Copyright (c) 2023 Programier (Vladyslav Reminskyi)
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#pragma once
+#include <asmjit/a64.h>
+#include <peephole.hpp>
+
+namespace JIT
+{
+    // stack_register is the register which holds the VM stack pointer
+    void run_peephole(asmjit::a64::Builder& builder, const asmjit::a64::Gp& stack_register,
+                      const PeepholeOptions& options, PeepholeStatistics& statistics);
+
+    // entries holds the labels of the JitEntry instructions, entries inside a cached loop are replaced by the label
+    // of a stub which loads the cached variables before it continues at the entry. The stubs of the polls inside a
+    // cached loop are replaced the same way by stubs which store the cached variables
+    void run_loop_registers(asmjit::a64::Builder& builder, const std::vector<LoopRegion>& loops,
+                            const LoopRegisters& registers, std::vector<asmjit::Label>& entries,
+                            std::vector<LoopPoll>& polls, PeepholeStatistics& statistics);
+}// namespace JIT
@@ -0,0 +1,159 @@
+// MIT License
+
+// Copyright (c) 2023 Programier (Vladyslav Reminskyi)
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#pragma once
+#include <angelscript.h>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace JIT
+{
+    // Analyses over the byte code of one function, run by the compilers before the emission. Their results replace
+    // single instructions, the code of every other instruction stays the same
+    struct AnalysisOptions {
+        // Constants stored in variables and in the value register are propagated forward. Arithmetic and compares
+        // on constants become stores of the result, conditional jumps on known values become unconditional jumps
+        // or are removed and the instructions which cannot be reached any more are not emitted
+        bool constant_folding = true;
+
+        // Null checks of pointers which passed an earlier check on every path or are addresses of variables and
+        // globals are not emitted
+        bool null_checks = true;
+
+        // Stores to temporary variables which are overwritten or never read before the function returns are not
+        // emitted. Every instruction which may return to the VM, call other code or raise an exception reads all
+        // variables, so the VM sees the same frame there
+        bool dead_stores = true;
+
+        // Objects of POD value types which are created by ALLOC and freed by FREE in the same block, with only
+        // instructions between them which cannot leave the code of the function, are placed into the native stack
+        // frame instead of the heap. The VM never sees the variable while it points into the frame
+        bool stack_objects = true;
+
+        // Record the result of every function, see analysis_reports() of the compilers
+        bool log = false;
+    };
+
+    struct AnalysisStatistics {
+        size_t folded_instructions = 0;
+        size_t folded_jumps        = 0;
+        size_t dead_instructions   = 0;
+        size_t removed_null_checks = 0;
+        size_t removed_stores      = 0;
+        size_t stack_objects       = 0;
+    };
+
+    struct AnalysisReport {
+        std::string function;
+        size_t removed_null_checks;
+        size_t removed_stores;
+        size_t stack_objects;
+    };
+
+    // Basic block of the byte code, begin and end are the addresses of the first instruction and of the instruction
+    // after the block. Blocks start at the first instruction, at jump targets, after jumps and RET and at every
+    // JitEntry, because the VM enters the code there
+    struct BasicBlock {
+        asDWORD* begin;
+        asDWORD* end;
+        std::vector<size_t> successors;
+        std::vector<size_t> predecessors;
+    };
+
+    class ByteCodeGraph
+    {
+    private:
+        std::vector<BasicBlock> _M_blocks;
+
+    public:
+        ByteCodeGraph(asDWORD* begin, asDWORD* end);
+
+        const std::vector<BasicBlock>& blocks() const;
+
+        // Index of the block which starts at address, blocks().size() if no block starts there
+        size_t block_at(asDWORD* address) const;
+
+        // Blocks where the VM starts the execution: the first block and the JitEntry blocks which no path of the
+        // byte code reaches, like the code of a catch block
+        std::vector<size_t> entries() const;
+    };
+
+    // Objects which live in the native stack frame, all of them share one slot of size bytes, a multiple of 16.
+    // The flags are set at their ALLOC and FREE instructions and at the JitEntry which follows the ALLOC, the
+    // compilers do not enter the code at this JitEntry
+    struct StackObjects {
+        std::vector<bool> instructions;
+        asUINT size = 0;
+    };
+
+    // What the compilers emit instead of one instruction
+    struct ConstantFold {
+        enum class Action : asBYTE
+        {
+            // The instruction is emitted as usual
+            None,
+
+            // The instruction is never executed, only the labels and the JitEntry instructions are kept
+            Dead,
+
+            // The result is known, value is stored into variable, size is 4 or 8 bytes
+            SetVariable,
+
+            // The low dword of the value register is set to value
+            SetValue,
+
+            // The conditional jump is always taken
+            Jump,
+
+            // The conditional jump is never taken
+            Skip,
+        };
+
+        Action action  = Action::None;
+        asBYTE size    = 0;
+        short variable = 0;
+        asQWORD value  = 0;
+    };
+
+    // Number of the leading word arguments which are variable offsets
+    asUINT variable_arguments(asEBCType type);
+
+    // Returns one entry for every dword of the byte code, indexed by the offset of the instruction, or an empty
+    // vector if nothing can be folded. With suspend_exits every SUSPEND may return to the VM, where a line callback
+    // can change the variables, so nothing is known at the JitEntry after it
+    std::vector<ConstantFold> propagate_constants(asDWORD* begin, asDWORD* end, bool suspend_exits);
+
+    // Returns one flag for every dword of the byte code, set at the instructions whose null check can be omitted,
+    // or an empty vector if every check is needed. The object pointer of a method stays valid after its first check
+    std::vector<bool> find_redundant_null_checks(asDWORD* begin, asDWORD* end, bool suspend_exits, bool is_method);
+
+    // Returns one flag for every dword of the byte code, set at the SetV, CpyVtoV and CpyRtoV instructions whose
+    // variable is not read any more, or an empty vector if no store is dead
+    std::vector<bool> find_dead_stores(asDWORD* begin, asDWORD* end, bool suspend_exits);
+
+    // Finds the objects which never escape from the block which creates them: the variable is only used by
+    // LoadRObjR and ChkNullV between the ALLOC and the FREE and no instruction between them returns to the VM,
+    // calls other code or raises an exception. The instructions are empty if no object qualifies
+    StackObjects find_stack_objects(asDWORD* begin, asDWORD* end);
+}// namespace JIT
@@ -0,0 +1,219 @@
+// MIT License
+
+// Copyright (c) 2023 Programier (Vladyslav Reminskyi)
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#pragma once
+#include <angelscript.h>
+#include <asmjit/core.h>
+#include <list>
+#include <cstddef>
+#include <memory>
+#include <safepoint.hpp>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+namespace JIT
+{
+    using namespace asmjit;
+
+    // Executable memory for the compiled functions.
+    // In shared mode every function is allocated from one JitAllocator, like JitRuntime::add does.
+    // In per module mode every asIScriptModule gets its own allocator, so the code of one module is packed into
+    // a few contiguous blocks, optionally backed by large pages. The blocks are released in bulk when the last
+    // function of the module is released.
+    //
+    // With a budget the compiled code counts its entries into a Usage record. When the code exceeds the budget,
+    // a clock sweep after every added function marks the least recently entered functions as candidates. Other
+    // threads may run the VM meanwhile, so nothing is written to the byte code then. collect(), which the host
+    // calls while no context executes, resets the JitEntry instructions of the candidates, so the VM interprets
+    // them, and frees their code.
+    //
+    // With deduplication a function whose code and relocations are identical to an already added function shares
+    // its code. Functions with runtime data embed its address and are never shared.
+    // The arena is not thread safe, JitContext guards it with a mutex.
+    class CodeArena
+    {
+    public:
+        enum class Mode
+        {
+            Shared,
+            PerModule,
+        };
+
+        struct Options {
+            Mode mode        = Mode::Shared;
+            bool large_pages = false;
+
+            // Size of one block of a module arena, 0 means the default of the allocator.
+            // With large pages the block size is aligned to the large page size
+            uint32_t block_size = 256 * 1024;
+
+            // Maximum bytes of compiled code, 0 disables the usage tracking and the eviction.
+            // Only functions compiled while a budget is set can be evicted
+            size_t budget = 0;
+
+            bool deduplicate = false;
+        };
+
+        // Updated by the compiled code, active is the number of threads executing the function
+        struct Usage {
+            uint32_t active     = 0;
+            uint32_t referenced = 1;
+        };
+
+        // Writable memory referenced by the code of one function, for example inline caches.
+        // It is released together with the code
+        class RuntimeData
+        {
+        private:
+            std::vector<std::unique_ptr<std::max_align_t[]>> _M_blocks;
+
+        public:
+            std::unique_ptr<Usage> usage;
+            SafepointTable safepoints;
+
+            template<typename T>
+            T* allocate()
+            {
+                static_assert(std::is_trivially_destructible_v<T> && alignof(T) <= alignof(std::max_align_t));
+                size_t count = (sizeof(T) + sizeof(std::max_align_t) - 1) / sizeof(std::max_align_t);
+                auto& block  = _M_blocks.emplace_back(new std::max_align_t[count]);
+                return new (block.get()) T();
+            }
+
+            // Array of count value initialised elements
+            template<typename T>
+            T* allocate(size_t count)
+            {
+                static_assert(std::is_trivially_destructible_v<T> && alignof(T) <= alignof(std::max_align_t));
+                size_t blocks = (sizeof(T) * count + sizeof(std::max_align_t) - 1) / sizeof(std::max_align_t);
+                auto& block   = _M_blocks.emplace_back(new std::max_align_t[blocks]);
+                T* result     = reinterpret_cast<T*>(block.get());
+                std::uninitialized_value_construct_n(result, count);
+                return result;
+            }
+
+            bool empty() const
+            {
+                return usage == nullptr && _M_blocks.empty() && safepoints.empty();
+            }
+        };
+
+        struct Statistics {
+            size_t arenas         = 0;
+            size_t functions      = 0;
+            size_t used_bytes     = 0;
+            size_t reserved_bytes = 0;
+            size_t blocks         = 0;
+
+            size_t code_bytes    = 0;
+            size_t pending_bytes = 0;
+            size_t evictions     = 0;
+            size_t reclaimed     = 0;
+            size_t shared        = 0;
+        };
+
+    private:
+        struct Arena {
+            std::unique_ptr<JitAllocator> allocator;
+            asIScriptModule* module = nullptr;
+            size_t functions        = 0;
+        };
+
+        enum class State
+        {
+            Live,
+            Candidate,
+            Disabled,
+            Evicted,
+        };
+
+        struct Function {
+            Arena* arena                = nullptr;
+            asIScriptFunction* function = nullptr;
+            size_t size                 = 0;
+            size_t references           = 1;
+            size_t hash                 = 0;
+            State state                 = State::Live;
+
+            Usage* usage = nullptr;
+            std::unique_ptr<RuntimeData> data;
+            std::list<void*>::iterator clock;
+
+            // Code before relocation and the relocations, only kept with deduplication
+            std::vector<uint8_t> image;
+        };
+
+        Options _M_options;
+        Arena _M_shared;
+
+        std::unordered_map<asIScriptModule*, Arena*> _M_modules;
+        std::unordered_map<void*, Function> _M_functions;
+
+        std::unordered_multimap<size_t, void*> _M_images;
+
+        // Functions which can be evicted, in the order of compilation
+        std::list<void*> _M_clock;
+        std::list<void*>::iterator _M_clock_hand;
+
+        size_t _M_code_bytes    = 0;
+        size_t _M_pending_bytes = 0;
+        size_t _M_evictions     = 0;
+        size_t _M_reclaimed     = 0;
+        size_t _M_shared_count  = 0;
+
+        Arena* arena_for(asIScriptModule* module);
+        void release_arena(Arena* arena);
+        void forget(Function& function);
+        void* find_image(const std::vector<uint8_t>& image, size_t hash);
+
+        void evict();
+        void reclaim();
+        void disable(Function& function);
+
+    public:
+        CodeArena();
+        CodeArena(const CodeArena&)            = delete;
+        CodeArena& operator=(const CodeArena&) = delete;
+        ~CodeArena();
+
+        // Only affects functions compiled after the call
+        void options(const Options& options);
+        const Options& options() const;
+
+        // The runtime data has a usage record if a budget is set, the compiler must emit the entry and exit counters
+        // for it
+        std::unique_ptr<RuntimeData> create_runtime_data() const;
+
+        Error add(asIScriptFunction* function, CodeHolder* code, void** output,
+                  std::unique_ptr<RuntimeData> data = nullptr);
+        void release(void* code);
+
+        // The clock sweep after every added function only marks candidates. collect() resets the JitEntry
+        // instructions of the candidates and frees their code, it must only be called while no context is
+        // executing, for example between the frames of the host or after a module was discarded
+        void collect();
+
+        Statistics statistics() const;
+    };
+}// namespace JIT
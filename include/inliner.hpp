@@ -0,0 +1,74 @@
+// MIT License
+
+// Copyright (c) 2023 Programier (Vladyslav Reminskyi)
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#pragma once
+#include <angelscript.h>
+#include <string>
+
+namespace JIT
+{
+    // Script functions called with CALL, or with CALLINTF if the method cannot be overridden, are emitted in place
+    // of the call when they are small enough and every instruction is compiled without a way back to the VM. The
+    // callee gets its own frame on the native stack, so it never leaves the JIT code while its frame is active
+    struct InlineOptions {
+        bool enabled = true;
+
+        // Largest callee in byte code dwords
+        asUINT max_callee_size = 64;
+
+        // Byte code dwords which may be inlined into one function, bounds the growth of the code
+        asUINT max_growth = 512;
+
+        // Record every decision, see inline_decisions() of the compilers
+        bool log = false;
+    };
+
+    struct InlineDecision {
+        std::string caller;
+        std::string callee;
+        asUINT byte_code_offset;
+        const char* reason;
+
+        bool inlined() const
+        {
+            return reason == nullptr;
+        }
+    };
+
+    struct InlineCandidate {
+        asIScriptFunction* function;
+        asDWORD* begin;
+        asDWORD* end;
+        asUINT size;
+
+        // Bytes of the variables below the frame pointer and of the arguments above it
+        asUINT variables_size;
+        asUINT arguments_size;
+        bool has_this;
+    };
+
+    // Returns nullptr and fills candidate if the callee can be inlined into caller, otherwise the reason why not.
+    // budget is the number of byte code dwords which may still be inlined into the caller
+    const char* inline_candidate(asIScriptFunction* caller, asIScriptFunction* callee, const InlineOptions& options,
+                                 asUINT budget, InlineCandidate& candidate);
+}// namespace JIT
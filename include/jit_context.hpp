@@ -0,0 +1,61 @@
+// MIT License
+
+// Copyright (c) 2023 Programier (Vladyslav Reminskyi)
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#pragma once
+#include <code_arena.hpp>
+#include <mutex>
+
+namespace JIT
+{
+    // Runtime and code memory which can be shared by several compilers and engines, for example one engine per
+    // worker thread. All methods are thread safe.
+    class JitContext
+    {
+    private:
+        JitRuntime _M_runtime;
+        CodeArena _M_code;
+        mutable std::mutex _M_mutex;
+
+    public:
+        JitContext() = default;
+        JitContext(const CodeArena::Options& options);
+        JitContext(const JitContext&)            = delete;
+        JitContext& operator=(const JitContext&) = delete;
+
+        const Environment& environment() const;
+        const CpuFeatures& cpu_features() const;
+
+        void options(const CodeArena::Options& options);
+        CodeArena::Options options() const;
+
+        std::unique_ptr<CodeArena::RuntimeData> create_runtime_data() const;
+        Error add(asIScriptFunction* function, CodeHolder* code, void** output,
+                  std::unique_ptr<CodeArena::RuntimeData> data = nullptr);
+        void release(void* code);
+
+        // Frees the code of evicted functions, only call it while no context is executing, see CodeArena::collect
+        void collect();
+
+        CodeArena::Statistics statistics() const;
+    };
+}// namespace JIT
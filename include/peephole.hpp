@@ -0,0 +1,96 @@
+// MIT License
+
+// Copyright (c) 2023 Programier (Vladyslav Reminskyi)
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#pragma once
+#include <asmjit/core.h>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace JIT
+{
+    // Passes over the node list of the builder, run after all instructions were emitted and before the code is
+    // serialised. Every pass only looks at straight line code, labels, calls and unknown instructions end the
+    // knowledge collected so far.
+    struct PeepholeOptions {
+        // A load from a slot which was stored from or loaded into a register before is replaced by a move from
+        // that register or removed
+        bool load_forwarding = true;
+
+        // Moves of a register to itself and stores of the value which the slot already holds are removed
+        bool redundant_moves = true;
+
+        // Adjacent adjustments of the VM stack pointer are merged into one
+        bool stack_folding = true;
+
+        // Variables and read only globals of innermost loops are kept in free registers. They are loaded before the
+        // loop and at every JitEntry inside it, written back at the exits of the loop, before calls and before the
+        // code returns to the VM
+        bool loop_registers = true;
+    };
+
+    // Number of instructions removed or rewritten by every pass
+    struct PeepholeStatistics {
+        size_t forwarded_loads = 0;
+        size_t removed_moves   = 0;
+        size_t folded_stack    = 0;
+
+        size_t cached_loops      = 0;
+        size_t cached_variables  = 0;
+        size_t replaced_accesses = 0;
+
+        PeepholeStatistics& operator+=(const PeepholeStatistics& other)
+        {
+            forwarded_loads += other.forwarded_loads;
+            removed_moves += other.removed_moves;
+            folded_stack += other.folded_stack;
+            cached_loops += other.cached_loops;
+            cached_variables += other.cached_variables;
+            replaced_accesses += other.replaced_accesses;
+            return *this;
+        }
+    };
+
+    // Innermost loop of the byte code, header is the label of its first instruction and back_edge the node of the
+    // last jump back to it
+    struct LoopRegion {
+        asmjit::Label header;
+        asmjit::BaseNode* back_edge;
+    };
+
+    // Ids of the registers which the loop pass must know about. cache holds the registers which may keep variables,
+    // the pass only uses those which no instruction of the loop touches
+    struct LoopRegisters {
+        uint32_t frame;
+        uint32_t stack;
+        uint32_t vm_registers;
+        std::vector<uint32_t> cache;
+    };
+
+    // Poll of a safepoint and its stub, where the signal handler continues the code. A poll inside a cached loop gets
+    // a new stub which stores the cached variables before it continues at the old one
+    struct LoopPoll {
+        asmjit::Label poll;
+        asmjit::Label stub;
+    };
+}// namespace JIT
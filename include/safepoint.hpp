@@ -0,0 +1,73 @@
+// MIT License
+
+// Copyright (c) 2023 Programier (Vladyslav Reminskyi)
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace JIT
+{
+    // Guard page polled by the code compiled with SuspendMode::Trap. A poll is a single load from the page,
+    // request_stop() makes the page unreadable, so the next poll faults and the signal handler moves the thread
+    // to the exit stub of the poll, which returns to the VM at the SUSPEND instruction.
+    //
+    // The page is shared by all threads. A host stops a script with asIScriptContext::Suspend or Abort followed by
+    // request_stop(), and calls resume() when the context returned. Until then every other thread executing JIT
+    // code passes through the VM at each poll, which is slower but correct.
+    // Only implemented on Linux and macOS, on other systems install_handler() returns false.
+    class Safepoint
+    {
+    public:
+        static bool install_handler();
+        static const void* page();
+
+        static bool request_stop();
+        static bool resume();
+    };
+
+    // Poll sites of one compiled function. The offsets are recorded before the code is added, install() registers
+    // the absolute addresses for the signal handler, they are unregistered by clear() or the destructor
+    class SafepointTable
+    {
+    private:
+        std::vector<std::pair<size_t, size_t>> _M_offsets;
+        std::vector<std::pair<uintptr_t, uintptr_t>> _M_installed;
+
+    public:
+        SafepointTable() = default;
+        SafepointTable(const SafepointTable&)            = delete;
+        SafepointTable& operator=(const SafepointTable&) = delete;
+        ~SafepointTable();
+
+        void record(size_t poll_offset, size_t stub_offset);
+        void install(void* code);
+        void clear();
+
+        bool empty() const
+        {
+            return _M_offsets.empty();
+        }
+    };
+}// namespace JIT
@@ -0,0 +1,146 @@
+// MIT License
+
+// Copyright (c) 2023 Programier (Vladyslav Reminskyi)
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#pragma once
+#include <angelscript.h>
+#include <code_arena.hpp>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace JIT
+{
+    // Speculative second tier. The first tier counts the entries of every function and records the types of the
+    // objects at the CALLINTF instructions and the function pointers at the CallPtr instructions. tier_up() of the
+    // compilers compiles the functions which became hot again: a call site which only saw objects of one type or one
+    // script function becomes a check of the type or pointer followed by the inlined function. The check is a guard,
+    // if it fails the code returns to the VM at the call and the VM executes it, so a wrong speculation only costs
+    // time. After max_guard_failures failures of one guard the second tier is invalidated and the function runs in
+    // the first tier again
+    // With a code budget both tiers count as one function in the usage of the first tier, so the first tier is only
+    // evicted while neither tier runs. The second tier is only entered through the first one
+    struct TierOptions {
+        bool enabled = false;
+
+        // Entries of a function before tier_up() compiles the second tier
+        asUINT hot_entries = 1000;
+
+        // Calls of a site with the same type before the call is speculated
+        asUINT min_calls = 16;
+
+        asUINT max_guard_failures = 16;
+
+        // Executions of a conditional jump before its profile decides the layout, the block which follows a jump is
+        // moved behind the function if the jump is taken cold_ratio times as often as not
+        asUINT min_branches = 64;
+        asUINT cold_ratio   = 16;
+    };
+
+    // Referenced by the code of the first tier, which continues in optimized if it is set
+    struct TierState {
+        void* optimized      = nullptr;
+        asUINT entries       = 0;
+        asUINT invalidations = 0;
+    };
+
+    // Types of the objects of one CALLINTF or functions of one CallPtr, other counts the calls with another type or
+    // function than the first one
+    struct CallProfile {
+        asITypeInfo* type           = nullptr;
+        asIScriptFunction* function = nullptr;
+        asUINT calls                = 0;
+        asUINT other                = 0;
+    };
+
+    // Edges of one conditional jump
+    struct BranchProfile {
+        asUINT executions   = 0;
+        asUINT fall_through = 0;
+
+        asUINT taken() const
+        {
+            return executions - fall_through;
+        }
+    };
+
+    // Speculated call of the second tier, the code returns to the VM at byte_code_offset if the object is not of type
+    // or the function pointer is not function
+    struct Guard {
+        asITypeInfo* type           = nullptr;
+        asIScriptFunction* function = nullptr;
+        asUINT byte_code_offset     = 0;
+        asUINT failures             = 0;
+    };
+
+    // The first tier of one function and its profile, the records live in the runtime data of the first tier
+    struct TierProfile {
+        asIScriptFunction* function = nullptr;
+        TierState* state            = nullptr;
+        void* optimized             = nullptr;
+
+        // Usage of the first tier for the code budget, null without a budget
+        CodeArena::Usage* usage = nullptr;
+
+        // Indexed by the offset of the CALLINTF, the CallPtr or the conditional jump in dwords
+        std::map<asUINT, CallProfile*> calls;
+        std::map<asUINT, BranchProfile*> branches;
+        std::vector<const Guard*> guards;
+
+        const CallProfile* call(asUINT offset) const;
+        const BranchProfile* branch(asUINT offset) const;
+    };
+
+    // Branch profiles which outlive the code, indexed by the module and the declaration of the function, so the
+    // profile of one run can lay out the code of the next one. The file has one line per conditional jump with the
+    // module, the declaration, the offset in dwords, the executions and the fall throughs separated by tabs
+    class BranchProfiles
+    {
+    public:
+        using Function = std::map<asUINT, BranchProfile>;
+
+    private:
+        std::map<std::string, Function> _M_functions;
+
+        static std::string key(asIScriptFunction* function);
+
+    public:
+        void record(asIScriptFunction* function, asUINT offset, const BranchProfile& profile);
+        const Function* find(asIScriptFunction* function) const;
+
+        bool save(const char* path) const;
+        bool load(const char* path);
+
+        size_t size() const;
+        void clear();
+    };
+
+    struct TierReport {
+        asIScriptFunction* function;
+        asUINT entries;
+        asUINT invalidations;
+        bool optimized;
+        std::vector<Guard> guards;
+    };
+
+    // The method of type which is called for the interface or virtual method, nullptr if type has none
+    asIScriptFunction* find_implementation(asITypeInfo* type, asIScriptFunction* method);
+}// namespace JIT
@@ -0,0 +1,1062 @@
+// MIT License
+
+// Copyright (c) 2023 Programier (Vladyslav Reminskyi)
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <algorithm>
+#include <arm64/peephole.hpp>
+#include <vector>
+
+namespace JIT
+{
+    using namespace asmjit;
+
+    class ARM64_Peephole
+    {
+    private:
+        // The low size bytes of the register hold the value of the memory operand
+        struct Fact {
+            a64::Mem mem;
+            uint32_t size;
+            uint32_t reg;
+        };
+
+        a64::Builder& _M_builder;
+        a64::Gp _M_stack;
+        const PeepholeOptions& _M_options;
+        PeepholeStatistics& _M_statistics;
+        std::vector<Fact> _M_facts;
+
+        // The native frame (sp) and the memory of the VM never overlap. The frame of an inlined callee lies on the
+        // native stack, but sp is adjusted around it, which drops the facts about the native frame. The objects in
+        // the slot of the native frame are only accessed through pointers, never relative to sp
+        static bool is_frame(const a64::Mem& mem)
+        {
+            return mem.hasBaseReg() && mem.baseId() == a64::Gp::kIdSp;
+        }
+
+        static bool may_alias(const a64::Mem& a, uint32_t a_size, const a64::Mem& b, uint32_t b_size)
+        {
+            if (!a.hasBaseReg() || !b.hasBaseReg() || a.hasIndex() || b.hasIndex())
+                return true;
+            if (is_frame(a) != is_frame(b))
+                return false;
+            if (a.baseId() != b.baseId())
+                return true;
+            return a.offset() < b.offset() + b_size && b.offset() < a.offset() + a_size;
+        }
+
+        static bool uses_register(const a64::Mem& mem, uint32_t reg)
+        {
+            return (mem.hasBaseReg() && mem.baseId() == reg) || (mem.hasIndexReg() && mem.indexId() == reg);
+        }
+
+        // Loads and stores of a general purpose register at a fixed offset
+        static bool is_load_or_store(const InstNode* inst)
+        {
+            return (inst->id() == a64::Inst::kIdLdr || inst->id() == a64::Inst::kIdStr) && inst->opCount() == 2 &&
+                   inst->op(0).isReg() && inst->op(0).as<BaseReg>().isGp() && inst->op(1).isMem() &&
+                   inst->op(1).as<a64::Mem>().isFixedOffset();
+        }
+
+        static bool is_stack_adjustment(const InstNode* inst, const a64::Gp& stack)
+        {
+            return (inst->id() == a64::Inst::kIdAdd || inst->id() == a64::Inst::kIdSub) && inst->opCount() == 3 &&
+                   inst->op(0).isReg() && inst->op(0).id() == stack.id() && inst->op(1).isReg() &&
+                   inst->op(1).id() == stack.id() && inst->op(2).isImm();
+        }
+
+        static int64_t stack_adjustment(const InstNode* inst)
+        {
+            int64_t value = inst->op(2).as<Imm>().value();
+            return inst->id() == a64::Inst::kIdAdd ? value : -value;
+        }
+
+        const Fact* find(const a64::Mem& mem, uint32_t size) const
+        {
+            for (const Fact& fact : _M_facts)
+            {
+                if (fact.size == size && fact.mem.equals(mem))
+                    return &fact;
+            }
+            return nullptr;
+        }
+
+        void forget_register(uint32_t reg)
+        {
+            std::erase_if(_M_facts,
+                          [reg](const Fact& fact) { return fact.reg == reg || uses_register(fact.mem, reg); });
+        }
+
+        void forget_memory(const a64::Mem& mem, uint32_t size)
+        {
+            std::erase_if(_M_facts,
+                          [&mem, size](const Fact& fact) { return may_alias(fact.mem, fact.size, mem, size); });
+        }
+
+        void remember(const a64::Mem& mem, const a64::Gp& reg)
+        {
+            if (!uses_register(mem, reg.id()))
+                _M_facts.push_back({mem, reg.size(), reg.id()});
+        }
+
+        // Merges the following adjustments of the VM stack pointer into this one, add and sub do not set flags.
+        // Returns false if the adjustments cancel each other out
+        bool fold_stack(InstNode* inst)
+        {
+            int64_t value  = stack_adjustment(inst);
+            BaseNode* next = inst->next();
+
+            while (next && next->isInst() && is_stack_adjustment(next->as<InstNode>(), _M_stack))
+            {
+                int64_t folded = value + stack_adjustment(next->as<InstNode>());
+                if (folded > 4095 || folded < -4095)
+                    break;
+
+                value               = folded;
+                BaseNode* following = next->next();
+                _M_builder.removeNode(next);
+                _M_statistics.folded_stack += 1;
+                next = following;
+            }
+
+            if (value == 0)
+                return false;
+
+            inst->setId(value > 0 ? a64::Inst::kIdAdd : a64::Inst::kIdSub);
+            inst->setOp(2, Imm(value > 0 ? value : -value));
+            return true;
+        }
+
+        void visit_mov(InstNode* inst)
+        {
+            const Operand& destination = inst->op(0);
+            const Operand& source      = inst->op(1);
+
+            if (_M_options.redundant_moves && destination.isReg() && source.isReg() &&
+                destination.id() == source.id() && destination.as<a64::Gp>().isGpX() && source.as<a64::Gp>().isGpX())
+            {
+                _M_builder.removeNode(inst);
+                _M_statistics.removed_moves += 1;
+                return;
+            }
+
+            visit_other(inst);
+        }
+
+        void visit_load(InstNode* inst)
+        {
+            a64::Gp reg  = inst->op(0).as<a64::Gp>();
+            a64::Mem mem = inst->op(1).as<a64::Mem>();
+
+            if (_M_options.load_forwarding)
+            {
+                if (const Fact* fact = find(mem, reg.size()))
+                {
+                    _M_statistics.forwarded_loads += 1;
+                    if (fact->reg == reg.id())
+                    {
+                        _M_builder.removeNode(inst);
+                        return;
+                    }
+
+                    inst->setId(a64::Inst::kIdMov);
+                    inst->setOp(1, a64::Gp::fromTypeAndId(reg.type(), fact->reg));
+                }
+            }
+
+            forget_register(reg.id());
+            remember(mem, reg);
+        }
+
+        void visit_store(InstNode* inst)
+        {
+            a64::Gp reg  = inst->op(0).as<a64::Gp>();
+            a64::Mem mem = inst->op(1).as<a64::Mem>();
+
+            const Fact* fact = find(mem, reg.size());
+            if (fact && fact->reg == reg.id() && _M_options.redundant_moves)
+            {
+                _M_builder.removeNode(inst);
+                _M_statistics.removed_moves += 1;
+                return;
+            }
+
+            forget_memory(mem, reg.size());
+            remember(mem, reg);
+        }
+
+        void visit_other(InstNode* inst)
+        {
+            // Conditional branches carry the condition code in the instruction id
+            switch (BaseInst::extractRealId(inst->id()))
+            {
+                // Branches write nothing, a branch target is a label which ends the block anyway
+                case a64::Inst::kIdB:
+                case a64::Inst::kIdCbz:
+                case a64::Inst::kIdCbnz:
+                case a64::Inst::kIdTbz:
+                case a64::Inst::kIdTbnz:
+                    return;
+
+                case a64::Inst::kIdBl:
+                case a64::Inst::kIdBlr:
+                case a64::Inst::kIdBr:
+                case a64::Inst::kIdRet:
+                    _M_facts.clear();
+                    return;
+
+                default:
+                    break;
+            }
+
+            InstRWInfo rw;
+            if (InstAPI::queryRWInfo(_M_builder.arch(), inst->baseInst(), inst->operands(), inst->opCount(), &rw) !=
+                kErrorOk)
+            {
+                _M_facts.clear();
+                return;
+            }
+
+            for (uint32_t index = 0; index < inst->opCount(); index++)
+            {
+                const Operand& operand = inst->op(index);
+                const OpRWInfo& info   = rw.operand(index);
+
+                if (operand.isReg() && info.isWrite() && operand.as<BaseReg>().isGp())
+                {
+                    forget_register(operand.id());
+                }
+                else if (operand.isMem())
+                {
+                    const a64::Mem& mem = operand.as<a64::Mem>();
+                    if (info.isWrite())
+                        forget_memory(mem, 16);
+                    // Pre and post indexed addressing writes the base register
+                    if ((info.isMemBaseWrite() || info.isMemIndexWrite()) && mem.hasBaseReg())
+                        forget_register(mem.baseId());
+                }
+            }
+        }
+
+    public:
+        ARM64_Peephole(a64::Builder& builder, const a64::Gp& stack, const PeepholeOptions& options,
+                       PeepholeStatistics& statistics)
+            : _M_builder(builder), _M_stack(stack), _M_options(options), _M_statistics(statistics)
+        {}
+
+        void run()
+        {
+            BaseNode* node = _M_builder.firstNode();
+            while (node)
+            {
+                if (!node->isInst())
+                {
+                    _M_facts.clear();
+                    node = node->next();
+                    continue;
+                }
+
+                InstNode* inst = node->as<InstNode>();
+                if (_M_options.stack_folding && is_stack_adjustment(inst, _M_stack) && !fold_stack(inst))
+                {
+                    node = node->next();
+                    _M_builder.removeNode(inst);
+                    _M_statistics.folded_stack += 1;
+                    continue;
+                }
+
+                // The node can be removed by the visitors, the next node must be read before
+                node = node->next();
+
+                if (is_load_or_store(inst))
+                {
+                    if (inst->id() == a64::Inst::kIdLdr)
+                        visit_load(inst);
+                    else
+                        visit_store(inst);
+                }
+                else if (inst->id() == a64::Inst::kIdMov && inst->opCount() == 2)
+                {
+                    visit_mov(inst);
+                }
+                else
+                {
+                    visit_other(inst);
+                }
+            }
+        }
+    };
+
+    // Branches to a label, the label is the last operand
+    static bool is_jump(const InstNode* inst)
+    {
+        switch (BaseInst::extractRealId(inst->id()))
+        {
+            case a64::Inst::kIdB:
+            case a64::Inst::kIdCbz:
+            case a64::Inst::kIdCbnz:
+            case a64::Inst::kIdTbz:
+            case a64::Inst::kIdTbnz:
+                return true;
+
+            default:
+                return false;
+        }
+    }
+
+    class ARM64_LoopRegisters
+    {
+    private:
+        static constexpr inline uint32_t no_register = 0xFFFFFFFF;
+
+        // Variable of the VM frame, the address is the offset from the frame pointer, or global variable with an
+        // absolute address. The address of a global can also be loaded from literal, a slot of the literal pool,
+        // then address is the offset from the loaded address
+        struct Variable {
+            bool global;
+            int64_t address;
+            uint32_t size;
+            a64::Mem literal;
+            uint32_t accesses   = 0;
+            uint32_t replacable = 0;
+            bool written        = false;
+            bool cacheable      = true;
+            uint32_t reg        = no_register;
+        };
+
+        // Load or store of a variable. address is the mov or the literal load of the address of a global, it is
+        // removed together with the access
+        struct Access {
+            InstNode* inst;
+            size_t variable;
+            InstNode* address;
+        };
+
+        struct Loop {
+            LabelNode* header;
+            InstNode* back_edge;
+
+            std::vector<Variable> variables;
+            std::vector<Access> accesses;
+
+            std::vector<InstNode*> outer_jumps;
+            std::vector<InstNode*> exits;
+            std::vector<InstNode*> leaves;
+            std::vector<InstNode*> reloads;
+            std::vector<size_t> entries;
+            std::vector<size_t> polls;
+
+            uint64_t used_registers = 0;
+            bool has_call           = false;
+            bool unknown_read       = false;
+            bool unknown_write      = false;
+        };
+
+        a64::Builder& _M_builder;
+        const LoopRegisters& _M_registers;
+        std::vector<Label>& _M_entries;
+        std::vector<LoopPoll>& _M_polls;
+        PeepholeStatistics& _M_statistics;
+        bool _M_frame_escapes = false;
+
+        static uint64_t register_bit(uint32_t id)
+        {
+            return id < 64 ? uint64_t(1) << id : 0;
+        }
+
+        static uint32_t label_of(const Operand& operand)
+        {
+            if (operand.isLabel())
+                return operand.id();
+            if (operand.isMem() && operand.as<a64::Mem>().hasBaseLabel())
+                return operand.as<a64::Mem>().baseId();
+            return Globals::kInvalidId;
+        }
+
+        static uint32_t real_id(const InstNode* inst)
+        {
+            return BaseInst::extractRealId(inst->id());
+        }
+
+        static bool is_address(const InstNode* inst)
+        {
+            if (inst->opCount() != 2 || !inst->op(0).isReg() || !inst->op(0).as<a64::Gp>().isGpX())
+                return false;
+
+            return (inst->id() == a64::Inst::kIdMov && inst->op(1).isImm()) ||
+                   (inst->id() == a64::Inst::kIdLdr && inst->op(1).isMem() &&
+                    inst->op(1).as<a64::Mem>().hasBaseLabel() && !inst->op(1).as<a64::Mem>().hasIndex());
+        }
+
+        static bool same_literal(const a64::Mem& a, const a64::Mem& b)
+        {
+            if (!a.hasBaseLabel() || !b.hasBaseLabel())
+                return a.hasBaseLabel() == b.hasBaseLabel();
+            return a.baseId() == b.baseId() && a.offset() == b.offset();
+        }
+
+        // Loads and stores of a whole variable, they become moves between the registers
+        static bool is_replaceable(const InstNode* inst, uint32_t size)
+        {
+            if (inst->opCount() != 2 || !inst->op(0).isReg() || !inst->op(1).isMem() ||
+                inst->op(1).as<a64::Mem>().isPreOrPost())
+                return false;
+
+            const a64::Reg& reg = inst->op(0).as<a64::Reg>();
+            switch (inst->id())
+            {
+                case a64::Inst::kIdLdr:
+                case a64::Inst::kIdStr:
+                    return reg.isGp() && reg.size() == size;
+
+                case a64::Inst::kIdLdr_v:
+                case a64::Inst::kIdStr_v:
+                    return (reg.isVecS() && size == 4) || (reg.isVecD() && size == 8);
+
+                default:
+                    return false;
+            }
+        }
+
+        // Size of the memory operand, the ARM operands do not store it
+        static uint32_t access_size(const InstNode* inst)
+        {
+            uint32_t id = inst->id();
+            if ((id == a64::Inst::kIdLdr || id == a64::Inst::kIdStr || id == a64::Inst::kIdLdr_v ||
+                 id == a64::Inst::kIdStr_v) &&
+                inst->opCount() == 2 && inst->op(0).isReg())
+                return inst->op(0).as<a64::Reg>().size();
+            return 0;
+        }
+
+        static a64::Gp register_of(const Variable& variable)
+        {
+            return variable.size == 4 ? a64::Gp(a64::GpW(variable.reg)) : a64::Gp(a64::GpX(variable.reg));
+        }
+
+        bool is_restore(const InstNode* inst) const
+        {
+            return inst->id() == a64::Inst::kIdLdr && inst->opCount() == 2 && inst->op(0).isReg() &&
+                   inst->op(0).id() == _M_registers.frame && inst->op(1).as<a64::Mem>().hasBaseReg() &&
+                   inst->op(1).as<a64::Mem>().baseId() == _M_registers.vm_registers;
+        }
+
+        // The address of a variable escapes if the frame pointer is read as a value, for example by add. The store
+        // of the frame pointer into the VM registers by save_registers does not count, calls write the variables
+        // back anyway
+        bool frame_escapes() const
+        {
+            for (BaseNode* node = _M_builder.firstNode(); node; node = node->next())
+            {
+                if (!node->isInst())
+                    continue;
+
+                const InstNode* inst = node->as<InstNode>();
+                if (inst->id() == a64::Inst::kIdStr && inst->opCount() == 2 && inst->op(0).id() == _M_registers.frame &&
+                    inst->op(1).as<a64::Mem>().hasBaseReg() &&
+                    inst->op(1).as<a64::Mem>().baseId() == _M_registers.vm_registers)
+                    continue;
+
+                InstRWInfo rw;
+                if (InstAPI::queryRWInfo(_M_builder.arch(), inst->baseInst(), inst->operands(), inst->opCount(), &rw) !=
+                    kErrorOk)
+                    return true;
+
+                for (uint32_t index = 0; index < inst->opCount(); index++)
+                {
+                    const Operand& operand = inst->op(index);
+                    if (operand.isReg() && operand.as<a64::Reg>().isGpX() && operand.id() == _M_registers.frame &&
+                        rw.operand(index).isRead())
+                        return true;
+                }
+            }
+            return false;
+        }
+
+        void use_registers(Loop& loop, const InstNode* inst)
+        {
+            for (uint32_t index = 0; index < inst->opCount(); index++)
+            {
+                const Operand& operand = inst->op(index);
+                if (operand.isReg() && operand.as<a64::Reg>().isGp())
+                {
+                    loop.used_registers |= register_bit(operand.id());
+                }
+                else if (operand.isMem())
+                {
+                    const a64::Mem& mem = operand.as<a64::Mem>();
+                    if (mem.hasBaseReg())
+                        loop.used_registers |= register_bit(mem.baseId());
+                    if (mem.hasIndexReg())
+                        loop.used_registers |= register_bit(mem.indexId());
+                }
+            }
+        }
+
+        void record(Loop& loop, bool global, int64_t address, InstNode* inst, bool write, InstNode* address_node)
+        {
+            uint32_t size = access_size(inst);
+            size_t index  = 0;
+
+            a64::Mem literal;
+            if (address_node && address_node->op(1).isMem())
+                literal = address_node->op(1).as<a64::Mem>();
+
+            while (index < loop.variables.size() &&
+                   (loop.variables[index].global != global || loop.variables[index].address != address ||
+                    loop.variables[index].size != size || !same_literal(loop.variables[index].literal, literal)))
+            {
+                index++;
+            }
+
+            if (index == loop.variables.size())
+                loop.variables.push_back({global, address, size, literal});
+
+            Variable& variable = loop.variables[index];
+            variable.accesses += 1;
+            variable.written = variable.written || write;
+
+            if (size != 4 && size != 8)
+                variable.cacheable = false;
+
+            if (global)
+            {
+                // Only loads which overwrite the address register can drop the mov, other reads stay in memory
+                if (write)
+                {
+                    variable.cacheable = false;
+                }
+                else if (inst->id() == a64::Inst::kIdLdr && is_replaceable(inst, size) &&
+                         inst->op(0).id() == address_node->op(0).id())
+                {
+                    variable.replacable += 1;
+                    loop.accesses.push_back({inst, index, address_node});
+                }
+            }
+            else if (is_replaceable(inst, size))
+            {
+                variable.replacable += 1;
+                loop.accesses.push_back({inst, index, nullptr});
+            }
+            else
+            {
+                variable.cacheable = false;
+            }
+        }
+
+        // Returns false if the instruction cannot be part of a cached loop. After a call the frame pointer is
+        // invalid until restore_registers loads it again, the variables are loaded after that instruction
+        bool scan(Loop& loop, InstNode* inst, bool& pending, InstNode*& address)
+        {
+            InstNode* previous = address;
+            address            = nullptr;
+            uint32_t id        = real_id(inst);
+
+            use_registers(loop, inst);
+
+            if (is_jump(inst))
+                return !pending && inst->opCount() > 0 && inst->op(inst->opCount() - 1).isLabel();
+
+            if (id == a64::Inst::kIdBl || id == a64::Inst::kIdBlr)
+            {
+                if (pending)
+                    return false;
+
+                loop.leaves.push_back(inst);
+                loop.has_call = true;
+                pending       = true;
+                return true;
+            }
+
+            if (id == a64::Inst::kIdRet)
+            {
+                if (pending)
+                    return false;
+
+                loop.leaves.push_back(inst);
+                return true;
+            }
+
+            if (id == a64::Inst::kIdBr)
+                return false;
+
+            if (is_restore(inst))
+            {
+                if (pending)
+                    loop.reloads.push_back(inst);
+                pending = false;
+                return true;
+            }
+
+            InstRWInfo rw;
+            if (InstAPI::queryRWInfo(_M_builder.arch(), inst->baseInst(), inst->operands(), inst->opCount(), &rw) !=
+                kErrorOk)
+                return false;
+
+            bool uses_frame = false;
+            for (uint32_t index = 0; index < inst->opCount(); index++)
+            {
+                const Operand& operand = inst->op(index);
+                if (operand.isReg() && operand.as<a64::Reg>().isGp() && operand.id() == _M_registers.frame)
+                {
+                    // Only restore_registers may write the frame pointer
+                    if (rw.operand(index).isWrite())
+                        return false;
+                    uses_frame = true;
+                }
+                else if (operand.isMem() && operand.as<a64::Mem>().hasBaseReg() &&
+                         operand.as<a64::Mem>().baseId() == _M_registers.frame)
+                {
+                    uses_frame = true;
+                }
+            }
+
+            if (pending && uses_frame)
+                return false;
+
+            for (uint32_t index = 0; index < inst->opCount(); index++)
+            {
+                if (!inst->op(index).isMem())
+                    continue;
+
+                const a64::Mem& mem  = inst->op(index).as<a64::Mem>();
+                const OpRWInfo& info = rw.operand(index);
+
+                if (mem.hasBaseLabel())
+                    continue;
+
+                if (mem.hasBaseReg() && mem.baseId() == _M_registers.frame)
+                {
+                    if (mem.hasIndex() || mem.isPreOrPost())
+                        return false;
+                    record(loop, false, mem.offset(), inst, info.isWrite(), nullptr);
+                }
+                else if (mem.hasBaseReg() && !mem.hasIndex() && !mem.isPreOrPost() && previous &&
+                         previous->op(0).id() == mem.baseId())
+                {
+                    uint64_t value = previous->op(1).isImm() ? previous->op(1).as<Imm>().valueAs<uint64_t>() : 0;
+                    record(loop, true, static_cast<int64_t>(value) + mem.offset(), inst, info.isWrite(), previous);
+                }
+                else if (!mem.hasBaseReg() ||
+                         (mem.baseId() != _M_registers.stack && mem.baseId() != _M_registers.vm_registers &&
+                          mem.baseId() != a64::Gp::kIdSp && mem.baseId() != a64::Gp::kIdFp &&
+                          mem.baseId() != a64::Gp::kIdLr))
+                {
+                    loop.unknown_read  = loop.unknown_read || info.isRead();
+                    loop.unknown_write = loop.unknown_write || info.isWrite();
+                }
+            }
+
+            if (is_address(inst))
+                address = inst;
+            return true;
+        }
+
+        bool analyse(Loop& loop)
+        {
+            uint32_t label_count = static_cast<uint32_t>(_M_builder.code()->labelCount());
+            std::vector<uint8_t> inside(label_count, 0);
+            std::vector<uint8_t> entry(label_count, 0);
+            std::vector<uint8_t> poll(label_count, 0);
+            std::vector<uint32_t> references(label_count, 0);
+
+            BaseNode* node = loop.header;
+            for (; node && node != loop.back_edge; node = node->next())
+            {
+                if (node->isLabel() && node->as<LabelNode>()->labelId() < label_count)
+                    inside[node->as<LabelNode>()->labelId()] = 1;
+            }
+
+            if (node == nullptr)
+                return false;
+
+            for (const Label& label : _M_entries)
+            {
+                if (label.id() < label_count)
+                    entry[label.id()] = 1;
+            }
+
+            for (const LoopPoll& safepoint : _M_polls)
+            {
+                if (safepoint.poll.id() < label_count)
+                    poll[safepoint.poll.id()] = 1;
+            }
+
+            // Jumps into the loop must target the header, jumps out of it are exits
+            bool in_loop = false;
+            for (node = _M_builder.firstNode(); node; node = node->next())
+            {
+                if (node == loop.header)
+                    in_loop = true;
+
+                if (node->isInst())
+                {
+                    InstNode* inst = node->as<InstNode>();
+                    for (uint32_t index = 0; index < inst->opCount(); index++)
+                    {
+                        uint32_t id = label_of(inst->op(index));
+                        if (id >= label_count)
+                            continue;
+
+                        references[id] += 1;
+                        if (inside[id] && !in_loop)
+                        {
+                            if (id != loop.header->labelId() || !is_jump(inst))
+                                return false;
+                            loop.outer_jumps.push_back(inst);
+                        }
+                        else if (!inside[id] && in_loop && is_jump(inst))
+                        {
+                            loop.exits.push_back(inst);
+                        }
+                    }
+                }
+                else if (node->isEmbedLabel())
+                {
+                    uint32_t id = node->as<EmbedLabelNode>()->labelId();
+                    if (id < label_count && inside[id])
+                        return false;
+                }
+                else if (node->isEmbedLabelDelta())
+                {
+                    uint32_t id   = node->as<EmbedLabelDeltaNode>()->labelId();
+                    uint32_t base = node->as<EmbedLabelDeltaNode>()->baseLabelId();
+                    if ((id < label_count && inside[id]) || (base < label_count && inside[base]))
+                        return false;
+                }
+
+                if (node == loop.back_edge)
+                    in_loop = false;
+            }
+
+            // A label without references can only be entered by the VM through a JitEntry or mark a safepoint poll
+            for (uint32_t id = 0; id < label_count; id++)
+            {
+                if (inside[id] && references[id] == 0 && !entry[id] && !poll[id])
+                    return false;
+            }
+
+            for (size_t index = 0; index < _M_entries.size(); index++)
+            {
+                if (_M_entries[index].id() < label_count && inside[_M_entries[index].id()])
+                    loop.entries.push_back(index);
+            }
+
+            for (size_t index = 0; index < _M_polls.size(); index++)
+            {
+                if (_M_polls[index].poll.id() < label_count && inside[_M_polls[index].poll.id()])
+                    loop.polls.push_back(index);
+            }
+
+            bool pending      = false;
+            InstNode* address = nullptr;
+
+            for (node = loop.header;; node = node->next())
+            {
+                if (node->isLabel())
+                {
+                    if (pending)
+                        return false;
+                    address = nullptr;
+                }
+                else if (!node->isInst() || !scan(loop, node->as<InstNode>(), pending, address))
+                {
+                    return false;
+                }
+
+                if (node == loop.back_edge)
+                    break;
+            }
+
+            return !pending;
+        }
+
+        // Assigns the registers which no instruction of the loop uses, the most accessed variables first
+        size_t select(Loop& loop)
+        {
+            std::vector<Variable>& variables = loop.variables;
+
+            for (size_t first = 0; first < variables.size(); first++)
+            {
+                for (size_t second = first + 1; second < variables.size(); second++)
+                {
+                    Variable& a = variables[first];
+                    Variable& b = variables[second];
+
+                    int64_t a_end = a.address + (a.size ? a.size : 16);
+                    int64_t b_end = b.address + (b.size ? b.size : 16);
+                    if (a.global == b.global && same_literal(a.literal, b.literal) && a.address < b_end &&
+                        b.address < a_end)
+                        a.cacheable = b.cacheable = false;
+
+                    // Globals behind different literals or immediates can be the same memory
+                    if (a.global && b.global && !same_literal(a.literal, b.literal) && (a.written || b.written))
+                        a.cacheable = b.cacheable = false;
+                }
+            }
+
+            std::vector<size_t> order;
+            for (size_t index = 0; index < variables.size(); index++)
+            {
+                Variable& variable = variables[index];
+                if (variable.global && (loop.has_call || loop.unknown_write))
+                    variable.cacheable = false;
+                if (!variable.global && _M_frame_escapes && (loop.unknown_read || loop.unknown_write))
+                    variable.cacheable = false;
+
+                if (variable.cacheable && variable.replacable > 0)
+                    order.push_back(index);
+            }
+
+            std::stable_sort(order.begin(), order.end(), [&variables](size_t a, size_t b) {
+                return variables[a].replacable > variables[b].replacable;
+            });
+
+            size_t assigned = 0;
+            for (uint32_t reg : _M_registers.cache)
+            {
+                if (assigned == order.size())
+                    break;
+
+                if ((loop.used_registers & register_bit(reg)) == 0)
+                    variables[order[assigned++]].reg = reg;
+            }
+            return assigned;
+        }
+
+        void emit_loads(const Loop& loop)
+        {
+            a64::GpX frame(_M_registers.frame);
+            for (const Variable& variable : loop.variables)
+            {
+                if (variable.reg == no_register)
+                    continue;
+
+                if (variable.global && variable.literal.hasBaseLabel())
+                {
+                    _M_builder.ldr(a64::GpX(variable.reg), variable.literal);
+                    _M_builder.ldr(register_of(variable),
+                                   a64::ptr(a64::GpX(variable.reg), static_cast<int32_t>(variable.address)));
+                }
+                else if (variable.global)
+                {
+                    _M_builder.mov(a64::GpX(variable.reg), static_cast<uint64_t>(variable.address));
+                    _M_builder.ldr(register_of(variable), a64::ptr(a64::GpX(variable.reg)));
+                }
+                else
+                {
+                    _M_builder.ldr(register_of(variable), a64::ptr(frame, static_cast<int32_t>(variable.address)));
+                }
+            }
+        }
+
+        void emit_stores(const Loop& loop)
+        {
+            a64::GpX frame(_M_registers.frame);
+            for (const Variable& variable : loop.variables)
+            {
+                if (variable.reg != no_register && variable.written)
+                    _M_builder.str(register_of(variable), a64::ptr(frame, static_cast<int32_t>(variable.address)));
+            }
+        }
+
+        void replace(const Access& access, const Variable& variable)
+        {
+            InstNode* inst = access.inst;
+            Operand reg    = inst->op(0);
+
+            switch (inst->id())
+            {
+                case a64::Inst::kIdLdr:
+                    inst->setId(a64::Inst::kIdMov);
+                    inst->setOp(1, register_of(variable));
+                    break;
+
+                case a64::Inst::kIdStr:
+                    inst->setId(a64::Inst::kIdMov);
+                    inst->setOp(0, register_of(variable));
+                    inst->setOp(1, reg);
+                    break;
+
+                case a64::Inst::kIdLdr_v:
+                    inst->setId(a64::Inst::kIdFmov_v);
+                    inst->setOp(1, register_of(variable));
+                    break;
+
+                case a64::Inst::kIdStr_v:
+                    inst->setId(a64::Inst::kIdFmov_v);
+                    inst->setOp(0, register_of(variable));
+                    inst->setOp(1, reg);
+                    break;
+
+                default:
+                    break;
+            }
+        }
+
+        void rewrite(Loop& loop)
+        {
+            // Loads on the way into the loop, jumps from outside skip the loads of the fall through path otherwise
+            _M_builder.setCursor(loop.header->prev());
+            if (!loop.outer_jumps.empty())
+            {
+                Label preheader = _M_builder.newLabel();
+                _M_builder.bind(preheader);
+
+                for (InstNode* jump : loop.outer_jumps)
+                {
+                    jump->setOp(jump->opCount() - 1, preheader);
+                }
+            }
+            emit_loads(loop);
+
+            for (InstNode* leave : loop.leaves)
+            {
+                _M_builder.setCursor(leave->prev());
+                emit_stores(loop);
+            }
+
+            for (InstNode* reload : loop.reloads)
+            {
+                _M_builder.setCursor(reload);
+                emit_loads(loop);
+            }
+
+            // Exit and entry stubs follow the back edge, the fall through path of a conditional back edge skips them
+            _M_builder.setCursor(loop.back_edge);
+
+            bool falls_through = real_id(loop.back_edge) != a64::Inst::kIdB ||
+                                 BaseInst::extractARMCondCode(loop.back_edge->id()) != arm::CondCode::kAL;
+            Label skip;
+
+            if (falls_through)
+            {
+                emit_stores(loop);
+                if (!loop.exits.empty() || !loop.entries.empty() || !loop.polls.empty())
+                {
+                    skip = _M_builder.newLabel();
+                    _M_builder.b(skip);
+                }
+            }
+
+            std::vector<std::pair<uint32_t, Label>> stubs;
+            for (InstNode* exit : loop.exits)
+            {
+                uint32_t target = exit->op(exit->opCount() - 1).id();
+                auto stub       = std::find_if(stubs.begin(), stubs.end(),
+                                               [target](auto& entry) { return entry.first == target; });
+
+                if (stub == stubs.end())
+                {
+                    stubs.emplace_back(target, _M_builder.newLabel());
+                    stub = stubs.end() - 1;
+
+                    _M_builder.bind(stub->second);
+                    emit_stores(loop);
+                    _M_builder.b(Label(target));
+                }
+
+                exit->setOp(exit->opCount() - 1, stub->second);
+            }
+
+            for (size_t index : loop.entries)
+            {
+                Label stub = _M_builder.newLabel();
+                _M_builder.bind(stub);
+                emit_loads(loop);
+                _M_builder.b(_M_entries[index]);
+                _M_entries[index] = stub;
+            }
+
+            // The VM continues at the SUSPEND of a poll with the variables in the frame
+            for (size_t index : loop.polls)
+            {
+                Label stub = _M_builder.newLabel();
+                _M_builder.bind(stub);
+                emit_stores(loop);
+                _M_builder.b(_M_polls[index].stub);
+                _M_polls[index].stub = stub;
+            }
+
+            if (skip.isValid())
+                _M_builder.bind(skip);
+
+            for (Access& access : loop.accesses)
+            {
+                const Variable& variable = loop.variables[access.variable];
+                if (variable.reg == no_register)
+                    continue;
+
+                replace(access, variable);
+                if (access.address)
+                    _M_builder.removeNode(access.address);
+                _M_statistics.replaced_accesses += 1;
+            }
+        }
+
+    public:
+        ARM64_LoopRegisters(a64::Builder& builder, const LoopRegisters& registers, std::vector<Label>& entries,
+                            std::vector<LoopPoll>& polls, PeepholeStatistics& statistics)
+            : _M_builder(builder), _M_registers(registers), _M_entries(entries), _M_polls(polls),
+              _M_statistics(statistics)
+        {}
+
+        void run(const std::vector<LoopRegion>& regions)
+        {
+            _M_frame_escapes = frame_escapes();
+
+            for (const LoopRegion& region : regions)
+            {
+                Loop loop;
+                if (_M_builder.labelNodeOf(&loop.header, region.header) != kErrorOk || !region.back_edge ||
+                    !region.back_edge->isInst() || !is_jump(region.back_edge->as<InstNode>()))
+                    continue;
+
+                loop.back_edge = region.back_edge->as<InstNode>();
+                if (!analyse(loop))
+                    continue;
+
+                size_t cached = select(loop);
+                if (cached == 0)
+                    continue;
+
+                rewrite(loop);
+                _M_statistics.cached_loops += 1;
+                _M_statistics.cached_variables += cached;
+            }
+
+            _M_builder.setCursor(_M_builder.lastNode());
+        }
+    };
+
+    void run_peephole(a64::Builder& builder, const a64::Gp& stack_register, const PeepholeOptions& options,
+                      PeepholeStatistics& statistics)
+    {
+        ARM64_Peephole(builder, stack_register, options, statistics).run();
+    }
+
+    void run_loop_registers(a64::Builder& builder, const std::vector<LoopRegion>& loops, const LoopRegisters& registers,
+                            std::vector<Label>& entries, std::vector<LoopPoll>& polls, PeepholeStatistics& statistics)
+    {
+        ARM64_LoopRegisters(builder, registers, entries, polls, statistics).run(loops);
+    }
+}// namespace JIT
@@ -0,0 +1,1884 @@
+// MIT License
+
+// Copyright (c) 2023 Programier (Vladyslav Reminskyi)
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <algorithm>
+#include <bytecode_analysis.hpp>
+#include <climits>
+
+namespace JIT
+{
+    static asEBCInstr opcode_at(asDWORD* address)
+    {
+        return static_cast<asEBCInstr>(*reinterpret_cast<asBYTE*>(address));
+    }
+
+    static asUINT instruction_size(asEBCInstr instruction)
+    {
+        return asBCTypeSize[asBCInfo[instruction].type];
+    }
+
+    static short variable_at(asDWORD* address, asUINT index)
+    {
+        return *(reinterpret_cast<short*>(address) + index + 1);
+    }
+
+    static bool is_conditional_jump(asEBCInstr instruction)
+    {
+        switch (instruction)
+        {
+            case asBC_JZ:
+            case asBC_JNZ:
+            case asBC_JS:
+            case asBC_JNS:
+            case asBC_JP:
+            case asBC_JNP:
+            case asBC_JLowZ:
+            case asBC_JLowNZ:
+                return true;
+
+            default:
+                return false;
+        }
+    }
+
+    static asDWORD* jump_target(asDWORD* address)
+    {
+        return address + asBC_INTARG(address) + instruction_size(opcode_at(address));
+    }
+
+    asUINT variable_arguments(asEBCType type)
+    {
+        switch (type)
+        {
+            case asBCTYPE_wW_ARG:
+            case asBCTYPE_rW_ARG:
+            case asBCTYPE_rW_DW_ARG:
+            case asBCTYPE_wW_QW_ARG:
+            case asBCTYPE_wW_DW_ARG:
+            case asBCTYPE_rW_QW_ARG:
+            case asBCTYPE_wW_W_ARG:
+            case asBCTYPE_rW_W_DW_ARG:
+            case asBCTYPE_rW_DW_DW_ARG:
+                return 1;
+
+            case asBCTYPE_wW_rW_ARG:
+            case asBCTYPE_wW_rW_DW_ARG:
+            case asBCTYPE_rW_rW_ARG:
+                return 2;
+
+            case asBCTYPE_wW_rW_rW_ARG:
+                return 3;
+
+            default:
+                return 0;
+        }
+    }
+
+    // The first variable argument of these types is written by the instruction
+    static bool writes_variable(asEBCType type)
+    {
+        switch (type)
+        {
+            case asBCTYPE_wW_ARG:
+            case asBCTYPE_wW_QW_ARG:
+            case asBCTYPE_wW_DW_ARG:
+            case asBCTYPE_wW_W_ARG:
+            case asBCTYPE_wW_rW_ARG:
+            case asBCTYPE_wW_rW_DW_ARG:
+            case asBCTYPE_wW_rW_rW_ARG:
+                return true;
+
+            default:
+                return false;
+        }
+    }
+
+    // Variables cover the dwords from variable - size / 4 + 1 to variable
+    static bool overlaps(short first, asBYTE first_size, short second, asBYTE second_size)
+    {
+        int first_low  = first - first_size / static_cast<int>(sizeof(asDWORD)) + 1;
+        int second_low = second - second_size / static_cast<int>(sizeof(asDWORD)) + 1;
+        return first_low <= second && second_low <= first;
+    }
+
+    // Instructions which do not leave the code of the function and write no other variable than the first
+    // argument of a wW type
+    static bool is_local(asEBCInstr instruction)
+    {
+        switch (instruction)
+        {
+            case asBC_PopPtr:
+            case asBC_PshGPtr:
+            case asBC_PshC4:
+            case asBC_PshV4:
+            case asBC_PSF:
+            case asBC_SwapPtr:
+            case asBC_PshG4:
+            case asBC_LdGRdR4:
+            case asBC_NEGf:
+            case asBC_NEGd:
+            case asBC_INCi16:
+            case asBC_INCi8:
+            case asBC_DECi16:
+            case asBC_DECi8:
+            case asBC_INCi:
+            case asBC_DECi:
+            case asBC_INCf:
+            case asBC_DECf:
+            case asBC_INCd:
+            case asBC_DECd:
+            case asBC_INCi64:
+            case asBC_DECi64:
+            case asBC_PshC8:
+            case asBC_PshVPtr:
+            case asBC_RDSPtr:
+            case asBC_CMPd:
+            case asBC_CMPf:
+            case asBC_CMPIf:
+            case asBC_JMPP:
+            case asBC_PopRPtr:
+            case asBC_PshRPtr:
+            case asBC_ChkRefS:
+            case asBC_ChkNullV:
+            case asBC_PshNull:
+            case asBC_OBJTYPE:
+            case asBC_TYPEID:
+            case asBC_SetG4:
+            case asBC_CpyVtoR8:
+            case asBC_CpyVtoG4:
+            case asBC_CpyGtoV4:
+            case asBC_WRTV1:
+            case asBC_WRTV2:
+            case asBC_WRTV4:
+            case asBC_WRTV8:
+            case asBC_RDR1:
+            case asBC_RDR2:
+            case asBC_RDR4:
+            case asBC_RDR8:
+            case asBC_LDG:
+            case asBC_LDV:
+            case asBC_PGA:
+            case asBC_CmpPtr:
+            case asBC_VAR:
+            case asBC_iTOf:
+            case asBC_fTOi:
+            case asBC_uTOf:
+            case asBC_fTOu:
+            case asBC_iTOb:
+            case asBC_iTOw:
+            case asBC_dTOi:
+            case asBC_dTOu:
+            case asBC_dTOf:
+            case asBC_iTOd:
+            case asBC_uTOd:
+            case asBC_fTOd:
+            case asBC_fTOi64:
+            case asBC_dTOi64:
+            case asBC_fTOu64:
+            case asBC_dTOu64:
+            case asBC_i64TOf:
+            case asBC_u64TOf:
+            case asBC_i64TOd:
+            case asBC_u64TOd:
+            case asBC_ADDf:
+            case asBC_SUBf:
+            case asBC_MULf:
+            case asBC_DIVf:
+            case asBC_MODf:
+            case asBC_ADDd:
+            case asBC_SUBd:
+            case asBC_MULd:
+            case asBC_DIVd:
+            case asBC_MODd:
+            case asBC_ADDIf:
+            case asBC_SUBIf:
+            case asBC_MULIf:
+            case asBC_SetV1:
+            case asBC_SetV2:
+            case asBC_NOT:
+            case asBC_ChkNullS:
+            case asBC_LoadThisR:
+            case asBC_LoadRObjR:
+            case asBC_LoadVObjR:
+            case asBC_JMP:
+            case asBC_RET:
+            case asBC_JitEntry:
+                return true;
+
+            default:
+                return false;
+        }
+    }
+
+    ByteCodeGraph::ByteCodeGraph(asDWORD* begin, asDWORD* end)
+    {
+        std::vector<bool> leaders(static_cast<size_t>(end - begin) + 1, false);
+        leaders[0] = true;
+
+        for (asDWORD* address = begin; address < end;)
+        {
+            asEBCInstr instruction = opcode_at(address);
+            asDWORD* next          = address + instruction_size(instruction);
+
+            if (instruction == asBC_JitEntry)
+                leaders[address - begin] = true;
+
+            if (instruction == asBC_JMP || is_conditional_jump(instruction))
+            {
+                asDWORD* target = jump_target(address);
+                if (target >= begin && target < end)
+                    leaders[target - begin] = true;
+            }
+
+            if (instruction == asBC_JMP || instruction == asBC_JMPP || instruction == asBC_RET ||
+                is_conditional_jump(instruction))
+            {
+                leaders[std::min(next, end) - begin] = true;
+            }
+
+            address = next;
+        }
+
+        for (asDWORD* address = begin; address < end; address += instruction_size(opcode_at(address)))
+        {
+            if (leaders[address - begin])
+            {
+                if (!_M_blocks.empty())
+                    _M_blocks.back().end = address;
+                _M_blocks.push_back({address, end, {}, {}});
+            }
+        }
+
+        auto link = [this](size_t from, asDWORD* address) {
+            size_t to = block_at(address);
+            if (to == _M_blocks.size())
+                return;
+
+            std::vector<size_t>& successors = _M_blocks[from].successors;
+            if (std::find(successors.begin(), successors.end(), to) == successors.end())
+            {
+                successors.push_back(to);
+                _M_blocks[to].predecessors.push_back(from);
+            }
+        };
+
+        for (size_t index = 0; index < _M_blocks.size(); index++)
+        {
+            BasicBlock& block = _M_blocks[index];
+            asDWORD* last     = block.begin;
+
+            while (last + instruction_size(opcode_at(last)) < block.end) last += instruction_size(opcode_at(last));
+
+            asEBCInstr instruction = opcode_at(last);
+            if (instruction == asBC_RET)
+                continue;
+
+            if (instruction == asBC_JMP || is_conditional_jump(instruction))
+                link(index, jump_target(last));
+
+            // The VM jumps to the JMP at the index read from the variable, the JMPs follow the JMPP
+            if (instruction == asBC_JMPP)
+            {
+                for (asDWORD* entry = block.end; entry < end && opcode_at(entry) == asBC_JMP;
+                     entry += instruction_size(asBC_JMP))
+                {
+                    link(index, entry);
+                }
+            }
+            else if (instruction != asBC_JMP)
+            {
+                link(index, block.end);
+            }
+        }
+    }
+
+    const std::vector<BasicBlock>& ByteCodeGraph::blocks() const
+    {
+        return _M_blocks;
+    }
+
+    size_t ByteCodeGraph::block_at(asDWORD* address) const
+    {
+        auto block = std::lower_bound(_M_blocks.begin(), _M_blocks.end(), address,
+                                      [](const BasicBlock& block, asDWORD* address) { return block.begin < address; });
+
+        if (block == _M_blocks.end() || block->begin != address)
+            return _M_blocks.size();
+        return static_cast<size_t>(block - _M_blocks.begin());
+    }
+
+    std::vector<size_t> ByteCodeGraph::entries() const
+    {
+        std::vector<bool> reachable(_M_blocks.size(), false);
+        std::vector<size_t> stack = {0};
+        reachable[0]              = true;
+
+        while (!stack.empty())
+        {
+            size_t index = stack.back();
+            stack.pop_back();
+
+            for (size_t successor : _M_blocks[index].successors)
+            {
+                if (!reachable[successor])
+                {
+                    reachable[successor] = true;
+                    stack.push_back(successor);
+                }
+            }
+        }
+
+        std::vector<size_t> result = {0};
+        for (size_t index = 1; index < _M_blocks.size(); index++)
+        {
+            if (!reachable[index] && opcode_at(_M_blocks[index].begin) == asBC_JitEntry)
+                result.push_back(index);
+        }
+        return result;
+    }
+
+    // Variables whose address is taken, they can be written through a pointer
+    static std::vector<short> escaped_variables(asDWORD* begin, asDWORD* end)
+    {
+        std::vector<short> result;
+        for (asDWORD* address = begin; address < end; address += instruction_size(opcode_at(address)))
+        {
+            asEBCInstr instruction = opcode_at(address);
+            if (instruction == asBC_PSF || instruction == asBC_LDV || instruction == asBC_VAR ||
+                instruction == asBC_LoadVObjR)
+            {
+                result.push_back(variable_at(address, 0));
+            }
+        }
+        return result;
+    }
+
+    // Iterates a forward dataflow to the fixed point. states[index] is the state at the start of a block and
+    // reached[index] is set if the block is executed, the entries of the graph start with the default state.
+    // transfer(index, state) applies the instructions of a block, successors(index, state, result) returns the
+    // blocks reached from its end and meet(state, other) returns true if state changed
+    template<typename State, typename Transfer, typename Successors, typename Meet>
+    static void solve_forward(const ByteCodeGraph& graph, std::vector<State>& states, std::vector<bool>& reached,
+                              Transfer transfer, Successors successors, Meet meet)
+    {
+        size_t count = graph.blocks().size();
+        states.assign(count, State());
+        reached.assign(count, false);
+
+        std::vector<size_t> worklist = graph.entries();
+        std::vector<bool> queued(count, false);
+        std::vector<size_t> next;
+
+        for (size_t entry : worklist)
+        {
+            reached[entry] = true;
+            queued[entry]  = true;
+        }
+
+        while (!worklist.empty())
+        {
+            size_t index = worklist.back();
+            worklist.pop_back();
+            queued[index] = false;
+
+            State state = states[index];
+            transfer(index, state);
+            successors(index, state, next);
+
+            for (size_t successor : next)
+            {
+                bool changed = !reached[successor];
+                if (changed)
+                {
+                    reached[successor] = true;
+                    states[successor]  = state;
+                }
+                else
+                {
+                    changed = meet(states[successor], state);
+                }
+
+                if (changed && !queued[successor])
+                {
+                    queued[successor] = true;
+                    worklist.push_back(successor);
+                }
+            }
+        }
+    }
+
+    // Forward dataflow over the basic blocks. A variable is known at the start of a block if every reachable
+    // predecessor leaves the same value in it, the edges of folded jumps which are never taken do not count.
+    // Variables whose address is taken by PSF, LDV, VAR or LoadVObjR can be written through a pointer and are never
+    // known. Every instruction which may run script code or native functions forgets all variables, a line callback
+    // can change them through asIScriptContext::GetAddressOfVar while the VM runs the code
+    class ConstantPropagation
+    {
+    private:
+        struct Constant {
+            short variable;
+            asBYTE size;
+            asQWORD value;
+        };
+
+        struct State {
+            std::vector<Constant> variables;
+            bool value_known = false;
+            asDWORD value    = 0;
+        };
+
+        asDWORD* _M_begin;
+        asDWORD* _M_end;
+        bool _M_suspend_exits;
+        ByteCodeGraph _M_graph;
+        std::vector<short> _M_escaped;
+        std::vector<State> _M_states;
+        std::vector<bool> _M_reached;
+
+        static bool is_taken(asEBCInstr instruction, asDWORD value)
+        {
+            int number = static_cast<int>(value);
+            switch (instruction)
+            {
+                case asBC_JZ:
+                    return number == 0;
+                case asBC_JNZ:
+                    return number != 0;
+                case asBC_JS:
+                    return number < 0;
+                case asBC_JNS:
+                    return number >= 0;
+                case asBC_JP:
+                    return number > 0;
+                case asBC_JNP:
+                    return number <= 0;
+                case asBC_JLowZ:
+                    return static_cast<asBYTE>(value) == 0;
+                default:
+                    return static_cast<asBYTE>(value) != 0;
+            }
+        }
+
+        static bool test(asEBCInstr instruction, asDWORD value)
+        {
+            int number = static_cast<int>(value);
+            switch (instruction)
+            {
+                case asBC_TZ:
+                    return number == 0;
+                case asBC_TNZ:
+                    return number != 0;
+                case asBC_TS:
+                    return number < 0;
+                case asBC_TNS:
+                    return number >= 0;
+                case asBC_TP:
+                    return number > 0;
+                default:
+                    return number <= 0;
+            }
+        }
+
+        template<typename T>
+        static asDWORD compare(T first, T second)
+        {
+            return first == second ? 0 : (first < second ? static_cast<asDWORD>(-1) : 1);
+        }
+
+        // Returns false if the VM would raise an exception or the result depends on the processor
+        static bool binary32(asEBCInstr instruction, asDWORD first, asDWORD second, asDWORD& result)
+        {
+            int a = static_cast<int>(first);
+            int b = static_cast<int>(second);
+
+            switch (instruction)
+            {
+                case asBC_ADDi:
+                case asBC_ADDIi:
+                    result = first + second;
+                    return true;
+                case asBC_SUBi:
+                case asBC_SUBIi:
+                    result = first - second;
+                    return true;
+                case asBC_MULi:
+                case asBC_MULIi:
+                    result = first * second;
+                    return true;
+                case asBC_DIVi:
+                case asBC_MODi:
+                    if (b == 0 || (a == INT_MIN && b == -1))
+                        return false;
+                    result = static_cast<asDWORD>(instruction == asBC_DIVi ? a / b : a % b);
+                    return true;
+                case asBC_DIVu:
+                case asBC_MODu:
+                    if (second == 0)
+                        return false;
+                    result = instruction == asBC_DIVu ? first / second : first % second;
+                    return true;
+                case asBC_BAND:
+                    result = first & second;
+                    return true;
+                case asBC_BOR:
+                    result = first | second;
+                    return true;
+                case asBC_BXOR:
+                    result = first ^ second;
+                    return true;
+                case asBC_BSLL:
+                case asBC_BSRL:
+                case asBC_BSRA:
+                    if (second >= 32)
+                        return false;
+                    result = instruction == asBC_BSLL   ? first << second
+                             : instruction == asBC_BSRL ? first >> second
+                                                        : static_cast<asDWORD>(a >> second);
+                    return true;
+                default:
+                    return false;
+            }
+        }
+
+        static bool binary64(asEBCInstr instruction, asQWORD first, asQWORD second, asQWORD& result)
+        {
+            asINT64 a = static_cast<asINT64>(first);
+            asINT64 b = static_cast<asINT64>(second);
+
+            switch (instruction)
+            {
+                case asBC_ADDi64:
+                    result = first + second;
+                    return true;
+                case asBC_SUBi64:
+                    result = first - second;
+                    return true;
+                case asBC_MULi64:
+                    result = first * second;
+                    return true;
+                case asBC_DIVi64:
+                case asBC_MODi64:
+                    if (b == 0 || (a == LLONG_MIN && b == -1))
+                        return false;
+                    result = static_cast<asQWORD>(instruction == asBC_DIVi64 ? a / b : a % b);
+                    return true;
+                case asBC_DIVu64:
+                case asBC_MODu64:
+                    if (second == 0)
+                        return false;
+                    result = instruction == asBC_DIVu64 ? first / second : first % second;
+                    return true;
+                case asBC_BAND64:
+                    result = first & second;
+                    return true;
+                case asBC_BOR64:
+                    result = first | second;
+                    return true;
+                case asBC_BXOR64:
+                    result = first ^ second;
+                    return true;
+                case asBC_BSLL64:
+                case asBC_BSRL64:
+                case asBC_BSRA64:
+                    if (second >= 64)
+                        return false;
+                    result = instruction == asBC_BSLL64   ? first << second
+                             : instruction == asBC_BSRL64 ? first >> second
+                                                          : static_cast<asQWORD>(a >> second);
+                    return true;
+                default:
+                    return false;
+            }
+        }
+
+        bool is_escaped(short variable, asBYTE size) const
+        {
+            return std::any_of(_M_escaped.begin(), _M_escaped.end(), [variable, size](short escaped) {
+                return overlaps(variable, size, escaped, sizeof(asQWORD));
+            });
+        }
+
+        static void forget(State& state, short variable, asBYTE size)
+        {
+            std::erase_if(state.variables, [variable, size](const Constant& constant) {
+                return overlaps(constant.variable, constant.size, variable, size);
+            });
+        }
+
+        static bool load32(const State& state, short variable, asDWORD& value)
+        {
+            for (const Constant& constant : state.variables)
+            {
+                if (constant.variable == variable)
+                {
+                    value = static_cast<asDWORD>(constant.value);
+                    return true;
+                }
+
+                // High half of a 64 bit value
+                if (constant.size == sizeof(asQWORD) && constant.variable == variable + 1)
+                {
+                    value = static_cast<asDWORD>(constant.value >> 32);
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        static bool load64(const State& state, short variable, asQWORD& value)
+        {
+            for (const Constant& constant : state.variables)
+            {
+                if (constant.variable == variable && constant.size == sizeof(asQWORD))
+                {
+                    value = constant.value;
+                    return true;
+                }
+            }
+
+            asDWORD low, high;
+            if (!load32(state, variable, low) || !load32(state, variable - 1, high))
+                return false;
+
+            value = static_cast<asQWORD>(low) | (static_cast<asQWORD>(high) << 32);
+            return true;
+        }
+
+        // Result of an instruction which writes size bytes of variable, the instruction becomes a store of the
+        // result if it is known
+        void result(State& state, ConstantFold* fold, short variable, asBYTE size, bool known, asQWORD value) const
+        {
+            forget(state, variable, size);
+            if (!known)
+                return;
+
+            if (!is_escaped(variable, size))
+                state.variables.push_back({variable, size, value});
+
+            if (fold)
+                *fold = {ConstantFold::Action::SetVariable, size, variable, value};
+        }
+
+        static void value_result(State& state, ConstantFold* fold, bool known, asDWORD value)
+        {
+            state.value_known = known;
+            state.value       = value;
+
+            if (known && fold)
+                *fold = {ConstantFold::Action::SetValue, sizeof(asDWORD), 0, value};
+        }
+
+        void execute(State& state, asDWORD* address, ConstantFold* fold) const
+        {
+            asEBCInstr instruction = opcode_at(address);
+            asDWORD first, second;
+            asQWORD first64, second64;
+
+            switch (instruction)
+            {
+                case asBC_SetV4:
+                    result(state, nullptr, variable_at(address, 0), sizeof(asDWORD), true, asBC_DWORDARG(address));
+                    break;
+
+                case asBC_SetV8:
+                    result(state, nullptr, variable_at(address, 0), sizeof(asQWORD), true, asBC_QWORDARG(address));
+                    break;
+
+                case asBC_CpyVtoV4:
+                case asBC_CpyRtoV4:
+                {
+                    bool known = instruction == asBC_CpyRtoV4 ? state.value_known
+                                                              : load32(state, variable_at(address, 1), first);
+                    if (instruction == asBC_CpyRtoV4)
+                        first = state.value;
+                    result(state, fold, variable_at(address, 0), sizeof(asDWORD), known, first);
+                    break;
+                }
+
+                case asBC_CpyVtoV8:
+                {
+                    bool known = load64(state, variable_at(address, 1), first64);
+                    result(state, fold, variable_at(address, 0), sizeof(asQWORD), known, first64);
+                    break;
+                }
+
+                case asBC_CpyRtoV8:
+                    result(state, nullptr, variable_at(address, 0), sizeof(asQWORD), false, 0);
+                    break;
+
+                case asBC_ADDi:
+                case asBC_SUBi:
+                case asBC_MULi:
+                case asBC_DIVi:
+                case asBC_MODi:
+                case asBC_DIVu:
+                case asBC_MODu:
+                case asBC_BAND:
+                case asBC_BOR:
+                case asBC_BXOR:
+                case asBC_BSLL:
+                case asBC_BSRL:
+                case asBC_BSRA:
+                {
+                    bool known = load32(state, variable_at(address, 1), first) &&
+                                 load32(state, variable_at(address, 2), second) &&
+                                 binary32(instruction, first, second, first);
+                    result(state, fold, variable_at(address, 0), sizeof(asDWORD), known, first);
+                    break;
+                }
+
+                case asBC_ADDIi:
+                case asBC_SUBIi:
+                case asBC_MULIi:
+                {
+                    bool known = load32(state, variable_at(address, 1), first) &&
+                                 binary32(instruction, first, asBC_DWORDARG(address + 1), first);
+                    result(state, fold, variable_at(address, 0), sizeof(asDWORD), known, first);
+                    break;
+                }
+
+                case asBC_ADDi64:
+                case asBC_SUBi64:
+                case asBC_MULi64:
+                case asBC_DIVi64:
+                case asBC_MODi64:
+                case asBC_DIVu64:
+                case asBC_MODu64:
+                case asBC_BAND64:
+                case asBC_BOR64:
+                case asBC_BXOR64:
+                {
+                    bool known = load64(state, variable_at(address, 1), first64) &&
+                                 load64(state, variable_at(address, 2), second64) &&
+                                 binary64(instruction, first64, second64, first64);
+                    result(state, fold, variable_at(address, 0), sizeof(asQWORD), known, first64);
+                    break;
+                }
+
+                // The shift count is a dword
+                case asBC_BSLL64:
+                case asBC_BSRL64:
+                case asBC_BSRA64:
+                {
+                    bool known = load64(state, variable_at(address, 1), first64) &&
+                                 load32(state, variable_at(address, 2), second) &&
+                                 binary64(instruction, first64, second, first64);
+                    result(state, fold, variable_at(address, 0), sizeof(asQWORD), known, first64);
+                    break;
+                }
+
+                case asBC_NEGi:
+                case asBC_BNOT:
+                case asBC_IncVi:
+                case asBC_DecVi:
+                case asBC_sbTOi:
+                case asBC_swTOi:
+                case asBC_ubTOi:
+                case asBC_uwTOi:
+                {
+                    short variable = variable_at(address, 0);
+                    bool known     = load32(state, variable, first);
+
+                    switch (instruction)
+                    {
+                        case asBC_NEGi:
+                            first = 0u - first;
+                            break;
+                        case asBC_BNOT:
+                            first = ~first;
+                            break;
+                        case asBC_IncVi:
+                            first++;
+                            break;
+                        case asBC_DecVi:
+                            first--;
+                            break;
+                        case asBC_sbTOi:
+                            first = static_cast<asDWORD>(static_cast<int>(static_cast<signed char>(first)));
+                            break;
+                        case asBC_swTOi:
+                            first = static_cast<asDWORD>(static_cast<int>(static_cast<short>(first)));
+                            break;
+                        case asBC_ubTOi:
+                            first = static_cast<asBYTE>(first);
+                            break;
+                        default:
+                            first = static_cast<asWORD>(first);
+                            break;
+                    }
+
+                    result(state, fold, variable, sizeof(asDWORD), known, first);
+                    break;
+                }
+
+                case asBC_NEGi64:
+                case asBC_BNOT64:
+                {
+                    short variable = variable_at(address, 0);
+                    bool known     = load64(state, variable, first64);
+                    first64        = instruction == asBC_NEGi64 ? 0ull - first64 : ~first64;
+                    result(state, fold, variable, sizeof(asQWORD), known, first64);
+                    break;
+                }
+
+                case asBC_iTOi64:
+                case asBC_uTOi64:
+                {
+                    bool known = load32(state, variable_at(address, 1), first);
+                    first64    = instruction == asBC_iTOi64
+                                         ? static_cast<asQWORD>(static_cast<asINT64>(static_cast<int>(first)))
+                                         : static_cast<asQWORD>(first);
+                    result(state, fold, variable_at(address, 0), sizeof(asQWORD), known, first64);
+                    break;
+                }
+
+                case asBC_i64TOi:
+                {
+                    bool known = load64(state, variable_at(address, 1), first64);
+                    result(state, fold, variable_at(address, 0), sizeof(asDWORD), known, static_cast<asDWORD>(first64));
+                    break;
+                }
+
+                case asBC_CMPi:
+                case asBC_CMPu:
+                {
+                    bool known = load32(state, variable_at(address, 0), first) &&
+                                 load32(state, variable_at(address, 1), second);
+                    value_result(state, fold, known,
+                                 instruction == asBC_CMPi ? compare(static_cast<int>(first), static_cast<int>(second))
+                                                          : compare(first, second));
+                    break;
+                }
+
+                case asBC_CMPIi:
+                case asBC_CMPIu:
+                {
+                    bool known = load32(state, variable_at(address, 0), first);
+                    second     = asBC_DWORDARG(address);
+                    value_result(state, fold, known,
+                                 instruction == asBC_CMPIi ? compare(static_cast<int>(first), static_cast<int>(second))
+                                                           : compare(first, second));
+                    break;
+                }
+
+                case asBC_CMPi64:
+                case asBC_CMPu64:
+                {
+                    bool known = load64(state, variable_at(address, 0), first64) &&
+                                 load64(state, variable_at(address, 1), second64);
+                    value_result(state, fold, known,
+                                 instruction == asBC_CMPi64
+                                         ? compare(static_cast<asINT64>(first64), static_cast<asINT64>(second64))
+                                         : compare(first64, second64));
+                    break;
+                }
+
+                case asBC_TZ:
+                case asBC_TNZ:
+                case asBC_TS:
+                case asBC_TNS:
+                case asBC_TP:
+                case asBC_TNP:
+                    value_result(state, fold, state.value_known, test(instruction, state.value) ? 1 : 0);
+                    break;
+
+                case asBC_CpyVtoR4:
+                {
+                    bool known = load32(state, variable_at(address, 0), first);
+                    value_result(state, fold, known, first);
+                    break;
+                }
+
+                case asBC_ClrHi:
+                    state.value &= 0xFF;
+                    break;
+
+                case asBC_JZ:
+                case asBC_JNZ:
+                case asBC_JS:
+                case asBC_JNS:
+                case asBC_JP:
+                case asBC_JNP:
+                case asBC_JLowZ:
+                case asBC_JLowNZ:
+                    if (state.value_known && fold)
+                    {
+                        fold->action = is_taken(instruction, state.value) ? ConstantFold::Action::Jump
+                                                                          : ConstantFold::Action::Skip;
+                    }
+                    break;
+
+                case asBC_SUSPEND:
+                    if (_M_suspend_exits)
+                        state.variables.clear();
+                    break;
+
+                default:
+                {
+                    asEBCType type = asBCInfo[instruction].type;
+                    if (!is_local(instruction))
+                        state.variables.clear();
+                    else if (writes_variable(type))
+                        forget(state, variable_at(address, 0), sizeof(asQWORD));
+
+                    if (instruction != asBC_JMP && instruction != asBC_JitEntry)
+                        state.value_known = false;
+                    break;
+                }
+            }
+        }
+
+        // Meets the state at the end of a predecessor into the state at the start of a block, returns true if
+        // the state at the start changed
+        static bool meet(State& state, const State& other)
+        {
+            size_t size = state.variables.size();
+            std::erase_if(state.variables, [&other](const Constant& constant) {
+                return std::none_of(other.variables.begin(), other.variables.end(), [&constant](const Constant& value) {
+                    return value.variable == constant.variable && value.size == constant.size &&
+                           value.value == constant.value;
+                });
+            });
+
+            bool value_known  = state.value_known && other.value_known && state.value == other.value;
+            bool changed      = size != state.variables.size() || value_known != state.value_known;
+            state.value_known = value_known;
+            return changed;
+        }
+
+        // Successors which are reached from the end of the block with the given state
+        void successors(size_t index, const State& state, std::vector<size_t>& result) const
+        {
+            const BasicBlock& block = _M_graph.blocks()[index];
+            result                  = block.successors;
+
+            asDWORD* last = block.begin;
+            while (last + instruction_size(opcode_at(last)) < block.end) last += instruction_size(opcode_at(last));
+
+            asEBCInstr instruction = opcode_at(last);
+            if (!is_conditional_jump(instruction) || !state.value_known)
+                return;
+
+            asDWORD* next = is_taken(instruction, state.value) ? jump_target(last) : block.end;
+            result.assign(1, _M_graph.block_at(next));
+            if (result[0] == _M_graph.blocks().size())
+                result.clear();
+        }
+
+    public:
+        ConstantPropagation(asDWORD* begin, asDWORD* end, bool suspend_exits)
+            : _M_begin(begin), _M_end(end), _M_suspend_exits(suspend_exits), _M_graph(begin, end),
+              _M_escaped(escaped_variables(begin, end))
+        {}
+
+        std::vector<ConstantFold> run()
+        {
+            const std::vector<BasicBlock>& blocks = _M_graph.blocks();
+            solve_forward(
+                    _M_graph, _M_states, _M_reached,
+                    [this, &blocks](size_t index, State& state) {
+                        for (asDWORD* address = blocks[index].begin; address < blocks[index].end;
+                             address += instruction_size(opcode_at(address)))
+                        {
+                            execute(state, address, nullptr);
+                        }
+                    },
+                    [this](size_t index, const State& state, std::vector<size_t>& result) {
+                        successors(index, state, result);
+                    },
+                    meet);
+
+            std::vector<ConstantFold> folds(static_cast<size_t>(_M_end - _M_begin));
+            bool folded = false;
+
+            for (size_t index = 0; index < blocks.size(); index++)
+            {
+                State state = _M_states[index];
+                for (asDWORD* address = blocks[index].begin; address < blocks[index].end;
+                     address += instruction_size(opcode_at(address)))
+                {
+                    ConstantFold& fold = folds[address - _M_begin];
+                    if (_M_reached[index])
+                        execute(state, address, &fold);
+                    else
+                        fold.action = ConstantFold::Action::Dead;
+
+                    folded = folded || fold.action != ConstantFold::Action::None;
+                }
+            }
+
+            if (!folded)
+                folds.clear();
+            return folds;
+        }
+    };
+
+    // Forward dataflow of the variables which hold a valid pointer, a variable is valid at the start of a block if
+    // it is valid at the end of every predecessor. A pointer is valid after it passed a null check, the checks
+    // themselves throw. Only the top of the VM stack is tracked and only inside of a block: an address pushed by
+    // PSF or PGA, or a pointer which passed a check. Instructions which may run other code forget the variables like
+    // in the constant propagation, except the object pointer of a method, which nothing can change
+    class NullCheckAnalysis
+    {
+    private:
+        enum class Top
+        {
+            Unknown,
+            Valid,
+            Address,
+        };
+
+        struct State {
+            std::vector<short> valid;
+            Top top        = Top::Unknown;
+            short variable = 0;
+        };
+
+        asDWORD* _M_begin;
+        asDWORD* _M_end;
+        bool _M_suspend_exits;
+        bool _M_is_method;
+        ByteCodeGraph _M_graph;
+        std::vector<short> _M_escaped;
+        std::vector<State> _M_states;
+        std::vector<bool> _M_reached;
+
+        // Instructions which write through a pointer, they can change every variable whose address is taken
+        static bool writes_memory(asEBCInstr instruction)
+        {
+            switch (instruction)
+            {
+                case asBC_WRTV1:
+                case asBC_WRTV2:
+                case asBC_WRTV4:
+                case asBC_WRTV8:
+                case asBC_INCi16:
+                case asBC_INCi8:
+                case asBC_DECi16:
+                case asBC_DECi8:
+                case asBC_INCi:
+                case asBC_DECi:
+                case asBC_INCf:
+                case asBC_DECf:
+                case asBC_INCd:
+                case asBC_DECd:
+                case asBC_INCi64:
+                case asBC_DECi64:
+                    return true;
+
+                default:
+                    return false;
+            }
+        }
+
+        static bool is_valid(const State& state, short variable)
+        {
+            return std::find(state.valid.begin(), state.valid.end(), variable) != state.valid.end();
+        }
+
+        static void validate(State& state, short variable)
+        {
+            if (!is_valid(state, variable))
+                state.valid.push_back(variable);
+        }
+
+        static void forget(State& state, short variable)
+        {
+            std::erase_if(state.valid, [variable](short valid) {
+                return overlaps(valid, sizeof(asPWORD), variable, sizeof(asQWORD));
+            });
+        }
+
+        void forget_all(State& state) const
+        {
+            bool has_this = _M_is_method && is_valid(state, 0);
+            state.valid.clear();
+            if (has_this)
+                state.valid.push_back(0);
+        }
+
+        // Returns true if the pointer checked by the instruction is known to be valid
+        bool execute(State& state, asDWORD* address) const
+        {
+            asEBCInstr instruction = opcode_at(address);
+            bool redundant         = false;
+
+            switch (instruction)
+            {
+                case asBC_ChkNullV:
+                case asBC_LoadRObjR:
+                case asBC_SetListSize:
+                case asBC_SetListType:
+                {
+                    short variable = variable_at(address, 0);
+                    redundant      = is_valid(state, variable);
+                    validate(state, variable);
+                    break;
+                }
+
+                case asBC_PshListElmnt:
+                {
+                    short variable = variable_at(address, 0);
+                    redundant      = is_valid(state, variable);
+                    validate(state, variable);
+                    state.top = Top::Valid;
+                    break;
+                }
+
+                case asBC_LoadThisR:
+                    redundant = is_valid(state, 0);
+                    validate(state, 0);
+                    break;
+
+                case asBC_PSF:
+                    state.top      = Top::Address;
+                    state.variable = variable_at(address, 0);
+                    break;
+
+                case asBC_PGA:
+                    state.top = Top::Valid;
+                    break;
+
+                case asBC_PshVPtr:
+                    state.top = is_valid(state, variable_at(address, 0)) ? Top::Valid : Top::Unknown;
+                    break;
+
+                // The pointer on the top of the stack
+                case asBC_CHKREF:
+                case asBC_ChkNullS:
+                    if (instruction == asBC_ChkNullS && asBC_WORDARG0(address) != 0)
+                        break;
+
+                    redundant = state.top != Top::Unknown;
+                    if (state.top == Top::Unknown)
+                        state.top = Top::Valid;
+                    break;
+
+                // The pointer stored at the address on the top of the stack
+                case asBC_ChkRefS:
+                    if (state.top == Top::Address)
+                    {
+                        redundant = is_valid(state, state.variable);
+                        validate(state, state.variable);
+                    }
+                    break;
+
+                case asBC_RDSPtr:
+                    redundant = state.top != Top::Unknown;
+                    state.top = state.top == Top::Address && is_valid(state, state.variable) ? Top::Valid
+                                                                                             : Top::Unknown;
+                    break;
+
+                case asBC_ADDSi:
+                    redundant = state.top != Top::Unknown;
+                    state.top = Top::Valid;
+                    break;
+
+                default:
+                {
+                    asEBCType type = asBCInfo[instruction].type;
+                    if (!is_local(instruction) || (instruction == asBC_SUSPEND && _M_suspend_exits))
+                        forget_all(state);
+
+                    if (writes_variable(type) || instruction == asBC_IncVi || instruction == asBC_DecVi ||
+                        instruction == asBC_LOADOBJ)
+                    {
+                        forget(state, variable_at(address, 0));
+                    }
+
+                    if (writes_memory(instruction))
+                    {
+                        for (short variable : _M_escaped) forget(state, variable);
+                    }
+
+                    if (!is_local(instruction) || asBCInfo[instruction].stackInc != 0 || instruction == asBC_SwapPtr)
+                        state.top = Top::Unknown;
+                    break;
+                }
+            }
+
+            return redundant;
+        }
+
+        static bool meet(State& state, const State& other)
+        {
+            size_t size = state.valid.size();
+            std::erase_if(state.valid, [&other](short variable) { return !is_valid(other, variable); });
+            return size != state.valid.size();
+        }
+
+    public:
+        NullCheckAnalysis(asDWORD* begin, asDWORD* end, bool suspend_exits, bool is_method)
+            : _M_begin(begin), _M_end(end), _M_suspend_exits(suspend_exits), _M_is_method(is_method),
+              _M_graph(begin, end), _M_escaped(escaped_variables(begin, end))
+        {}
+
+        std::vector<bool> run()
+        {
+            const std::vector<BasicBlock>& blocks = _M_graph.blocks();
+            solve_forward(
+                    _M_graph, _M_states, _M_reached,
+                    [this, &blocks](size_t index, State& state) {
+                        for (asDWORD* address = blocks[index].begin; address < blocks[index].end;
+                             address += instruction_size(opcode_at(address)))
+                        {
+                            execute(state, address);
+                        }
+                        state.top = Top::Unknown;
+                    },
+                    [&blocks](size_t index, const State&, std::vector<size_t>& result) {
+                        result = blocks[index].successors;
+                    },
+                    meet);
+
+            std::vector<bool> redundant(static_cast<size_t>(_M_end - _M_begin), false);
+            bool found = false;
+
+            for (size_t index = 0; index < blocks.size(); index++)
+            {
+                if (!_M_reached[index])
+                    continue;
+
+                State state = _M_states[index];
+                for (asDWORD* address = blocks[index].begin; address < blocks[index].end;
+                     address += instruction_size(opcode_at(address)))
+                {
+                    if (execute(state, address))
+                    {
+                        redundant[address - _M_begin] = true;
+                        found                         = true;
+                    }
+                }
+            }
+
+            if (!found)
+                redundant.clear();
+            return redundant;
+        }
+    };
+
+    // Backward dataflow of the dwords of the frame which may be read before they are written again. Every
+    // instruction which may leave the code of the function or raise an exception reads all of them, the VM and a
+    // line callback can look at every variable there. Arguments and variables whose address is taken are always
+    // live, so only the stores to the temporaries of the function are removed
+    class LivenessAnalysis
+    {
+    private:
+        asDWORD* _M_begin;
+        asDWORD* _M_end;
+        bool _M_suspend_exits;
+        ByteCodeGraph _M_graph;
+        std::vector<short> _M_escaped;
+        std::vector<std::vector<bool>> _M_states;
+        int _M_low  = 0;
+        int _M_high = -1;
+
+        void mark(std::vector<bool>& live, short variable, asBYTE size, bool value) const
+        {
+            for (int dword = variable - size / static_cast<int>(sizeof(asDWORD)) + 1; dword <= variable; dword++)
+            {
+                if (dword >= _M_low && dword <= _M_high)
+                    live[dword - _M_low] = value;
+            }
+        }
+
+        bool is_live(const std::vector<bool>& live, short variable, asBYTE size) const
+        {
+            for (int dword = variable - size / static_cast<int>(sizeof(asDWORD)) + 1; dword <= variable; dword++)
+            {
+                if (dword < _M_low || dword > _M_high || live[dword - _M_low])
+                    return true;
+            }
+            return false;
+        }
+
+        // The first argument of a wW type is written with size bytes, the other arguments are read. With size 0 the
+        // written size is unknown and nothing is killed, reads of unknown size cover a qword
+        void update(std::vector<bool>& live, asDWORD* address, asBYTE size) const
+        {
+            asEBCType type  = asBCInfo[opcode_at(address)].type;
+            asUINT count    = variable_arguments(type);
+            asUINT argument = 0;
+
+            if (writes_variable(type))
+            {
+                if (size != 0)
+                    mark(live, variable_at(address, 0), size, false);
+                argument = 1;
+            }
+
+            for (; argument < count; argument++)
+            {
+                mark(live, variable_at(address, argument), size == sizeof(asDWORD) ? size : sizeof(asQWORD), true);
+            }
+        }
+
+        void execute(std::vector<bool>& live, asDWORD* address) const
+        {
+            asEBCInstr instruction = opcode_at(address);
+            switch (instruction)
+            {
+                case asBC_SetV4:
+                case asBC_CpyVtoV4:
+                case asBC_CpyRtoV4:
+                case asBC_CpyVtoR4:
+                case asBC_CpyVtoG4:
+                case asBC_CpyGtoV4:
+                case asBC_PshV4:
+                case asBC_ADDi:
+                case asBC_SUBi:
+                case asBC_MULi:
+                case asBC_ADDIi:
+                case asBC_SUBIi:
+                case asBC_MULIi:
+                case asBC_BAND:
+                case asBC_BOR:
+                case asBC_BXOR:
+                case asBC_BSLL:
+                case asBC_BSRL:
+                case asBC_BSRA:
+                case asBC_CMPi:
+                case asBC_CMPu:
+                case asBC_CMPIi:
+                case asBC_CMPIu:
+                case asBC_IncVi:
+                case asBC_DecVi:
+                case asBC_NEGi:
+                case asBC_BNOT:
+                case asBC_ADDf:
+                case asBC_SUBf:
+                case asBC_MULf:
+                case asBC_DIVf:
+                case asBC_MODf:
+                case asBC_ADDIf:
+                case asBC_SUBIf:
+                case asBC_MULIf:
+                case asBC_CMPf:
+                case asBC_CMPIf:
+                case asBC_NEGf:
+                    update(live, address, sizeof(asDWORD));
+                    break;
+
+                case asBC_SetV8:
+                case asBC_CpyVtoV8:
+                case asBC_CpyRtoV8:
+                case asBC_CpyVtoR8:
+                case asBC_PshV8:
+                case asBC_ADDd:
+                case asBC_SUBd:
+                case asBC_MULd:
+                case asBC_DIVd:
+                case asBC_MODd:
+                case asBC_CMPd:
+                case asBC_NEGd:
+                case asBC_ADDi64:
+                case asBC_SUBi64:
+                case asBC_MULi64:
+                case asBC_BAND64:
+                case asBC_BOR64:
+                case asBC_BXOR64:
+                case asBC_CMPi64:
+                case asBC_CMPu64:
+                case asBC_NEGi64:
+                case asBC_BNOT64:
+                    update(live, address, sizeof(asQWORD));
+                    break;
+
+                // Local instructions which are modelled by the constant propagation and are missing in is_local()
+                case asBC_sbTOi:
+                case asBC_swTOi:
+                case asBC_ubTOi:
+                case asBC_uwTOi:
+                case asBC_i64TOi:
+                case asBC_uTOi64:
+                case asBC_iTOi64:
+                case asBC_BSLL64:
+                case asBC_BSRL64:
+                case asBC_BSRA64:
+                case asBC_ClrHi:
+                case asBC_TZ:
+                case asBC_TNZ:
+                case asBC_TS:
+                case asBC_TNS:
+                case asBC_TP:
+                case asBC_TNP:
+                case asBC_JZ:
+                case asBC_JNZ:
+                case asBC_JS:
+                case asBC_JNS:
+                case asBC_JP:
+                case asBC_JNP:
+                case asBC_JLowZ:
+                case asBC_JLowNZ:
+                    update(live, address, 0);
+                    break;
+
+                // Local instructions which raise exceptions
+                case asBC_ChkRefS:
+                case asBC_ChkNullV:
+                case asBC_ChkNullS:
+                case asBC_RDSPtr:
+                case asBC_LoadThisR:
+                case asBC_LoadRObjR:
+                case asBC_JMPP:
+                    live.assign(live.size(), true);
+                    break;
+
+                case asBC_SUSPEND:
+                    if (_M_suspend_exits)
+                        live.assign(live.size(), true);
+                    break;
+
+                // RET leaves nothing of the frame behind, only the arguments which are always live
+                case asBC_RET:
+                    live.assign(live.size(), false);
+                    break;
+
+                default:
+                    if (is_local(instruction))
+                        update(live, address, 0);
+                    else
+                        live.assign(live.size(), true);
+                    break;
+            }
+        }
+
+        // The candidates for the removal, the stores which only write the variable
+        static asBYTE store_size(asEBCInstr instruction)
+        {
+            switch (instruction)
+            {
+                case asBC_SetV4:
+                case asBC_CpyVtoV4:
+                case asBC_CpyRtoV4:
+                    return sizeof(asDWORD);
+
+                case asBC_SetV8:
+                case asBC_CpyVtoV8:
+                case asBC_CpyRtoV8:
+                    return sizeof(asQWORD);
+
+                default:
+                    return 0;
+            }
+        }
+
+        bool is_temporary(short variable, asBYTE size) const
+        {
+            if (variable - size / static_cast<int>(sizeof(asDWORD)) + 1 <= 0)
+                return false;
+
+            return std::none_of(_M_escaped.begin(), _M_escaped.end(), [variable, size](short escaped) {
+                return overlaps(variable, size, escaped, sizeof(asQWORD));
+            });
+        }
+
+        // The live dwords at the end of a block, a block without successors other than RET leaves everything live
+        std::vector<bool> live_out(size_t index) const
+        {
+            const BasicBlock& block = _M_graph.blocks()[index];
+            std::vector<bool> live(static_cast<size_t>(_M_high - _M_low + 1), false);
+
+            if (block.successors.empty())
+            {
+                asDWORD* last = block.begin;
+                while (last + instruction_size(opcode_at(last)) < block.end) last += instruction_size(opcode_at(last));
+
+                if (opcode_at(last) != asBC_RET)
+                    live.assign(live.size(), true);
+                return live;
+            }
+
+            for (size_t successor : block.successors)
+            {
+                const std::vector<bool>& other = _M_states[successor];
+                for (size_t dword = 0; dword < live.size(); dword++) live[dword] = live[dword] || other[dword];
+            }
+            return live;
+        }
+
+        // Applies the instructions of a block from the last to the first, calls visit(address, live) with the dwords
+        // live after every instruction
+        template<typename Visit>
+        void transfer(size_t index, std::vector<bool>& live, Visit visit) const
+        {
+            const BasicBlock& block = _M_graph.blocks()[index];
+            std::vector<asDWORD*> addresses;
+            for (asDWORD* address = block.begin; address < block.end; address += instruction_size(opcode_at(address)))
+            {
+                addresses.push_back(address);
+            }
+
+            for (auto address = addresses.rbegin(); address != addresses.rend(); ++address)
+            {
+                visit(*address, live);
+                execute(live, *address);
+            }
+        }
+
+    public:
+        LivenessAnalysis(asDWORD* begin, asDWORD* end, bool suspend_exits)
+            : _M_begin(begin), _M_end(end), _M_suspend_exits(suspend_exits), _M_graph(begin, end),
+              _M_escaped(escaped_variables(begin, end))
+        {
+            bool first = true;
+            for (asDWORD* address = begin; address < end; address += instruction_size(opcode_at(address)))
+            {
+                asUINT count = variable_arguments(asBCInfo[opcode_at(address)].type);
+                for (asUINT argument = 0; argument < count; argument++)
+                {
+                    int variable = variable_at(address, argument);
+                    _M_low       = first ? variable - 1 : std::min(_M_low, variable - 1);
+                    _M_high      = first ? variable : std::max(_M_high, variable);
+                    first        = false;
+                }
+            }
+        }
+
+        std::vector<bool> run()
+        {
+            const std::vector<BasicBlock>& blocks = _M_graph.blocks();
+            if (_M_high < _M_low || blocks.empty())
+                return {};
+
+            size_t dwords = static_cast<size_t>(_M_high - _M_low + 1);
+            _M_states.assign(blocks.size(), std::vector<bool>(dwords, false));
+
+            // The live dwords only grow, so the iteration ends when no block start changes any more
+            std::vector<size_t> worklist(blocks.size());
+            std::vector<bool> queued(blocks.size(), true);
+            for (size_t index = 0; index < blocks.size(); index++) worklist[index] = index;
+
+            while (!worklist.empty())
+            {
+                size_t index = worklist.back();
+                worklist.pop_back();
+                queued[index] = false;
+
+                std::vector<bool> live = live_out(index);
+                transfer(index, live, [](asDWORD*, const std::vector<bool>&) {});
+
+                if (live == _M_states[index])
+                    continue;
+
+                _M_states[index] = std::move(live);
+                for (size_t predecessor : blocks[index].predecessors)
+                {
+                    if (!queued[predecessor])
+                    {
+                        queued[predecessor] = true;
+                        worklist.push_back(predecessor);
+                    }
+                }
+            }
+
+            std::vector<bool> dead(static_cast<size_t>(_M_end - _M_begin), false);
+            bool found = false;
+
+            for (size_t index = 0; index < blocks.size(); index++)
+            {
+                std::vector<bool> live = live_out(index);
+                transfer(index, live, [this, &dead, &found](asDWORD* address, const std::vector<bool>& live) {
+                    asBYTE size    = store_size(opcode_at(address));
+                    short variable = variable_at(address, 0);
+
+                    if (size != 0 && is_temporary(variable, size) && !is_live(live, variable, size))
+                    {
+                        dead[address - _M_begin] = true;
+                        found                    = true;
+                    }
+                });
+            }
+
+            if (!found)
+                dead.clear();
+            return dead;
+        }
+    };
+
+    // Escape analysis of the objects created by ALLOC. The object of a variable stays in the block if the address
+    // of the variable is only pushed by the PSF before its ALLOC, the variable is only read by LoadRObjR and
+    // ChkNullV until the FREE and every instruction between them stays in the code without raising an exception.
+    // The pointer put into the value register by LoadRObjR may only be used to read and write the fields. ALLOC
+    // and FREE themselves leave the code, so the lifetimes of two such objects never overlap and one slot of the
+    // native frame holds all of them
+    class EscapeAnalysis
+    {
+    private:
+        // Larger objects stay on the heap, the slot is addressed with the immediate offsets of the prologue
+        static constexpr inline asUINT max_size = 128;
+
+        asDWORD* _M_begin;
+        asDWORD* _M_end;
+        ByteCodeGraph _M_graph;
+        std::vector<short> _M_escaped;
+
+        // Instructions which neither leave the code nor raise an exception
+        static bool stays_in_code(asEBCInstr instruction)
+        {
+            switch (instruction)
+            {
+                case asBC_ChkRefS:
+                case asBC_ChkNullV:
+                case asBC_ChkNullS:
+                case asBC_RDSPtr:
+                case asBC_LoadThisR:
+                case asBC_LoadRObjR:
+                case asBC_JMPP:
+                case asBC_RET:
+                case asBC_JitEntry:
+                    return false;
+
+                case asBC_SetV4:
+                case asBC_SetV8:
+                case asBC_CpyVtoV4:
+                case asBC_CpyVtoV8:
+                case asBC_CpyVtoR4:
+                case asBC_CpyRtoV4:
+                case asBC_CpyRtoV8:
+                case asBC_PshV8:
+                case asBC_ADDi:
+                case asBC_SUBi:
+                case asBC_MULi:
+                case asBC_ADDIi:
+                case asBC_SUBIi:
+                case asBC_MULIi:
+                case asBC_BAND:
+                case asBC_BOR:
+                case asBC_BXOR:
+                case asBC_BSLL:
+                case asBC_BSRL:
+                case asBC_BSRA:
+                case asBC_CMPi:
+                case asBC_CMPu:
+                case asBC_CMPIi:
+                case asBC_CMPIu:
+                case asBC_IncVi:
+                case asBC_DecVi:
+                case asBC_NEGi:
+                case asBC_BNOT:
+                case asBC_ADDi64:
+                case asBC_SUBi64:
+                case asBC_MULi64:
+                case asBC_BAND64:
+                case asBC_BOR64:
+                case asBC_BXOR64:
+                case asBC_BSLL64:
+                case asBC_BSRL64:
+                case asBC_BSRA64:
+                case asBC_CMPi64:
+                case asBC_CMPu64:
+                case asBC_NEGi64:
+                case asBC_BNOT64:
+                case asBC_sbTOi:
+                case asBC_swTOi:
+                case asBC_ubTOi:
+                case asBC_uwTOi:
+                case asBC_i64TOi:
+                case asBC_uTOi64:
+                case asBC_iTOi64:
+                case asBC_ClrHi:
+                case asBC_TZ:
+                case asBC_TNZ:
+                case asBC_TS:
+                case asBC_TNS:
+                case asBC_TP:
+                case asBC_TNP:
+                    return true;
+
+                default:
+                    return is_local(instruction);
+            }
+        }
+
+        // Value types without constructor and destructor, the FREE only releases the memory
+        static bool is_candidate(asITypeInfo* type, int constructor_id)
+        {
+            asQWORD flags = type->GetFlags();
+            if (constructor_id != 0 || (flags & asOBJ_SCRIPT_OBJECT) || !(flags & asOBJ_VALUE) || !(flags & asOBJ_POD))
+                return false;
+
+            if (type->GetSize() == 0 || type->GetSize() > max_size)
+                return false;
+
+            for (asUINT index = 0; index < type->GetBehaviourCount(); index++)
+            {
+                asEBehaviours behaviour;
+                type->GetBehaviourByIndex(index, &behaviour);
+                if (behaviour == asBEHAVE_DESTRUCT)
+                    return false;
+            }
+            return true;
+        }
+
+        bool uses_variable(asDWORD* address, short variable) const
+        {
+            asUINT count = variable_arguments(asBCInfo[opcode_at(address)].type);
+            for (asUINT argument = 0; argument < count; argument++)
+            {
+                if (overlaps(variable_at(address, argument), sizeof(asQWORD), variable, sizeof(asQWORD)))
+                    return true;
+            }
+            return false;
+        }
+
+        // Returns the FREE of the object created by the ALLOC at address or nullptr if the object escapes
+        asDWORD* find_free(asDWORD* address, asDWORD* block_end, short variable, asITypeInfo* type) const
+        {
+            bool field_pointer = false;
+
+            // The JitEntry which the compiler of AngelScript puts after the ALLOC
+            address += instruction_size(asBC_ALLOC);
+            if (address < block_end && opcode_at(address) == asBC_JitEntry)
+                address += instruction_size(asBC_JitEntry);
+
+            for (; address < block_end; address += instruction_size(opcode_at(address)))
+            {
+                asEBCInstr instruction = opcode_at(address);
+
+                if (instruction == asBC_FREE)
+                {
+                    bool same_object = variable_at(address, 0) == variable &&
+                                       reinterpret_cast<asITypeInfo*>(asBC_PTRARG(address)) == type;
+                    return same_object ? address : nullptr;
+                }
+
+                if (uses_variable(address, variable))
+                {
+                    if (instruction == asBC_LoadRObjR && variable_at(address, 0) == variable)
+                        field_pointer = true;
+                    else if (instruction != asBC_ChkNullV || variable_at(address, 0) != variable)
+                        return nullptr;
+                    continue;
+                }
+
+                // The pointer to a field must not be stored anywhere
+                if (field_pointer &&
+                    (instruction == asBC_CpyRtoV4 || instruction == asBC_CpyRtoV8 || instruction == asBC_PshRPtr))
+                    return nullptr;
+
+                if (!stays_in_code(instruction))
+                    return nullptr;
+            }
+            return nullptr;
+        }
+
+    public:
+        EscapeAnalysis(asDWORD* begin, asDWORD* end) : _M_begin(begin), _M_end(end), _M_graph(begin, end)
+        {
+            // The PSF which pushes the variable for its ALLOC does not take the address
+            for (asDWORD* address = begin; address < end; address += instruction_size(opcode_at(address)))
+            {
+                asEBCInstr instruction = opcode_at(address);
+                asDWORD* next          = address + instruction_size(instruction);
+
+                if (instruction == asBC_PSF && next < end && opcode_at(next) == asBC_ALLOC)
+                    continue;
+
+                if (instruction == asBC_PSF || instruction == asBC_LDV || instruction == asBC_VAR ||
+                    instruction == asBC_LoadVObjR)
+                {
+                    _M_escaped.push_back(variable_at(address, 0));
+                }
+            }
+        }
+
+        StackObjects run()
+        {
+            StackObjects result;
+            result.instructions.assign(static_cast<size_t>(_M_end - _M_begin), false);
+
+            const std::vector<BasicBlock>& blocks = _M_graph.blocks();
+            for (size_t index = 0; index < blocks.size(); index++)
+            {
+                const BasicBlock& block = blocks[index];
+                asDWORD* previous       = nullptr;
+                for (asDWORD* address = block.begin; address < block.end;
+                     previous = address, address += instruction_size(opcode_at(address)))
+                {
+                    if (opcode_at(address) != asBC_ALLOC || previous == nullptr || opcode_at(previous) != asBC_PSF)
+                        continue;
+
+                    asITypeInfo* type  = reinterpret_cast<asITypeInfo*>(asBC_PTRARG(address));
+                    int constructor_id = asBC_INTARG(address + sizeof(asPWORD) / sizeof(asDWORD));
+                    short variable     = variable_at(previous, 0);
+
+                    // Arguments and variables whose address is taken can be read from outside of the block
+                    if (variable - 1 <= 0 || !is_candidate(type, constructor_id) ||
+                        std::any_of(_M_escaped.begin(), _M_escaped.end(), [variable](short escaped) {
+                            return overlaps(variable, sizeof(asQWORD), escaped, sizeof(asQWORD));
+                        }))
+                    {
+                        continue;
+                    }
+
+                    // The JitEntry after the ALLOC starts a block, it belongs to the block of the ALLOC if nothing
+                    // else reaches it. The compilers do not enter the code there, the VM only reaches it after it
+                    // executed the ALLOC itself and then continues with the object on the heap
+                    asDWORD* end   = block.end;
+                    asDWORD* entry = address + instruction_size(asBC_ALLOC);
+                    if (entry == block.end && entry < _M_end && opcode_at(entry) == asBC_JitEntry)
+                    {
+                        const BasicBlock& next = blocks[_M_graph.block_at(entry)];
+                        if (next.predecessors.size() == 1 && next.predecessors[0] == index)
+                            end = next.end;
+                    }
+
+                    asDWORD* free = find_free(address, end, variable, type);
+                    if (free == nullptr)
+                        continue;
+
+                    result.instructions[address - _M_begin] = true;
+                    result.instructions[free - _M_begin]    = true;
+                    if (entry < free && opcode_at(entry) == asBC_JitEntry)
+                        result.instructions[entry - _M_begin] = true;
+                    result.size = std::max(result.size, (type->GetSize() + 15) & ~static_cast<asUINT>(15));
+                }
+            }
+
+            if (result.size == 0)
+                result.instructions.clear();
+            return result;
+        }
+    };
+
+    std::vector<ConstantFold> propagate_constants(asDWORD* begin, asDWORD* end, bool suspend_exits)
+    {
+        return ConstantPropagation(begin, end, suspend_exits).run();
+    }
+
+    std::vector<bool> find_redundant_null_checks(asDWORD* begin, asDWORD* end, bool suspend_exits, bool is_method)
+    {
+        return NullCheckAnalysis(begin, end, suspend_exits, is_method).run();
+    }
+
+    std::vector<bool> find_dead_stores(asDWORD* begin, asDWORD* end, bool suspend_exits)
+    {
+        return LivenessAnalysis(begin, end, suspend_exits).run();
+    }
+
+    StackObjects find_stack_objects(asDWORD* begin, asDWORD* end)
+    {
+        return EscapeAnalysis(begin, end).run();
+    }
+}// namespace JIT
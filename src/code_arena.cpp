@@ -0,0 +1,414 @@
+// MIT License
+
+// Copyright (c) 2023 Programier (Vladyslav Reminskyi)
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <atomic>
+#include <code_arena.hpp>
+#include <cstring>
+#include <string_view>
+
+namespace JIT
+{
+    static JitAllocator* create_allocator(const CodeArena::Options& options)
+    {
+        JitAllocator::CreateParams params;
+        params.blockSize = options.block_size;
+
+        if (options.large_pages)
+        {
+            params.options |= JitAllocatorOptions::kUseLargePages;
+            params.options |= JitAllocatorOptions::kAlignBlockSizeToLargePage;
+        }
+
+        return new JitAllocator(&params);
+    }
+
+    template<typename T>
+    static void append(std::vector<uint8_t>& image, const T& value)
+    {
+        const uint8_t* data = reinterpret_cast<const uint8_t*>(&value);
+        image.insert(image.end(), data, data + sizeof(value));
+    }
+
+    // Everything which defines the final code, except the base address
+    static std::vector<uint8_t> create_image(CodeHolder* code)
+    {
+        std::vector<uint8_t> image;
+
+        for (Section* section : code->sections())
+        {
+            append(image, section->offset());
+            append(image, section->virtualSize());
+            image.insert(image.end(), section->data(), section->data() + section->bufferSize());
+        }
+
+        for (const RelocEntry* entry : code->relocEntries())
+        {
+            append(image, entry->relocType());
+            append(image, entry->sourceSectionId());
+            append(image, entry->targetSectionId());
+            append(image, entry->sourceOffset());
+            append(image, entry->payload());
+            append(image, entry->format().regionSize());
+            append(image, entry->format().valueOffset());
+            append(image, entry->format().valueSize());
+        }
+
+        return image;
+    }
+
+    CodeArena::CodeArena()
+    {
+        _M_shared.allocator = std::make_unique<JitAllocator>();
+        _M_clock_hand       = _M_clock.end();
+    }
+
+    CodeArena::~CodeArena()
+    {
+        for (auto& [module, arena] : _M_modules)
+        {
+            delete arena;
+        }
+    }
+
+    void CodeArena::options(const Options& options)
+    {
+        _M_options = options;
+    }
+
+    const CodeArena::Options& CodeArena::options() const
+    {
+        return _M_options;
+    }
+
+    CodeArena::Arena* CodeArena::arena_for(asIScriptModule* module)
+    {
+        if (_M_options.mode == Mode::Shared || module == nullptr)
+            return &_M_shared;
+
+        Arena*& arena = _M_modules[module];
+        if (arena == nullptr)
+        {
+            arena         = new Arena();
+            arena->module = module;
+            arena->allocator.reset(create_allocator(_M_options));
+        }
+        return arena;
+    }
+
+    void CodeArena::release_arena(Arena* arena)
+    {
+        auto it = _M_modules.find(arena->module);
+        if (it != _M_modules.end() && it->second == arena)
+            _M_modules.erase(it);
+
+        // Destroying the allocator releases all of its blocks at once
+        delete arena;
+    }
+
+    std::unique_ptr<CodeArena::RuntimeData> CodeArena::create_runtime_data() const
+    {
+        auto data = std::make_unique<RuntimeData>();
+        if (_M_options.budget != 0)
+            data->usage = std::make_unique<Usage>();
+        return data;
+    }
+
+    // Same steps as JitRuntime::_add, but with the allocator of the arena
+    Error CodeArena::add(asIScriptFunction* function, CodeHolder* code, void** output,
+                         std::unique_ptr<RuntimeData> data)
+    {
+        *output = nullptr;
+
+        if (data && data->empty())
+            data.reset();
+
+        ASMJIT_PROPAGATE(code->flatten());
+        ASMJIT_PROPAGATE(code->resolveUnresolvedLinks());
+
+        size_t estimated_size = code->codeSize();
+        if (estimated_size == 0)
+            return kErrorNoCodeGenerated;
+
+        std::vector<uint8_t> image;
+        size_t hash = 0;
+
+        if (_M_options.deduplicate && data == nullptr)
+        {
+            image = create_image(code);
+            hash  = std::hash<std::string_view>()(
+                    std::string_view(reinterpret_cast<const char*>(image.data()), image.size()));
+
+            if (void* shared = find_image(image, hash))
+            {
+                _M_functions[shared].references += 1;
+                _M_shared_count += 1;
+                *output = shared;
+                return kErrorOk;
+            }
+        }
+
+        Arena* arena = arena_for(function->GetModule());
+        JitAllocator::Span span;
+        ASMJIT_PROPAGATE(arena->allocator->alloc(span, estimated_size));
+
+        Error error = code->relocateToBase(reinterpret_cast<uintptr_t>(span.rx()));
+        if (error != kErrorOk)
+        {
+            arena->allocator->release(span.rx());
+            return error;
+        }
+
+        size_t code_size = code->codeSize();
+        arena->allocator->write(span, [&](JitAllocator::Span& span) noexcept -> Error {
+            uint8_t* rw = static_cast<uint8_t*>(span.rw());
+
+            for (Section* section : code->sections())
+            {
+                size_t offset       = static_cast<size_t>(section->offset());
+                size_t buffer_size  = static_cast<size_t>(section->bufferSize());
+                size_t virtual_size = static_cast<size_t>(section->virtualSize());
+
+                std::memcpy(rw + offset, section->data(), buffer_size);
+                if (virtual_size > buffer_size)
+                    std::memset(rw + offset + buffer_size, 0, virtual_size - buffer_size);
+            }
+
+            span.shrink(code_size);
+            return kErrorOk;
+        });
+
+        arena->functions += 1;
+
+        Function& info = _M_functions[span.rx()];
+        info.arena     = arena;
+        info.function  = function;
+        info.size      = span.size();
+        info.usage     = data ? data->usage.get() : nullptr;
+        info.data      = std::move(data);
+        info.clock     = _M_clock.end();
+
+        if (!image.empty())
+        {
+            info.hash  = hash;
+            info.image = std::move(image);
+            _M_images.emplace(hash, span.rx());
+        }
+
+        _M_code_bytes += info.size;
+        *output        = span.rx();
+
+        if (info.usage)
+        {
+            info.clock = _M_clock.insert(_M_clock_hand, span.rx());
+            evict();
+        }
+        return kErrorOk;
+    }
+
+    void* CodeArena::find_image(const std::vector<uint8_t>& image, size_t hash)
+    {
+        auto range = _M_images.equal_range(hash);
+        for (auto it = range.first; it != range.second; ++it)
+        {
+            if (_M_functions[it->second].image == image)
+                return it->second;
+        }
+        return nullptr;
+    }
+
+    void CodeArena::forget(Function& function)
+    {
+        if (function.clock != _M_clock.end())
+        {
+            if (_M_clock_hand == function.clock)
+                ++_M_clock_hand;
+            _M_clock.erase(function.clock);
+            function.clock = _M_clock.end();
+        }
+
+        if (function.state == State::Candidate || function.state == State::Disabled)
+            _M_pending_bytes -= function.size;
+        _M_code_bytes -= function.size;
+    }
+
+    void CodeArena::release(void* code)
+    {
+        auto it = _M_functions.find(code);
+        if (it == _M_functions.end())
+            return;
+
+        if (it->second.references > 1)
+        {
+            it->second.references -= 1;
+            _M_shared_count -= 1;
+            return;
+        }
+
+        if (!it->second.image.empty())
+        {
+            auto range = _M_images.equal_range(it->second.hash);
+            for (auto image = range.first; image != range.second; ++image)
+            {
+                if (image->second == code)
+                {
+                    _M_images.erase(image);
+                    break;
+                }
+            }
+        }
+
+        Arena* arena = it->second.arena;
+        forget(it->second);
+        _M_functions.erase(it);
+        arena->functions -= 1;
+
+        if (arena == &_M_shared)
+        {
+            arena->allocator->release(code);
+        }
+        else if (arena->functions == 0)
+        {
+            release_arena(arena);
+        }
+    }
+
+    // The VM enters the compiled code only through JitEntry instructions with a non zero argument. Only called from
+    // collect(), no VM reads the arguments while they are reset
+    void CodeArena::disable(Function& function)
+    {
+        asUINT length;
+        asDWORD* byte_code = function.function->GetByteCode(&length);
+        asDWORD* end       = byte_code + length;
+
+        while (byte_code < end)
+        {
+            asEBCInstr instruction = static_cast<asEBCInstr>(*reinterpret_cast<asBYTE*>(byte_code));
+            if (instruction == asBC_JitEntry)
+                asBC_PTRARG(byte_code) = 0;
+            byte_code += asBCTypeSize[asBCInfo[instruction].type];
+        }
+
+        function.state = State::Disabled;
+        _M_evictions += 1;
+    }
+
+    // Only called from collect(), so no thread can be about to enter the code of a disabled function. Code which
+    // a thread is still executing stays until a later collect(). The first bytes stay allocated until the function
+    // is released, so the address never belongs to another function
+    void CodeArena::reclaim()
+    {
+        for (auto it = _M_clock.begin(); it != _M_clock.end();)
+        {
+            void* code         = *it;
+            Function& function = _M_functions[code];
+            ++it;
+
+            if (function.state != State::Disabled ||
+                std::atomic_ref<uint32_t>(function.usage->active).load(std::memory_order_acquire) != 0)
+                continue;
+
+            JitAllocator::Span span;
+            if (function.arena->allocator->query(span, code) != kErrorOk ||
+                function.arena->allocator->shrink(span, 1) != kErrorOk)
+                continue;
+
+            forget(function);
+            if (function.data)
+                function.data->safepoints.clear();
+
+            function.state = State::Evicted;
+            function.size  = span.size();
+            _M_code_bytes += function.size;
+            _M_reclaimed += 1;
+        }
+    }
+
+    void CodeArena::evict()
+    {
+        size_t budget = _M_options.budget;
+        size_t steps  = _M_clock.size() * 2;
+
+        while (budget != 0 && _M_code_bytes - _M_pending_bytes > budget && steps-- > 0)
+        {
+            if (_M_clock_hand == _M_clock.end())
+                _M_clock_hand = _M_clock.begin();
+
+            Function& function = _M_functions[*_M_clock_hand];
+            ++_M_clock_hand;
+
+            if (function.state != State::Live)
+                continue;
+
+            // Second chance for functions entered since the last sweep
+            std::atomic_ref<uint32_t> referenced(function.usage->referenced);
+            if (referenced.load(std::memory_order_relaxed) != 0)
+            {
+                referenced.store(0, std::memory_order_relaxed);
+                continue;
+            }
+
+            function.state = State::Candidate;
+            _M_pending_bytes += function.size;
+        }
+    }
+
+    void CodeArena::collect()
+    {
+        evict();
+
+        for (void* code : _M_clock)
+        {
+            Function& function = _M_functions[code];
+            if (function.state == State::Candidate)
+                disable(function);
+        }
+
+        reclaim();
+    }
+
+    CodeArena::Statistics CodeArena::statistics() const
+    {
+        Statistics result;
+        result.arenas        = _M_modules.size();
+        result.functions     = _M_functions.size();
+        result.code_bytes    = _M_code_bytes;
+        result.pending_bytes = _M_pending_bytes;
+        result.evictions     = _M_evictions;
+        result.reclaimed     = _M_reclaimed;
+        result.shared        = _M_shared_count;
+
+        auto append = [&result](const Arena* arena) {
+            JitAllocator::Statistics statistics = arena->allocator->statistics();
+            result.used_bytes += statistics.usedSize();
+            result.reserved_bytes += statistics.reservedSize();
+            result.blocks += statistics.blockCount();
+        };
+
+        append(&_M_shared);
+        for (auto& [module, arena] : _M_modules)
+        {
+            append(arena);
+        }
+        return result;
+    }
+}// namespace JIT
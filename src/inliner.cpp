@@ -0,0 +1,305 @@
+// MIT License
+
+// Copyright (c) 2023 Programier (Vladyslav Reminskyi)
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <bytecode_analysis.hpp>
+#include <inliner.hpp>
+
+namespace JIT
+{
+    static constexpr inline asUINT max_inline_frame_size = 2048;
+
+    // Instructions which both compilers emit without a native call and without a return to the VM. None of them
+    // touches the VM stack, so the callee cannot push anything. LoadThisR is emitted without its null check, the
+    // caller checks the object before the inlined code. JitEntry and SUSPEND are dropped
+    static bool is_inlineable(asEBCInstr instruction)
+    {
+        switch (instruction)
+        {
+            case asBC_NOT:
+            case asBC_LdGRdR4:
+            case asBC_RET:
+            case asBC_JMP:
+            case asBC_JZ:
+            case asBC_JNZ:
+            case asBC_JS:
+            case asBC_JNS:
+            case asBC_JP:
+            case asBC_JNP:
+            case asBC_JLowZ:
+            case asBC_JLowNZ:
+            case asBC_TZ:
+            case asBC_TNZ:
+            case asBC_TS:
+            case asBC_TNS:
+            case asBC_TP:
+            case asBC_TNP:
+            case asBC_NEGi:
+            case asBC_NEGf:
+            case asBC_NEGd:
+            case asBC_INCi16:
+            case asBC_INCi8:
+            case asBC_DECi16:
+            case asBC_DECi8:
+            case asBC_INCi:
+            case asBC_DECi:
+            case asBC_INCf:
+            case asBC_DECf:
+            case asBC_INCd:
+            case asBC_DECd:
+            case asBC_IncVi:
+            case asBC_DecVi:
+            case asBC_BNOT:
+            case asBC_BAND:
+            case asBC_BOR:
+            case asBC_BXOR:
+            case asBC_BSLL:
+            case asBC_BSRL:
+            case asBC_BSRA:
+            case asBC_CMPd:
+            case asBC_CMPu:
+            case asBC_CMPf:
+            case asBC_CMPi:
+            case asBC_CMPIi:
+            case asBC_CMPIf:
+            case asBC_CMPIu:
+            case asBC_LOADOBJ:
+            case asBC_STOREOBJ:
+            case asBC_ClrVPtr:
+            case asBC_SetV1:
+            case asBC_SetV2:
+            case asBC_SetV4:
+            case asBC_SetV8:
+            case asBC_SetG4:
+            case asBC_CpyVtoV4:
+            case asBC_CpyVtoV8:
+            case asBC_CpyVtoR4:
+            case asBC_CpyVtoR8:
+            case asBC_CpyVtoG4:
+            case asBC_CpyRtoV4:
+            case asBC_CpyRtoV8:
+            case asBC_CpyGtoV4:
+            case asBC_WRTV1:
+            case asBC_WRTV2:
+            case asBC_WRTV4:
+            case asBC_WRTV8:
+            case asBC_RDR1:
+            case asBC_RDR2:
+            case asBC_RDR4:
+            case asBC_RDR8:
+            case asBC_LDG:
+            case asBC_LDV:
+            case asBC_CmpPtr:
+            case asBC_iTOf:
+            case asBC_fTOi:
+            case asBC_fTOu:
+            case asBC_sbTOi:
+            case asBC_swTOi:
+            case asBC_ubTOi:
+            case asBC_uwTOi:
+            case asBC_dTOi:
+            case asBC_dTOu:
+            case asBC_dTOf:
+            case asBC_iTOd:
+            case asBC_fTOd:
+            case asBC_iTOb:
+            case asBC_iTOw:
+            case asBC_i64TOi:
+            case asBC_uTOi64:
+            case asBC_iTOi64:
+            case asBC_fTOi64:
+            case asBC_dTOi64:
+            case asBC_i64TOf:
+            case asBC_i64TOd:
+            case asBC_ADDi:
+            case asBC_SUBi:
+            case asBC_MULi:
+            case asBC_DIVi:
+            case asBC_MODi:
+            case asBC_DIVu:
+            case asBC_MODu:
+            case asBC_ADDf:
+            case asBC_SUBf:
+            case asBC_MULf:
+            case asBC_DIVf:
+            case asBC_ADDd:
+            case asBC_SUBd:
+            case asBC_MULd:
+            case asBC_DIVd:
+            case asBC_ADDIi:
+            case asBC_SUBIi:
+            case asBC_MULIi:
+            case asBC_ADDIf:
+            case asBC_SUBIf:
+            case asBC_MULIf:
+            case asBC_NEGi64:
+            case asBC_INCi64:
+            case asBC_DECi64:
+            case asBC_BNOT64:
+            case asBC_ADDi64:
+            case asBC_SUBi64:
+            case asBC_MULi64:
+            case asBC_DIVi64:
+            case asBC_MODi64:
+            case asBC_DIVu64:
+            case asBC_MODu64:
+            case asBC_BAND64:
+            case asBC_BOR64:
+            case asBC_BXOR64:
+            case asBC_BSLL64:
+            case asBC_BSRL64:
+            case asBC_BSRA64:
+            case asBC_CMPi64:
+            case asBC_CMPu64:
+            case asBC_ClrHi:
+            case asBC_LoadVObjR:
+            case asBC_LoadThisR:
+            case asBC_JitEntry:
+            case asBC_SUSPEND:
+                return true;
+
+            default:
+                return false;
+        }
+    }
+
+    static bool is_jump(asEBCInstr instruction)
+    {
+        switch (instruction)
+        {
+            case asBC_JMP:
+            case asBC_JZ:
+            case asBC_JNZ:
+            case asBC_JS:
+            case asBC_JNS:
+            case asBC_JP:
+            case asBC_JNP:
+            case asBC_JLowZ:
+            case asBC_JLowNZ:
+                return true;
+
+            default:
+                return false;
+        }
+    }
+
+    // The implementation of a virtual method is only known if no class can override it
+    static asIScriptFunction* devirtualize(asIScriptFunction* function)
+    {
+        asITypeInfo* type = function->GetObjectType();
+        if (type == nullptr || (!function->IsFinal() && (type->GetFlags() & asOBJ_NOINHERIT) == 0))
+            return nullptr;
+
+        for (asUINT index = 0; index < type->GetMethodCount(); index++)
+        {
+            if (type->GetMethodByIndex(index, true) == function)
+                return type->GetMethodByIndex(index, false);
+        }
+        return nullptr;
+    }
+
+    const char* inline_candidate(asIScriptFunction* caller, asIScriptFunction* callee, const InlineOptions& options,
+                                 asUINT budget, InlineCandidate& candidate)
+    {
+        if (!options.enabled)
+            return "disabled";
+
+        if (callee && callee->GetFuncType() == asFUNC_VIRTUAL)
+        {
+            callee = devirtualize(callee);
+            if (callee == nullptr)
+                return "virtual method can be overridden";
+        }
+
+        if (callee && callee->GetFuncType() == asFUNC_INTERFACE)
+            return "interface method";
+
+        if (callee == nullptr || callee->GetFuncType() != asFUNC_SCRIPT)
+            return "not a script function";
+
+        if (callee == caller)
+            return "recursive";
+
+        asUINT length = 0;
+        asDWORD* begin = callee->GetByteCode(&length);
+        if (begin == nullptr || length == 0)
+            return "no byte code";
+
+        if (length > options.max_callee_size)
+            return "callee too large";
+
+        if (length > budget)
+            return "growth limit reached";
+
+        candidate.function       = callee;
+        candidate.begin          = begin;
+        candidate.end            = begin + length;
+        candidate.size           = length;
+        candidate.variables_size = 0;
+        candidate.arguments_size = 0;
+        candidate.has_this       = callee->GetObjectType() != nullptr;
+
+        bool has_return = false;
+        for (asDWORD* address = begin; address < candidate.end;)
+        {
+            asEBCInstr instruction = static_cast<asEBCInstr>(*reinterpret_cast<asBYTE*>(address));
+            if (!is_inlineable(instruction))
+                return "instruction leaves the JIT code";
+
+            // Without backward jumps the SUSPEND instructions of the callee can be dropped
+            if (is_jump(instruction))
+            {
+                asDWORD* target = address + asBC_INTARG(address) + asBCTypeSize[asBCInfo[instruction].type];
+                if (target <= address || target >= candidate.end)
+                    return "loop";
+            }
+
+            if (instruction == asBC_RET)
+            {
+                asUINT arguments = asBC_WORDARG0(address) * sizeof(asDWORD);
+                if (has_return && arguments != candidate.arguments_size)
+                    return "unknown argument size";
+
+                candidate.arguments_size = arguments;
+                has_return               = true;
+            }
+
+            asUINT variables = variable_arguments(asBCInfo[instruction].type);
+            for (asUINT index = 0; index < variables; index++)
+            {
+                short offset = *(reinterpret_cast<short*>(address) + index + 1);
+                if (offset > 0 && static_cast<asUINT>(offset) * sizeof(asDWORD) > candidate.variables_size)
+                    candidate.variables_size = static_cast<asUINT>(offset) * sizeof(asDWORD);
+            }
+
+            address += asBCTypeSize[asBCInfo[instruction].type];
+        }
+
+        if (!has_return)
+            return "no return";
+
+        if (candidate.variables_size + candidate.arguments_size > max_inline_frame_size)
+            return "frame too large";
+
+        return nullptr;
+    }
+}// namespace JIT
@@ -0,0 +1,85 @@
+// MIT License
+
+// Copyright (c) 2023 Programier (Vladyslav Reminskyi)
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <jit_context.hpp>
+
+namespace JIT
+{
+    JitContext::JitContext(const CodeArena::Options& options)
+    {
+        _M_code.options(options);
+    }
+
+    const Environment& JitContext::environment() const
+    {
+        return _M_runtime.environment();
+    }
+
+    const CpuFeatures& JitContext::cpu_features() const
+    {
+        return _M_runtime.cpuFeatures();
+    }
+
+    void JitContext::options(const CodeArena::Options& options)
+    {
+        std::lock_guard lock(_M_mutex);
+        _M_code.options(options);
+    }
+
+    CodeArena::Options JitContext::options() const
+    {
+        std::lock_guard lock(_M_mutex);
+        return _M_code.options();
+    }
+
+    std::unique_ptr<CodeArena::RuntimeData> JitContext::create_runtime_data() const
+    {
+        std::lock_guard lock(_M_mutex);
+        return _M_code.create_runtime_data();
+    }
+
+    Error JitContext::add(asIScriptFunction* function, CodeHolder* code, void** output,
+                          std::unique_ptr<CodeArena::RuntimeData> data)
+    {
+        std::lock_guard lock(_M_mutex);
+        return _M_code.add(function, code, output, std::move(data));
+    }
+
+    void JitContext::release(void* code)
+    {
+        std::lock_guard lock(_M_mutex);
+        _M_code.release(code);
+    }
+
+    void JitContext::collect()
+    {
+        std::lock_guard lock(_M_mutex);
+        _M_code.collect();
+    }
+
+    CodeArena::Statistics JitContext::statistics() const
+    {
+        std::lock_guard lock(_M_mutex);
+        return _M_code.statistics();
+    }
+}// namespace JIT
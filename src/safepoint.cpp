@@ -0,0 +1,238 @@
+// MIT License
+
+// Copyright (c) 2023 Programier (Vladyslav Reminskyi)
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <atomic>
+#include <mutex>
+#include <safepoint.hpp>
+#include <unordered_map>
+
+#if defined(__linux__) || defined(__APPLE__)
+#define SAFEPOINT_SIGNALS 1
+#include <csignal>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+#else
+#define SAFEPOINT_SIGNALS 0
+#endif
+
+namespace JIT
+{
+    // The registry is read by the signal handler, so it is guarded by a spin lock instead of a mutex.
+    // The fault is synchronous, the faulting thread never holds the lock itself
+    class SafepointRegistry
+    {
+    private:
+        std::atomic_flag _M_lock = ATOMIC_FLAG_INIT;
+        std::unordered_map<uintptr_t, uintptr_t> _M_stubs;
+
+        void lock()
+        {
+            while (_M_lock.test_and_set(std::memory_order_acquire))
+            {
+            }
+        }
+
+        void unlock()
+        {
+            _M_lock.clear(std::memory_order_release);
+        }
+
+    public:
+        void add(uintptr_t poll, uintptr_t stub)
+        {
+            lock();
+            _M_stubs[poll] = stub;
+            unlock();
+        }
+
+        // A reclaimed function can leave its addresses to another function, only remove the own entry
+        void remove(uintptr_t poll, uintptr_t stub)
+        {
+            lock();
+            auto it = _M_stubs.find(poll);
+            if (it != _M_stubs.end() && it->second == stub)
+                _M_stubs.erase(it);
+            unlock();
+        }
+
+        uintptr_t find(uintptr_t poll)
+        {
+            lock();
+            auto it          = _M_stubs.find(poll);
+            uintptr_t result = it != _M_stubs.end() ? it->second : 0;
+            unlock();
+            return result;
+        }
+    };
+
+    static SafepointRegistry registry;
+
+#if SAFEPOINT_SIGNALS
+    static void* safepoint_page = nullptr;
+    static size_t page_size     = 0;
+    static struct sigaction previous_segv;
+    static struct sigaction previous_bus;
+
+    static uintptr_t& program_counter(ucontext_t* context)
+    {
+#if defined(__linux__) && defined(__x86_64__)
+        return reinterpret_cast<uintptr_t&>(context->uc_mcontext.gregs[REG_RIP]);
+#elif defined(__linux__) && defined(__aarch64__)
+        return reinterpret_cast<uintptr_t&>(context->uc_mcontext.pc);
+#elif defined(__APPLE__) && defined(__x86_64__)
+        return reinterpret_cast<uintptr_t&>(context->uc_mcontext->__ss.__rip);
+#elif defined(__APPLE__) && defined(__aarch64__)
+        return reinterpret_cast<uintptr_t&>(context->uc_mcontext->__ss.__pc);
+#else
+#error "Unsupported architecture for the safepoint handler"
+#endif
+    }
+
+    static void forward_signal(int signal, siginfo_t* info, void* context)
+    {
+        const struct sigaction& previous = signal == SIGBUS ? previous_bus : previous_segv;
+
+        if (previous.sa_flags & SA_SIGINFO)
+        {
+            previous.sa_sigaction(signal, info, context);
+        }
+        else if (previous.sa_handler == SIG_DFL)
+        {
+            // Returning from the handler repeats the fault, which is then handled by the default action
+            std::signal(signal, SIG_DFL);
+        }
+        else if (previous.sa_handler != SIG_IGN)
+        {
+            previous.sa_handler(signal);
+        }
+    }
+
+    static void handle_fault(int signal, siginfo_t* info, void* context)
+    {
+        uintptr_t address = reinterpret_cast<uintptr_t>(info->si_addr);
+        uintptr_t page    = reinterpret_cast<uintptr_t>(safepoint_page);
+
+        if (address >= page && address < page + page_size)
+        {
+            uintptr_t& pc  = program_counter(static_cast<ucontext_t*>(context));
+            uintptr_t stub = registry.find(pc);
+            if (stub != 0)
+            {
+                pc = stub;
+                return;
+            }
+        }
+
+        forward_signal(signal, info, context);
+    }
+#endif
+
+    bool Safepoint::install_handler()
+    {
+#if SAFEPOINT_SIGNALS
+        static std::once_flag installed;
+        static bool result = false;
+
+        std::call_once(installed, []() {
+            page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+            void* page = mmap(nullptr, page_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (page == MAP_FAILED)
+                return;
+
+            struct sigaction action = {};
+            action.sa_sigaction     = handle_fault;
+            action.sa_flags         = SA_SIGINFO | SA_ONSTACK;
+            sigemptyset(&action.sa_mask);
+
+            if (sigaction(SIGSEGV, &action, &previous_segv) != 0 || sigaction(SIGBUS, &action, &previous_bus) != 0)
+            {
+                munmap(page, page_size);
+                return;
+            }
+
+            safepoint_page = page;
+            result         = true;
+        });
+        return result;
+#else
+        return false;
+#endif
+    }
+
+    const void* Safepoint::page()
+    {
+#if SAFEPOINT_SIGNALS
+        return safepoint_page;
+#else
+        return nullptr;
+#endif
+    }
+
+    bool Safepoint::request_stop()
+    {
+#if SAFEPOINT_SIGNALS
+        return safepoint_page && mprotect(safepoint_page, page_size, PROT_NONE) == 0;
+#else
+        return false;
+#endif
+    }
+
+    bool Safepoint::resume()
+    {
+#if SAFEPOINT_SIGNALS
+        return safepoint_page && mprotect(safepoint_page, page_size, PROT_READ) == 0;
+#else
+        return false;
+#endif
+    }
+
+    SafepointTable::~SafepointTable()
+    {
+        clear();
+    }
+
+    void SafepointTable::record(size_t poll_offset, size_t stub_offset)
+    {
+        _M_offsets.emplace_back(poll_offset, stub_offset);
+    }
+
+    void SafepointTable::install(void* code)
+    {
+        uintptr_t base = reinterpret_cast<uintptr_t>(code);
+        for (auto& [poll, stub] : _M_offsets)
+        {
+            _M_installed.emplace_back(base + poll, base + stub);
+            registry.add(base + poll, base + stub);
+        }
+    }
+
+    void SafepointTable::clear()
+    {
+        for (auto& [poll, stub] : _M_installed)
+        {
+            registry.remove(poll, stub);
+        }
+        _M_installed.clear();
+    }
+}// namespace JIT
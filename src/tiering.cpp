@@ -0,0 +1,133 @@
+// MIT License
+
+// Copyright (c) 2023 Programier (Vladyslav Reminskyi)
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <fstream>
+#include <sstream>
+#include <tiering.hpp>
+
+namespace JIT
+{
+    const CallProfile* TierProfile::call(asUINT offset) const
+    {
+        auto it = calls.find(offset);
+        return it == calls.end() ? nullptr : it->second;
+    }
+
+    const BranchProfile* TierProfile::branch(asUINT offset) const
+    {
+        auto it = branches.find(offset);
+        return it == branches.end() ? nullptr : it->second;
+    }
+
+    std::string BranchProfiles::key(asIScriptFunction* function)
+    {
+        const char* module = function->GetModuleName();
+        return std::string(module ? module : "") + '\t' + function->GetDeclaration(true, true, true);
+    }
+
+    void BranchProfiles::record(asIScriptFunction* function, asUINT offset, const BranchProfile& profile)
+    {
+        _M_functions[key(function)][offset] = profile;
+    }
+
+    const BranchProfiles::Function* BranchProfiles::find(asIScriptFunction* function) const
+    {
+        if (_M_functions.empty())
+            return nullptr;
+
+        auto it = _M_functions.find(key(function));
+        return it == _M_functions.end() ? nullptr : &it->second;
+    }
+
+    bool BranchProfiles::save(const char* path) const
+    {
+        std::ofstream file(path);
+        if (!file)
+            return false;
+
+        for (auto& [function, branches] : _M_functions)
+        {
+            for (auto& [offset, profile] : branches)
+            {
+                file << function << '\t' << offset << '\t' << profile.executions << '\t' << profile.fall_through
+                     << '\n';
+            }
+        }
+        return static_cast<bool>(file);
+    }
+
+    // Lines which cannot be parsed are skipped, the profile only changes the layout of the code
+    bool BranchProfiles::load(const char* path)
+    {
+        std::ifstream file(path);
+        if (!file)
+            return false;
+
+        std::string line;
+        while (std::getline(file, line))
+        {
+            size_t module_end      = line.find('\t');
+            size_t declaration_end = module_end == std::string::npos ? module_end : line.find('\t', module_end + 1);
+            if (declaration_end == std::string::npos)
+                continue;
+
+            std::istringstream counters(line.substr(declaration_end + 1));
+            asUINT offset;
+            BranchProfile profile;
+            if (counters >> offset >> profile.executions >> profile.fall_through &&
+                profile.fall_through <= profile.executions)
+            {
+                _M_functions[line.substr(0, declaration_end)][offset] = profile;
+            }
+        }
+        return true;
+    }
+
+    size_t BranchProfiles::size() const
+    {
+        size_t branches = 0;
+        for (auto& [function, profiles] : _M_functions) branches += profiles.size();
+        return branches;
+    }
+
+    void BranchProfiles::clear()
+    {
+        _M_functions.clear();
+    }
+
+    asIScriptFunction* find_implementation(asITypeInfo* type, asIScriptFunction* method)
+    {
+        if (type == nullptr || method == nullptr)
+            return nullptr;
+
+        // The declaration without the object name contains the return type, the name, the parameters and the const
+        // of the method
+        std::string declaration = method->GetDeclaration(false, false, false);
+        for (asUINT index = 0; index < type->GetMethodCount(); index++)
+        {
+            asIScriptFunction* implementation = type->GetMethodByIndex(index, false);
+            if (implementation && declaration == implementation->GetDeclaration(false, false, false))
+                return implementation;
+        }
+        return nullptr;
+    }
+}// namespace JIT
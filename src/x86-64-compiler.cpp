@@ -22,19 +22,24 @@
 
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cinttypes>
 #include <cmath>
 #include <cstring>
+#include <mutex>
 #include <stdexcept>
 #include <x86-64/compiler.hpp>
 
+#ifndef WITH_LOG
 #define WITH_LOG 1
+#endif
 #define SHOW_JIT_ENTRY 1
 
 #if WITH_LOG
 #define logf printf
 #else
-#define logf
+#define logf(...) ((void) 0)
 #endif
 
 #define STDCALL_DECL
@@ -85,6 +90,7 @@ namespace JIT
     static constexpr inline int32_t half_ptr_size      = static_cast<int32_t>(sizeof(void*) / 2);
     static constexpr inline int32_t ptr_size_1         = static_cast<int32_t>(sizeof(void*) * 1);
     static constexpr inline int32_t vm_register_offset = -ptr_size_1;
+    static constexpr inline int32_t byte_code_offset   = -ptr_size_1 * 2;
 
     static constexpr inline size_t const_pool_size = 64;
 
@@ -92,6 +98,8 @@ namespace JIT
     static constexpr inline Gpq stack_pointer MAYBE_UNUSED = rsp;
     static constexpr inline Gpq base_pointer MAYBE_UNUSED  = rbp;
 
+    // The first free register is the accumulator, only it can load and store a 64 bit absolute address, which
+    // the handlers of the globals use instead of materialising the address in a register
     static constexpr inline Gpq qword_free_1 MAYBE_UNUSED = rax;
     static constexpr inline Gpq qword_free_2 MAYBE_UNUSED = rbx;
     static constexpr inline Gpq qword_free_3 MAYBE_UNUSED = r14;
@@ -137,6 +145,9 @@ namespace JIT
 
     static constexpr inline Gpq restore_register = r13;
 
+    // Caller saved registers which hold the variables of the innermost loops
+    static constexpr inline Gpq loop_cache_registers[] = {rcx, rdx, rsi, rdi};
+
     static constexpr inline Gpq vm_stack_frame_pointer MAYBE_UNUSED = r8;
     static constexpr inline Gpq vm_stack_pointer MAYBE_UNUSED       = r9;
     static constexpr inline Gpq vm_value_q MAYBE_UNUSED             = r10;
@@ -151,6 +162,8 @@ namespace JIT
     static constexpr inline Gpq stack_pointer MAYBE_UNUSED = rsp;
     static constexpr inline Gpq base_pointer MAYBE_UNUSED  = rbp;
 
+    // The first free register is the accumulator, only it can load and store a 64 bit absolute address, which
+    // the handlers of the globals use instead of materialising the address in a register
     static constexpr inline Gpq qword_free_1 MAYBE_UNUSED = rax;
     static constexpr inline Gpq qword_free_2 MAYBE_UNUSED = rbx;
     static constexpr inline Gpq qword_free_3 MAYBE_UNUSED = r14;
@@ -196,6 +209,9 @@ namespace JIT
 
     static constexpr inline Gpq restore_register = r13;
 
+    // Caller saved registers which hold the variables of the innermost loops, rsi and rdi are callee saved here
+    static constexpr inline Gpq loop_cache_registers[] = {rcx, rdx};
+
     static constexpr inline Gpq vm_stack_frame_pointer MAYBE_UNUSED = r8;
     static constexpr inline Gpq vm_stack_pointer MAYBE_UNUSED       = r9;
     static constexpr inline Gpq vm_value_q MAYBE_UNUSED             = r10;
@@ -257,6 +273,187 @@ namespace JIT
         throw std::runtime_error("Attempting to access a null pointer");
     }
 
+    // Used by ALLOC for value types, the VM calls the same functions through the engine
+    static void* STDCALL_DECL create_object(asIScriptEngine* engine, asITypeInfo* type)
+    {
+        return engine->CreateScriptObject(type);
+    }
+
+    static void* STDCALL_DECL allocate_object(asITypeInfo* type)
+    {
+        return asAllocMem(type->GetSize());
+    }
+
+    static void STDCALL_DECL release_object(asIScriptEngine* engine, void* object, asITypeInfo* type)
+    {
+        engine->ReleaseScriptObject(object, type);
+    }
+
+    // Handle assignment of REFCPY and RefCpyV, release the old object before the new one gets a reference like the VM
+    static void STDCALL_DECL assign_handle(void** destination, void* source, asITypeInfo* type)
+    {
+        asIScriptEngine* engine = type->GetEngine();
+        if (*destination)
+            engine->ReleaseScriptObject(*destination, type);
+        if (source)
+            engine->AddRefScriptObject(source, type);
+        *destination = source;
+    }
+
+    // Inline cache of one Cast instruction, the last type which passed the check is stored in source
+    struct CastCache {
+        asITypeInfo* target = nullptr;
+        asITypeInfo* source = nullptr;
+    };
+
+    // The VM leaves the object register unchanged if the cast fails, the compiler clears it before the instruction
+    static void STDCALL_DECL cast_object(asSVMRegisters* registers, asIScriptObject* object, CastCache* cache)
+    {
+        asITypeInfo* type = object->GetObjectType();
+        if (type != cache->source)
+        {
+            if (!type->Implements(cache->target) && !type->DerivesFrom(cache->target))
+                return;
+            cache->source = type;
+        }
+
+        registers->objectType     = nullptr;
+        registers->objectRegister = object;
+        object->AddRef();
+    }
+
+    // Records the type of the object of a CALLINTF for the second tier, the VM raises the exception of a null object
+    static void STDCALL_DECL record_call(asIScriptObject* object, CallProfile* profile)
+    {
+        if (object == nullptr)
+            return;
+
+        asITypeInfo* type = object->GetObjectType();
+        if (profile->type == nullptr)
+            profile->type = type;
+
+        if (type == profile->type)
+            profile->calls++;
+        else
+            profile->other++;
+    }
+
+    static asITypeInfo* STDCALL_DECL object_type(asIScriptObject* object)
+    {
+        return object->GetObjectType();
+    }
+
+    // Records the function of a CallPtr for the second tier, the VM raises the exception of a null pointer
+    static void STDCALL_DECL record_function(asIScriptFunction* function, CallProfile* profile)
+    {
+        if (function == nullptr)
+            return;
+
+        if (profile->function == nullptr)
+            profile->function = function;
+
+        if (function == profile->function)
+            profile->calls++;
+        else
+            profile->other++;
+    }
+
+    // Buffers of AllocMem, released by FREE through the engine, which uses the same memory functions.
+    // Small buffers are cleared by the compiled code
+    static constexpr inline asDWORD inline_clear_limit = 128;
+
+    static void* STDCALL_DECL allocate_list_buffer(size_t size)
+    {
+        void* buffer = asAllocMem(size);
+        if (buffer && size > inline_clear_limit)
+            std::memset(buffer, 0, size);
+        return buffer;
+    }
+
+    static constexpr inline asUINT list_constants_min_elements = 4;
+
+    // One constant element of a list initialiser, the script compiler emits
+    //     SetVn temp, value; PshListElmnt buffer, offset; PopRPtr; WRTVn temp
+    // or the same sequence with the SetVn after the PopRPtr
+    struct ListStore {
+        asDWORD* set;
+        asDWORD* end;
+        short buffer;
+        asDWORD offset;
+        asUINT size;
+        asQWORD value;
+    };
+
+    static asEBCInstr opcode_at(asDWORD* address)
+    {
+        return static_cast<asEBCInstr>(*reinterpret_cast<asBYTE*>(address));
+    }
+
+    static asUINT list_store_size(asEBCInstr set, asEBCInstr write)
+    {
+        switch (set)
+        {
+            case asBC_SetV1:
+                return write == asBC_WRTV1 ? 1 : 0;
+            case asBC_SetV2:
+                return write == asBC_WRTV2 ? 2 : 0;
+            case asBC_SetV4:
+                return write == asBC_WRTV4 ? 4 : 0;
+            case asBC_SetV8:
+                return write == asBC_WRTV8 ? 8 : 0;
+            default:
+                return 0;
+        }
+    }
+
+    static bool match_list_store(asDWORD* address, asDWORD* end, ListStore& store)
+    {
+        asDWORD* instructions[4];
+        for (asDWORD*& instruction : instructions)
+        {
+            if (address >= end)
+                return false;
+            instruction = address;
+            address += asBCTypeSize[asBCInfo[opcode_at(address)].type];
+        }
+
+        bool set_first   = opcode_at(instructions[0]) != asBC_PshListElmnt;
+        asDWORD* set     = instructions[set_first ? 0 : 2];
+        asDWORD* element = instructions[set_first ? 1 : 0];
+        asDWORD* pop     = instructions[set_first ? 2 : 1];
+        asDWORD* write   = instructions[3];
+
+        if (opcode_at(element) != asBC_PshListElmnt || opcode_at(pop) != asBC_PopRPtr ||
+            asBC_SWORDARG0(set) != asBC_SWORDARG0(write))
+            return false;
+
+        store.size = list_store_size(opcode_at(set), opcode_at(write));
+        if (store.size == 0)
+            return false;
+
+        store.set    = set;
+        store.end    = address;
+        store.buffer = static_cast<short>(-asBC_SWORDARG0(element) * static_cast<int>(sizeof(asDWORD)));
+        store.offset = asBC_DWORDARG(element);
+        store.value  = store.size == 8 ? asBC_QWORDARG(set) : asBC_DWORDARG(set);
+        return true;
+    }
+
+    // Script classes need a VM frame for their constructor, system constructors with arguments need the calling
+    // convention support of the VM. Value types without constructor or with a default constructor are created
+    // natively, CreateScriptObject calls the default constructor
+    static bool can_allocate_natively(asITypeInfo* type, int constructor_id)
+    {
+        if ((type->GetFlags() & asOBJ_SCRIPT_OBJECT) || !(type->GetFlags() & asOBJ_VALUE))
+            return false;
+
+        if (constructor_id == 0)
+            return true;
+
+        asIScriptFunction* constructor = type->GetEngine()->GetFunctionById(constructor_id);
+        return constructor != nullptr && constructor->GetParamCount() == 0;
+    }
+
     ////////////////////// MUST BE REMOVED IN FUTURE! //////////////////////
     static double STDCALL_DECL uint_to_double(uint32_t value)
     {
@@ -292,6 +489,15 @@ namespace JIT
 
     ////////////////////// MUST BE REMOVED IN FUTURE! //////////////////////
 
+    // Returns nanoseconds since the previous call and moves the time point forward
+    static uint64_t lap(std::chrono::steady_clock::time_point& time_point)
+    {
+        auto now     = std::chrono::steady_clock::now();
+        auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(now - time_point).count();
+        time_point   = now;
+        return static_cast<uint64_t>(elapsed);
+    }
+
     static void catch_errors(asmjit::Error error)
     {
         if (error != 0)
@@ -300,7 +506,24 @@ namespace JIT
         }
     }
 
-    X86_64_Compiler::X86_64_Compiler(bool with_suspend) : _M_with_suspend(with_suspend)
+    void (X86_64_Compiler::*X86_64_Compiler::exec[static_cast<size_t>(asBC_MAXBYTECODE)])(CompileInfo*);
+    const char* X86_64_Compiler::code_names[static_cast<size_t>(asBC_MAXBYTECODE)];
+
+    X86_64_Compiler::X86_64_Compiler(bool with_suspend, std::shared_ptr<JitContext> context)
+        : X86_64_Compiler(with_suspend ? SuspendMode::Exit : SuspendMode::Ignore, std::move(context))
+    {}
+
+    X86_64_Compiler::X86_64_Compiler(SuspendMode suspend_mode, std::shared_ptr<JitContext> context)
+        : _M_context(context ? std::move(context) : std::make_shared<JitContext>()), _M_suspend_mode(suspend_mode)
+    {
+        if (_M_suspend_mode == SuspendMode::Trap && !Safepoint::install_handler())
+            _M_suspend_mode = SuspendMode::Poll;
+
+        static std::once_flag registered;
+        std::call_once(registered, &X86_64_Compiler::register_instructions);
+    }
+
+    void X86_64_Compiler::register_instructions()
     {
 #define register_code(name)                                                                                            \
     exec[static_cast<size_t>(name)]       = &X86_64_Compiler::exec_##name;                                             \
@@ -512,6 +735,12 @@ namespace JIT
 
 
     int X86_64_Compiler::CompileFunction(asIScriptFunction* function, asJITFunction* output)
+    {
+        return compile(function, reinterpret_cast<void**>(output), nullptr);
+    }
+
+    // Compiles the first tier of the function, or the second tier if the profile to optimize is passed
+    int X86_64_Compiler::compile(asIScriptFunction* function, void** output, TierProfile* optimize)
     {
         if (std::strstr(function->GetName(), "nojit") != nullptr)
             return -1;
@@ -525,14 +754,50 @@ namespace JIT
         if (info.begin == nullptr || info.byte_codes == 0)
             return -1;
 
-        info.end = info.begin + info.byte_codes;
+        info.end      = info.begin + info.byte_codes;
+        info.engine   = function->GetEngine();
+        info.function = function;
+
+        std::unique_ptr<CodeArena::RuntimeData> runtime_data = _M_context->create_runtime_data();
+
+        // The second tier is released together with the first tier and is never evicted on its own. It counts its
+        // entries in the usage of the first tier, which jumps to it before counting, so the first tier stays while
+        // the second one runs
+        TierProfile first_tier;
+        if (optimize)
+        {
+            runtime_data->usage.reset();
+            info.tier        = optimize;
+            info.optimized   = true;
+            info.entry_table = runtime_data->allocate<asUINT>(info.byte_codes);
+        }
+        else if (_M_tier.enabled)
+        {
+            first_tier.function = function;
+            first_tier.state    = runtime_data->allocate<TierState>();
+            first_tier.usage    = runtime_data->usage.get();
+            info.tier           = &first_tier;
+        }
+
+        if (optimize == nullptr)
+            info.branch_profile = _M_branch_profiles.find(function);
+
+        info.runtime_data = runtime_data.get();
+        info.usage        = optimize ? optimize->usage : runtime_data->usage.get();
+
+        auto time_point = std::chrono::steady_clock::now();
 
         CodeHolder code;
-        code.init(_M_rt.environment(), _M_rt.cpuFeatures());
-        new (&info.assembler) Assembler(&code);
+        code.init(_M_context->environment(), _M_context->cpu_features());
+        new (&info.assembler) x86::Builder(&code);
+
+        size_t removed_null_checks = _M_statistics.analysis.removed_null_checks;
+        size_t removed_stores      = _M_statistics.analysis.removed_stores;
+        size_t stack_objects       = _M_statistics.analysis.stack_objects;
 
         init(&info);
         info.address = info.begin;
+        _M_statistics.init_time += lap(time_point);
 
         Zone zone(const_pool_size);
         ConstPool const_pool(&zone);
@@ -562,10 +827,64 @@ namespace JIT
             }
         }
 
+        embed_safepoint_stubs(&info);
+        embed_jump_tables(&info);
+        embed_list_constants(&info);
+        _M_statistics.emit_time += lap(time_point);
+
+        if (_M_peephole.loop_registers)
+        {
+            cache_loops(&info);
+            _M_statistics.peephole_time += lap(time_point);
+        }
+
+        if (_M_peephole.load_forwarding || _M_peephole.redundant_moves || _M_peephole.stack_folding)
+        {
+            run_peephole(info.assembler, vm_stack_pointer, _M_peephole, _M_statistics.peephole);
+            _M_statistics.peephole_time += lap(time_point);
+        }
+
+        if (!info.cold_blocks.empty())
+        {
+            layout_blocks(&info);
+            _M_statistics.peephole_time += lap(time_point);
+        }
+
         info.assembler.embedConstPool(const_pool_label, const_pool);
+        _M_statistics.const_pool_time += lap(time_point);
 
         info.assembler.finalize();
-        _M_rt.add(output, &code);
+        _M_statistics.finalize_time += lap(time_point);
+
+        write_jit_entries(&info, code);
+
+        for (SafepointStub& safepoint : info.safepoints)
+        {
+            runtime_data->safepoints.record(code.labelOffsetFromBase(safepoint.poll),
+                                            code.labelOffsetFromBase(safepoint.stub));
+        }
+
+        if (_M_context->add(function, &code, output, std::move(runtime_data)) != kErrorOk)
+            return -1;
+
+        if (!info.safepoints.empty())
+            info.runtime_data->safepoints.install(*output);
+
+        if (info.tier && !info.optimized)
+            _M_tiers.emplace(*output, std::move(first_tier));
+        _M_statistics.runtime_add_time += lap(time_point);
+
+        if (_M_analysis.log)
+        {
+            _M_analysis_reports.push_back({function->GetDeclaration(),
+                                           _M_statistics.analysis.removed_null_checks - removed_null_checks,
+                                           _M_statistics.analysis.removed_stores - removed_stores,
+                                           _M_statistics.analysis.stack_objects - stack_objects});
+        }
+
+        _M_statistics.functions += 1;
+        _M_statistics.byte_code_bytes += info.byte_codes * sizeof(asDWORD);
+        _M_statistics.machine_code_bytes += code.codeSize();
 
         logf("End of compile function '%s'\n=================================================================\n\n",
              function->GetName());
@@ -574,7 +893,15 @@ namespace JIT
 
     void X86_64_Compiler::ReleaseJITFunction(asJITFunction func)
     {
-        _M_rt.release(func);
+        auto tier = _M_tiers.find(reinterpret_cast<void*>(func));
+        if (tier != _M_tiers.end())
+        {
+            if (tier->second.optimized)
+                _M_context->release(tier->second.optimized);
+            _M_tiers.erase(tier);
+        }
+
+        _M_context->release(reinterpret_cast<void*>(func));
     }
 
     void X86_64_Compiler::push_instruction_index_for_skip(const std::string& name, unsigned int index)
@@ -582,22 +909,267 @@ namespace JIT
         _M_skip_instructions[name].insert(index);
     }
 
+    const X86_64_Compiler::CompileStatistics& X86_64_Compiler::statistics() const
+    {
+        return _M_statistics;
+    }
+
+    void X86_64_Compiler::reset_statistics()
+    {
+        _M_statistics = CompileStatistics();
+        _M_inline_decisions.clear();
+        _M_analysis_reports.clear();
+    }
+
+    void X86_64_Compiler::peephole(const PeepholeOptions& options)
+    {
+        _M_peephole = options;
+    }
+
+    const PeepholeOptions& X86_64_Compiler::peephole() const
+    {
+        return _M_peephole;
+    }
+
+    void X86_64_Compiler::inliner(const InlineOptions& options)
+    {
+        _M_inline = options;
+    }
+
+    const InlineOptions& X86_64_Compiler::inliner() const
+    {
+        return _M_inline;
+    }
+
+    const std::vector<InlineDecision>& X86_64_Compiler::inline_decisions() const
+    {
+        return _M_inline_decisions;
+    }
+
+    void X86_64_Compiler::analysis(const AnalysisOptions& options)
+    {
+        _M_analysis = options;
+    }
+
+    const AnalysisOptions& X86_64_Compiler::analysis() const
+    {
+        return _M_analysis;
+    }
+
+    const std::vector<AnalysisReport>& X86_64_Compiler::analysis_reports() const
+    {
+        return _M_analysis_reports;
+    }
+
+    void X86_64_Compiler::tiering(const TierOptions& options)
+    {
+        _M_tier = options;
+    }
+
+    const TierOptions& X86_64_Compiler::tiering() const
+    {
+        return _M_tier;
+    }
+
+    size_t X86_64_Compiler::tier_up()
+    {
+        size_t compiled = 0;
+        for (auto& [code, tier] : _M_tiers)
+        {
+            if (tier.optimized || tier.state->invalidations != 0 || tier.state->entries < _M_tier.hot_entries)
+                continue;
+
+            // A function which cannot be compiled again stays in the first tier
+            if (compile(tier.function, &tier.optimized, &tier) != 0)
+            {
+                // The guards were allocated in the runtime data of the discarded code
+                tier.guards.clear();
+                tier.state->invalidations++;
+                continue;
+            }
+
+            std::atomic_ref<void*>(tier.state->optimized).store(tier.optimized, std::memory_order_release);
+            _M_statistics.optimized_functions++;
+            compiled++;
+        }
+        return compiled;
+    }
+
+    void X86_64_Compiler::invalidate(asIScriptFunction* function)
+    {
+        for (auto& [code, tier] : _M_tiers)
+        {
+            if (function && tier.function != function)
+                continue;
+
+            std::atomic_ref<void*>(tier.state->optimized).store(nullptr, std::memory_order_release);
+            tier.state->invalidations++;
+        }
+    }
+
+    std::vector<TierReport> X86_64_Compiler::tier_reports() const
+    {
+        std::vector<TierReport> reports;
+        for (auto& [code, tier] : _M_tiers)
+        {
+            TierReport& report   = reports.emplace_back();
+            report.function      = tier.function;
+            report.entries       = tier.state->entries;
+            report.invalidations = tier.state->invalidations;
+            report.optimized     = tier.state->optimized != nullptr;
+
+            for (const Guard* guard : tier.guards) report.guards.push_back(*guard);
+        }
+        return reports;
+    }
+
+    bool X86_64_Compiler::save_branch_profile(const char* path) const
+    {
+        BranchProfiles profiles;
+        for (auto& [code, tier] : _M_tiers)
+        {
+            for (auto& [offset, profile] : tier.branches) profiles.record(tier.function, offset, *profile);
+        }
+        return profiles.save(path);
+    }
+
+    bool X86_64_Compiler::load_branch_profile(const char* path)
+    {
+        return _M_branch_profiles.load(path);
+    }
+
+    JitContext& X86_64_Compiler::context()
+    {
+        return *_M_context;
+    }
+
+    // Emits the result of the constant propagation instead of the instruction, returns false if the instruction is
+    // emitted as usual. Dead code keeps its labels and the labels of its JitEntry instructions, nothing jumps there
+    bool X86_64_Compiler::apply_constant_fold(CompileInfo* info)
+    {
+        if (info->constants.empty() || info->address < info->begin || info->address >= info->end)
+            return false;
+
+        const ConstantFold& fold = info->constants[info->address - info->begin];
+        switch (fold.action)
+        {
+            case ConstantFold::Action::None:
+                return false;
+
+            case ConstantFold::Action::Dead:
+                if (info->instruction == asBC_JitEntry)
+                    return false;
+
+                _M_statistics.analysis.dead_instructions++;
+                return true;
+
+            case ConstantFold::Action::SetVariable:
+            {
+                int32_t offset = -static_cast<int32_t>(fold.variable) * static_cast<int32_t>(sizeof(asDWORD));
+                if (fold.size == sizeof(asQWORD))
+                {
+                    new_instruction(mov(qword_free_2, fold.value));
+                    new_instruction(mov(qword_ptr(vm_stack_frame_pointer, offset), qword_free_2));
+                }
+                else
+                {
+                    new_instruction(mov(dword_ptr(vm_stack_frame_pointer, offset), static_cast<asDWORD>(fold.value)));
+                }
+                break;
+            }
+
+            case ConstantFold::Action::SetValue:
+                new_instruction(mov(vm_value_d, static_cast<asDWORD>(fold.value)));
+                break;
+
+            case ConstantFold::Action::Jump:
+                new_instruction(jmp(info->labels[find_label_for_jump(info)].label));
+                _M_statistics.analysis.folded_jumps++;
+                return true;
+
+            case ConstantFold::Action::Skip:
+                _M_statistics.analysis.folded_jumps++;
+                return true;
+        }
+
+        _M_statistics.analysis.folded_instructions++;
+        return true;
+    }
+
+    // Returns true if the null check of the current instruction is proven redundant by the analysis
+    bool X86_64_Compiler::skip_null_check(CompileInfo* info)
+    {
+        if (info->valid_pointers.empty() || info->address < info->begin || info->address >= info->end ||
+            !info->valid_pointers[info->address - info->begin])
+            return false;
+
+        _M_statistics.analysis.removed_null_checks++;
+        return true;
+    }
+
+    // Returns true if the store of the current instruction is never read, the instruction is not emitted
+    bool X86_64_Compiler::skip_dead_store(CompileInfo* info)
+    {
+        if (info->dead_stores.empty() || info->address < info->begin || info->address >= info->end ||
+            !info->dead_stores[info->address - info->begin])
+            return false;
+
+        _M_statistics.analysis.removed_stores++;
+        return true;
+    }
+
+    // Returns true if the object of the current ALLOC or FREE lives in the native stack frame
+    bool X86_64_Compiler::is_stack_object(CompileInfo* info)
+    {
+        const std::vector<bool>& objects = info->stack_objects.instructions;
+        if (objects.empty() || info->address < info->begin || info->address >= info->end ||
+            !objects[info->address - info->begin])
+            return false;
+
+        if (info->instruction == asBC_ALLOC)
+            _M_statistics.analysis.stack_objects++;
+        return true;
+    }
+
+    void X86_64_Compiler::check_null_pointer(CompileInfo* info, const x86::Gp& pointer)
+    {
+        if (skip_null_check(info))
+            return;
+
+        Label is_valid = info->assembler.newLabel();
+        new_instruction(cmp(pointer, 0));
+        new_instruction(jne(is_valid));
+        new_instruction(call(make_exception_nullptr_access));
+        new_instruction(bind(is_valid));
+    }
+
     asUINT X86_64_Compiler::process_instruction(CompileInfo* info)
     {
         bind_label_if_required(info);
         size_t index = static_cast<size_t>(info->instruction);
 
-#if WITH_LOG
-        auto current_offset = info->assembler.offset();
-#endif
+        if (info->next_list_constants < info->list_constants.size() &&
+            info->list_constants[info->next_list_constants].begin == info->address)
+        {
+            return copy_list_constants(info, info->list_constants[info->next_list_constants++]);
+        }
 
+        BaseNode* current_node = info->assembler.cursor();
 
-        ((*this).*exec[index])(info);
+        if (!skip_dead_store(info) && !apply_constant_fold(info))
+            ((*this).*exec[index])(info);
+
+        // A back edge removed by the constant folding is no loop any more
+        for (LoopInfo& loop : info->loops)
+        {
+            if (loop.back_edge == info->address && current_node != info->assembler.cursor())
+                loop.node = info->assembler.cursor();
+        }
 
 #if WITH_LOG
         {
             auto size           = instruction_size(info->instruction);
-            bool is_implemented = current_offset != info->assembler.offset();
+            bool is_implemented = current_node != info->assembler.cursor();
 
             if (info->instruction == asBC_JitEntry || info->instruction == asBC_SUSPEND ||
                 info->instruction == asBC_iTOb)
@@ -625,106 +1197,877 @@ namespace JIT
     }
 
 
+    // Copies the data of the run in blocks of 16 bytes, the state after the run is the same as after the single
+    // stores: the temporary variable holds the last value and the value register the address of the last element
+    asUINT X86_64_Compiler::copy_list_constants(CompileInfo* info, ListConstants& constants)
+    {
+        int32_t size   = static_cast<int32_t>(constants.data.size());
+        int32_t blocks = size & ~15;
+
+        Label is_valid = info->assembler.newLabel();
+        new_instruction(mov(qword_free_1, qword_ptr(vm_stack_frame_pointer, constants.buffer)));
+        new_instruction(test(qword_free_1, qword_free_1));
+        new_instruction(jne(is_valid));
+
+        // The VM raises the null pointer exception in PshListElmnt
+        exec_asBC_RET(info);
+        new_instruction(bind(is_valid));
+
+        new_instruction(lea(qword_free_1, qword_ptr(qword_free_1, static_cast<int32_t>(constants.offset) + blocks)));
+        new_instruction(lea(qword_free_3, x86::ptr(constants.label, blocks)));
+
+        if (blocks > 0)
+        {
+            Label loop = info->assembler.newLabel();
+            new_instruction(mov(qword_free_2, -blocks));
+            new_instruction(bind(loop));
+            new_instruction(movdqu(xmm_free_1, xmmword_ptr(qword_free_3, qword_free_2)));
+            new_instruction(movdqu(xmmword_ptr(qword_free_1, qword_free_2), xmm_free_1));
+            new_instruction(add(qword_free_2, 16));
+            new_instruction(jnz(loop));
+        }
+
+        int32_t position = 0;
+        for (; blocks + position + 8 <= size; position += 8)
+        {
+            new_instruction(mov(qword_free_2, qword_ptr(qword_free_3, position)));
+            new_instruction(mov(qword_ptr(qword_free_1, position), qword_free_2));
+        }
+        for (; blocks + position + 4 <= size; position += 4)
+        {
+            new_instruction(mov(dword_free_2, dword_ptr(qword_free_3, position)));
+            new_instruction(mov(dword_ptr(qword_free_1, position), dword_free_2));
+        }
+        for (; blocks + position < size; position++)
+        {
+            new_instruction(mov(byte_free_2, byte_ptr(qword_free_3, position)));
+            new_instruction(mov(byte_ptr(qword_free_1, position), byte_free_2));
+        }
+
+        new_instruction(lea(vm_value_q, qword_ptr(qword_free_1, position - static_cast<int32_t>(constants.last_size))));
+
+        asDWORD* address = info->address;
+        info->address    = constants.last_set;
+        ((*this).*exec[static_cast<size_t>(opcode_at(constants.last_set))])(info);
+        info->address = address;
+
+        return static_cast<asUINT>(constants.end - constants.begin);
+    }
+
     void X86_64_Compiler::init(CompileInfo* info)
     {
+        // Skipped instructions return to the VM, which reads the variables written before them
+        auto skip_it       = _M_skip_instructions.find(info->function->GetName());
+        bool skips_nothing = skip_it == _M_skip_instructions.end() || skip_it->second.empty();
+
+        // The slot of the objects in the native frame is below the byte code offset
+        if (_M_analysis.stack_objects && skips_nothing)
+            info->stack_objects = find_stack_objects(info->begin, info->end);
+
+        // The first tier continues in the second tier once tier_up() compiled it, with the same arguments
+        if (info->tier && !info->optimized)
+        {
+            Label first_tier = info->assembler.newLabel();
+            new_instruction(movabs(qword_free_1, info->tier->state));
+            new_instruction(inc(dword_ptr(qword_free_1, offsetof(TierState, entries))));
+            new_instruction(mov(qword_free_1, qword_ptr(qword_free_1, offsetof(TierState, optimized))));
+            new_instruction(test(qword_free_1, qword_free_1));
+            new_instruction(je(first_tier));
+            new_instruction(jmp(qword_free_1));
+            new_instruction(bind(first_tier));
+        }
+
         new_instruction(push(base_pointer));
         new_instruction(mov(base_pointer, stack_pointer));
-        new_instruction(sub(stack_pointer, -vm_register_offset));
+        new_instruction(sub(stack_pointer, static_cast<int32_t>(-byte_code_offset + info->stack_objects.size)));
 
         new_instruction(mov(qword_ptr(base_pointer, vm_register_offset), qword_first_arg));
         restore_registers(info);
 
-        // Restore position of execution
-        new_instruction(lea(qword_free_1, qword_ptr(rip)));
-        info->header_size = static_cast<asUINT>(info->assembler.offset());
-        new_instruction(add(qword_free_1, qword_second_arg));
-        new_instruction(jmp(qword_free_1));
+        // Count the entry for the code budget of the code arena
+        if (info->usage)
+        {
+            new_instruction(movabs(qword_free_1, info->usage));
+            new_instruction(lock().inc(dword_ptr(qword_free_1, offsetof(CodeArena::Usage, active))));
+            new_instruction(mov(dword_ptr(qword_free_1, offsetof(CodeArena::Usage, referenced)), 1));
+        }
+
+        // The argument of JitEntry holds the offset of the code in the low half and the offset of the instruction in
+        // the high half. The VM stores the address of the instruction in programPointer, so the byte code address
+        // is not embedded into the code and identical functions produce identical code
+        new_instruction(mov(qword_free_1, qword_second_arg));
+        new_instruction(shr(qword_free_1, 32));
+        new_instruction(mov(qword_free_2, qword_ptr(restore_register, offsetof(asSVMRegisters, programPointer))));
+        new_instruction(sub(qword_free_2, qword_free_1));
+        new_instruction(mov(qword_ptr(base_pointer, byte_code_offset), qword_free_2));
+
+        // The argument holds the offset of the code of the first tier, the entry table is indexed by the offset of
+        // the instruction
+        if (info->optimized)
+        {
+            new_instruction(movabs(qword_free_2, info->entry_table));
+            new_instruction(mov(dword_second_arg, dword_ptr(qword_free_2, qword_free_1)));
+        }
+        else
+        {
+            new_instruction(mov(dword_second_arg, dword_second_arg));
+        }
+
+        // Restore position of execution
+        info->header_label = info->assembler.newLabel();
+        new_instruction(lea(qword_free_1, qword_ptr(rip)));
+        new_instruction(bind(info->header_label));
+        new_instruction(add(qword_free_1, qword_second_arg));
+        new_instruction(jmp(qword_free_1));
+
+        asDWORD* start = info->begin;
+        asDWORD* end   = info->end;
+
+        while (start < end)
+        {
+            asEBCInstr op = asEBCInstr(*(asBYTE*) start);
+            switch (op)
+            {
+                case asBC_JMP:
+                case asBC_JLowZ:
+                case asBC_JZ:
+                case asBC_JLowNZ:
+                case asBC_JNZ:
+                case asBC_JS:
+                case asBC_JNS:
+                case asBC_JP:
+                case asBC_JNP:
+                {
+                    info->labels.emplace_back();
+                    info->labels.back().byte_code_address = start + asBC_INTARG(start) + instruction_size(op);
+                    info->labels.back().label             = info->assembler.newLabel();
+                    break;
+                }
+
+                // The VM jumps to the JMP at the index read from the variable, the JMPs follow the JMPP
+                case asBC_JMPP:
+                {
+                    asDWORD* entry = start + instruction_size(op);
+                    asUINT size    = 0;
+
+                    while (entry < end && static_cast<asEBCInstr>(*reinterpret_cast<asBYTE*>(entry)) == asBC_JMP)
+                    {
+                        entry += instruction_size(asBC_JMP);
+                        size++;
+                    }
+
+                    info->jump_tables.push_back({start, size, info->assembler.newLabel()});
+                    break;
+                }
+
+
+                default:
+                    break;
+            }
+            start += instruction_size(op);
+        }
+
+        find_list_constants(info);
+        find_loops(info);
+
+        if (_M_analysis.constant_folding)
+            info->constants = propagate_constants(info->begin, info->end, _M_suspend_mode != SuspendMode::Ignore);
+
+        if (_M_analysis.null_checks)
+        {
+            info->valid_pointers = find_redundant_null_checks(info->begin, info->end,
+                                                              _M_suspend_mode != SuspendMode::Ignore,
+                                                              info->function->GetObjectType() != nullptr);
+        }
+
+        if (_M_analysis.dead_stores && skips_nothing)
+            info->dead_stores = find_dead_stores(info->begin, info->end, _M_suspend_mode != SuspendMode::Ignore);
+    }
+
+    void X86_64_Compiler::restore_registers(CompileInfo* info)
+    {
+        new_instruction(mov(restore_register, qword_ptr(base_pointer, vm_register_offset)));
+
+        new_instruction(
+                mov(vm_stack_frame_pointer, qword_ptr(restore_register, offsetof(asSVMRegisters, stackFramePointer))));
+        new_instruction(mov(vm_stack_pointer, qword_ptr(restore_register, offsetof(asSVMRegisters, stackPointer))));
+        new_instruction(mov(vm_value_q, qword_ptr(restore_register, offsetof(asSVMRegisters, valueRegister))));
+        new_instruction(mov(vm_object, qword_ptr(restore_register, offsetof(asSVMRegisters, objectRegister))));
+        new_instruction(mov(vm_object_type, qword_ptr(restore_register, offsetof(asSVMRegisters, objectType))));
+    }
+
+    void X86_64_Compiler::save_registers(CompileInfo* info, bool ret)
+    {
+        new_instruction(mov(restore_register, qword_ptr(base_pointer, vm_register_offset)));
+        if (ret)
+        {
+            new_instruction(mov(qword_free_1, qword_ptr(base_pointer, byte_code_offset)));
+            new_instruction(add(qword_free_1, static_cast<int32_t>((info->address - info->begin) * sizeof(asDWORD))));
+            new_instruction(mov(qword_ptr(restore_register, offsetof(asSVMRegisters, programPointer)), qword_free_1));
+        }
+
+        new_instruction(
+                mov(qword_ptr(restore_register, offsetof(asSVMRegisters, stackFramePointer)), vm_stack_frame_pointer));
+        new_instruction(mov(qword_ptr(restore_register, offsetof(asSVMRegisters, stackPointer)), vm_stack_pointer));
+        new_instruction(mov(qword_ptr(restore_register, offsetof(asSVMRegisters, valueRegister)), vm_value_q));
+        new_instruction(mov(qword_ptr(restore_register, offsetof(asSVMRegisters, objectRegister)), vm_object));
+        new_instruction(mov(qword_ptr(restore_register, offsetof(asSVMRegisters, objectType)), vm_object_type));
+    }
+
+    // Returns to the VM at the next or at the current instruction if the VM requested a suspend or an exception was set
+    void X86_64_Compiler::exit_if_suspended(CompileInfo* info, bool next_instruction)
+    {
+        Label is_active = info->assembler.newLabel();
+        new_instruction(mov(qword_free_1, qword_ptr(base_pointer, vm_register_offset)));
+        new_instruction(cmp(byte_ptr(qword_free_1, offsetof(asSVMRegisters, doProcessSuspend)), 0));
+        new_instruction(je(is_active));
+
+        asDWORD* address = info->address;
+        if (next_instruction)
+            info->address += instruction_size(info->instruction);
+        exec_asBC_RET(info);
+        info->address = address;
+
+        new_instruction(bind(is_active));
+    }
+
+    // Stores the handle from the top of the stack into the address in the first argument register.
+    // The engine is only called when the handle changes and the type has none of plain_flags, REFCPY stores
+    // handles of NOCOUNT types plainly and RefCpyV also pointers to value types, like the VM
+    void X86_64_Compiler::copy_handle(CompileInfo* info, asITypeInfo* type, asDWORD plain_flags)
+    {
+        new_instruction(mov(qword_second_arg, qword_ptr(vm_stack_pointer)));
+
+        if (type->GetFlags() & plain_flags)
+        {
+            new_instruction(mov(qword_ptr(qword_first_arg), qword_second_arg));
+            return;
+        }
+
+        Label end = info->assembler.newLabel();
+        new_instruction(cmp(qword_ptr(qword_first_arg), qword_second_arg));
+        new_instruction(je(end));
+
+        // The release can execute a script destructor, which needs the state of the context
+        save_registers(info, true);
+        new_instruction(movabs(qword_third_arg, type));
+        new_instruction(call(assign_handle));
+        restore_registers(info);
+        new_instruction(bind(end));
+    }
+
+    void X86_64_Compiler::bind_label_if_required(CompileInfo* info)
+    {
+        for (LabelInfo& label_info : info->labels)
+        {
+            if (label_info.byte_code_address == info->address)
+            {
+                info->assembler.bind(label_info.label);
+                return;
+            }
+        }
+    }
+
+    size_t X86_64_Compiler::find_label_for_jump(CompileInfo* info)
+    {
+        return find_label(info, info->address + asBC_INTARG(info->address) + instruction_size(info->instruction));
+    }
+
+    size_t X86_64_Compiler::find_label(CompileInfo* info, asDWORD* address)
+    {
+        size_t index = 0;
+        for (; index < info->labels.size(); index++)
+        {
+            if (info->labels[index].byte_code_address == address)
+                return index;
+        }
+
+        throw std::runtime_error("Undefined label");
+    }
+
+    // Emits the jump of JZ, JNZ, JS, JNS, JP, JNP, JLowZ and JLowNZ. The first tier counts the executions and the fall
+    // throughs of the jump, a mostly taken jump is inverted to the block which it skips and continues at the target
+    void X86_64_Compiler::conditional_jump(CompileInfo* info, x86::CondCode condition, bool low)
+    {
+        Label target           = info->labels[find_label_for_jump(info)].label;
+        bool own               = info->address >= info->begin && info->address < info->end;
+        BranchProfile* profile = nullptr;
+
+        if (own && info->tier && !info->optimized)
+        {
+            profile = info->runtime_data->allocate<BranchProfile>();
+            info->tier->branches[static_cast<asUINT>(info->address - info->begin)] = profile;
+
+            new_instruction(movabs(qword_free_1, profile));
+            new_instruction(inc(dword_ptr(qword_free_1, offsetof(BranchProfile, executions))));
+        }
+
+        if (low)
+            new_instruction(cmp(vm_value_b, 0));
+        else
+            new_instruction(cmp(vm_value_d, 0));
+
+        asDWORD* destination = info->address + asBC_INTARG(info->address) + instruction_size(info->instruction);
+        if (own && is_cold_fall_through(info, destination))
+        {
+            Label block = info->assembler.newLabel();
+            new_instruction(j(x86::negateCond(condition), block));
+            new_instruction(jmp(target));
+            info->cold_blocks.push_back({info->assembler.cursor(), block, target});
+            new_instruction(bind(block));
+        }
+        else
+        {
+            new_instruction(j(condition, target));
+        }
+
+        if (profile)
+        {
+            new_instruction(movabs(qword_free_1, profile));
+            new_instruction(inc(dword_ptr(qword_free_1, offsetof(BranchProfile, fall_through))));
+        }
+    }
+
+    // The block between a conditional jump and its forward target is cold if the profile says that the jump is mostly
+    // taken. The block must end with a JMP or a RET, it cannot fall through to the target once it is moved
+    bool X86_64_Compiler::is_cold_fall_through(CompileInfo* info, asDWORD* target)
+    {
+        asUINT offset = static_cast<asUINT>(info->address - info->begin);
+        BranchProfile profile;
+
+        if (info->optimized)
+        {
+            const BranchProfile* counters = info->tier->branch(offset);
+            if (counters == nullptr)
+                return false;
+            profile = *counters;
+        }
+        else if (info->branch_profile)
+        {
+            auto it = info->branch_profile->find(offset);
+            if (it == info->branch_profile->end())
+                return false;
+            profile = it->second;
+        }
+        else
+        {
+            return false;
+        }
+
+        if (profile.executions < _M_tier.min_branches || profile.fall_through > profile.executions ||
+            profile.taken() < static_cast<uint64_t>(profile.fall_through) * _M_tier.cold_ratio)
+            return false;
+
+        asDWORD* current = info->address + instruction_size(info->instruction);
+        if (target <= current || target > info->end)
+            return false;
+
+        asEBCInstr last = info->instruction;
+        for (; current < target; current += instruction_size(last)) last = opcode_at(current);
+        return current == target && (last == asBC_JMP || last == asBC_RET);
+    }
+
+    // Moves the cold blocks behind the code of the function, so the mostly taken side of the jumps falls through. The
+    // passes over the nodes run before, a block is only moved if its nodes still end with an unconditional jump
+    // before the label of the target
+    void X86_64_Compiler::layout_blocks(CompileInfo* info)
+    {
+        x86::Builder& builder = info->assembler;
+
+        for (ColdBlock& block : info->cold_blocks)
+        {
+            LabelNode* begin  = nullptr;
+            LabelNode* target = nullptr;
+            if (builder.labelNodeOf(&begin, block.block) != kErrorOk ||
+                builder.labelNodeOf(&target, block.target) != kErrorOk)
+                continue;
+
+            BaseNode* node = begin;
+            BaseNode* last = nullptr;
+            for (; node && node != target; node = node->next())
+            {
+                if (node->isInst())
+                    last = node;
+            }
+
+            if (node == nullptr || last == nullptr ||
+                (last->as<InstNode>()->id() != x86::Inst::kIdJmp && last->as<InstNode>()->id() != x86::Inst::kIdRet))
+                continue;
+
+            BaseNode* tail = builder.lastNode();
+            for (node = begin;;)
+            {
+                BaseNode* next = node->next();
+                builder.removeNode(node);
+                tail = builder.addAfter(node, tail);
+
+                if (node == last)
+                    break;
+                node = next;
+            }
+
+            // The jump to the target is redundant if only labels are left between it and the target
+            node = block.jump->next();
+            while (node && node != target && node->isLabel()) node = node->next();
+
+            InstNode* jump = block.jump->as<InstNode>();
+            if (node == target && jump->op(0).isLabel() && jump->op(0).id() == block.target.id())
+                builder.removeNode(jump);
+
+            _M_statistics.cold_blocks++;
+        }
+
+        builder.setCursor(builder.lastNode());
+    }
+
+    // The signal handler of Safepoint continues a faulting poll at its stub, which returns to the VM at the SUSPEND
+    void X86_64_Compiler::embed_safepoint_stubs(CompileInfo* info)
+    {
+        asDWORD* address = info->address;
+        for (SafepointStub& safepoint : info->safepoints)
+        {
+            new_instruction(bind(safepoint.stub));
+            info->address = safepoint.byte_code_address;
+            exec_asBC_RET(info);
+        }
+        info->address = address;
+    }
+
+    // Runs of constant list elements are only copied at once if no jump or JitEntry lands inside the run
+    void X86_64_Compiler::find_list_constants(CompileInfo* info)
+    {
+        auto has_label = [info](asDWORD* address) {
+            return std::any_of(info->labels.begin(), info->labels.end(),
+                               [address](const LabelInfo& label) { return label.byte_code_address == address; });
+        };
+
+        asDWORD* address = info->begin;
+        while (address < info->end)
+        {
+            ListStore store;
+            if (!match_list_store(address, info->end, store))
+            {
+                address += instruction_size(opcode_at(address));
+                continue;
+            }
+
+            ListConstants constants{address, store.end, store.set, store.buffer, store.offset, store.size, {}, Label()};
+            asUINT elements = 0;
+
+            do
+            {
+                const asBYTE* value = reinterpret_cast<const asBYTE*>(&store.value);
+                constants.data.insert(constants.data.end(), value, value + store.size);
+                constants.end       = store.end;
+                constants.last_set  = store.set;
+                constants.last_size = store.size;
+                elements++;
+            } while (!has_label(constants.end) && match_list_store(constants.end, info->end, store) &&
+                     store.buffer == constants.buffer &&
+                     store.offset == constants.offset + static_cast<asDWORD>(constants.data.size()));
+
+            if (elements >= list_constants_min_elements)
+            {
+                constants.label = info->assembler.newLabel();
+                info->list_constants.push_back(std::move(constants));
+            }
+            address = constants.end;
+        }
+    }
+
+    void X86_64_Compiler::embed_list_constants(CompileInfo* info)
+    {
+        for (ListConstants& constants : info->list_constants)
+        {
+            new_instruction(align(AlignMode::kData, 16));
+            new_instruction(bind(constants.label));
+            new_instruction(embed(constants.data.data(), constants.data.size()));
+        }
+    }
+
+    // Offsets of the JMPP targets relative to the table, emitted after the code of the function
+    void X86_64_Compiler::embed_jump_tables(CompileInfo* info)
+    {
+        for (JumpTable& table : info->jump_tables)
+        {
+            new_instruction(align(AlignMode::kData, 4));
+            new_instruction(bind(table.label));
+
+            asDWORD* entry = table.byte_code_address + instruction_size(asBC_JMPP);
+            for (asUINT index = 0; index < table.size; index++)
+            {
+                asDWORD* target = entry + asBC_INTARG(entry) + instruction_size(asBC_JMP);
+                new_instruction(embedLabelDelta(info->labels[find_label(info, target)].label, table.label, 4));
+                entry += instruction_size(asBC_JMP);
+            }
+        }
+    }
+
+    // The offsets of the code are only known after the instructions were serialised, the peephole pass can change
+    // the size of the code in front of every JitEntry
+    void X86_64_Compiler::write_jit_entries(CompileInfo* info, CodeHolder& code)
+    {
+        uint64_t header_offset = code.labelOffset(info->header_label);
+
+        for (EntryInfo& entry : info->jit_entries)
+        {
+            asPWORD offset             = static_cast<asPWORD>(code.labelOffset(entry.label) - header_offset);
+            asPWORD instruction_offset = static_cast<asPWORD>(entry.byte_code_address - info->begin) * sizeof(asDWORD);
+
+            // The byte code keeps the entries of the first tier
+            if (info->optimized)
+                info->entry_table[entry.byte_code_address - info->begin] = static_cast<asUINT>(offset);
+            else
+                asBC_PTRARG(entry.byte_code_address) = offset | (instruction_offset << 32);
+        }
+    }
+
+    // A backward jump closes a loop, the loops which contain another loop are dropped
+    void X86_64_Compiler::find_loops(CompileInfo* info)
+    {
+        for (asDWORD* address = info->begin; address < info->end;)
+        {
+            asEBCInstr op = asEBCInstr(*(asBYTE*) address);
+            switch (op)
+            {
+                case asBC_JMP:
+                case asBC_JLowZ:
+                case asBC_JZ:
+                case asBC_JLowNZ:
+                case asBC_JNZ:
+                case asBC_JS:
+                case asBC_JNS:
+                case asBC_JP:
+                case asBC_JNP:
+                {
+                    asDWORD* target = address + asBC_INTARG(address) + instruction_size(op);
+                    if (target > address)
+                        break;
+
+                    auto loop = std::find_if(info->loops.begin(), info->loops.end(),
+                                             [target](const LoopInfo& loop) { return loop.header == target; });
+                    if (loop == info->loops.end())
+                        info->loops.push_back({target, address, nullptr});
+                    else
+                        loop->back_edge = std::max(loop->back_edge, address);
+                    break;
+                }
+
+                default:
+                    break;
+            }
+            address += instruction_size(op);
+        }
+
+        std::vector<LoopInfo> loops = info->loops;
+        std::erase_if(info->loops, [&loops](const LoopInfo& loop) {
+            return std::any_of(loops.begin(), loops.end(), [&loop](const LoopInfo& inner) {
+                return inner.header > loop.header && inner.header <= loop.back_edge;
+            });
+        });
+    }
+
+    // Keeps the variables of the innermost loops in registers, the JitEntry labels inside of a loop are replaced by
+    // stubs which load the variables
+    void X86_64_Compiler::cache_loops(CompileInfo* info)
+    {
+        std::vector<LoopRegion> regions;
+        for (LoopInfo& loop : info->loops)
+        {
+            if (loop.node)
+                regions.push_back({info->labels[find_label(info, loop.header)].label, loop.node});
+        }
+
+        if (regions.empty())
+            return;
+
+        LoopRegisters registers;
+        registers.frame        = vm_stack_frame_pointer.id();
+        registers.stack        = vm_stack_pointer.id();
+        registers.vm_registers = restore_register.id();
+        for (const Gpq& reg : loop_cache_registers)
+        {
+            registers.cache.push_back(reg.id());
+        }
+
+        std::vector<Label> entries;
+        for (EntryInfo& entry : info->jit_entries)
+        {
+            entries.push_back(entry.label);
+        }
+
+        std::vector<LoopPoll> polls;
+        for (SafepointStub& safepoint : info->safepoints)
+        {
+            polls.push_back({safepoint.poll, safepoint.stub});
+        }
+
+        run_loop_registers(info->assembler, regions, registers, entries, polls, _M_statistics.peephole);
+
+        for (size_t index = 0; index < entries.size(); index++)
+        {
+            info->jit_entries[index].label = entries[index];
+        }
+
+        for (size_t index = 0; index < polls.size(); index++)
+        {
+            info->safepoints[index].stub = polls[index].stub;
+        }
+    }
+
+    // The callee runs on a frame below the native stack pointer: the frame pointer of the caller, the variables and a
+    // copy of the arguments, which the callee may overwrite. RET pops the arguments from the VM stack like the VM
+    bool X86_64_Compiler::inline_call(CompileInfo* info, asIScriptFunction* function)
+    {
+        InlineCandidate candidate;
+        const char* reason = inline_candidate(info->function, function, _M_inline,
+                                              _M_inline.max_growth - info->inlined_size, candidate);
+
+        logf("Inline '%s': %s\n", function ? function->GetName() : "", reason ? reason : "inlined");
+        // GetDeclaration returns a buffer of the engine, which the next call overwrites
+        if (_M_inline.log)
+        {
+            InlineDecision decision;
+            decision.caller           = info->function->GetDeclaration();
+            decision.callee           = function ? function->GetDeclaration() : "";
+            decision.byte_code_offset = static_cast<asUINT>((info->address - info->begin) * sizeof(asDWORD));
+            decision.reason           = reason;
+            _M_inline_decisions.push_back(std::move(decision));
+        }
+
+        if (reason)
+            return false;
+
+        int32_t arguments    = static_cast<int32_t>(candidate.arguments_size);
+        int32_t frame_offset = static_cast<int32_t>(16 + ((candidate.variables_size + 7) & ~7u));
+        int32_t frame_size   = (frame_offset + arguments + 15) & ~15;
+
+        // The VM raises the null pointer exception at the call
+        if (candidate.has_this)
+        {
+            Label is_valid = info->assembler.newLabel();
+            new_instruction(cmp(qword_ptr(vm_stack_pointer), 0));
+            new_instruction(jne(is_valid));
+            exec_asBC_RET(info);
+            new_instruction(bind(is_valid));
+        }
+
+        new_instruction(sub(stack_pointer, frame_size));
+        new_instruction(mov(qword_ptr(stack_pointer), vm_stack_frame_pointer));
+
+        int32_t position = 0;
+        for (; position + 8 <= arguments; position += 8)
+        {
+            new_instruction(mov(qword_free_1, qword_ptr(vm_stack_pointer, position)));
+            new_instruction(mov(qword_ptr(stack_pointer, frame_offset + position), qword_free_1));
+        }
+        if (position < arguments)
+        {
+            new_instruction(mov(dword_free_1, dword_ptr(vm_stack_pointer, position)));
+            new_instruction(mov(dword_ptr(stack_pointer, frame_offset + position), dword_free_1));
+        }
+        new_instruction(lea(vm_stack_frame_pointer, qword_ptr(stack_pointer, frame_offset)));
+
+        asDWORD* address       = info->address;
+        asEBCInstr instruction = info->instruction;
+        size_t labels          = info->labels.size();
+        Label end              = info->assembler.newLabel();
 
-        asDWORD* start = info->begin;
-        asDWORD* end   = info->end;
+        for (asDWORD* current = candidate.begin; current < candidate.end;
+             current += instruction_size(opcode_at(current)))
+        {
+            asEBCInstr op = opcode_at(current);
+            if (op != asBC_JMP && op != asBC_JZ && op != asBC_JNZ && op != asBC_JS && op != asBC_JNS && op != asBC_JP &&
+                op != asBC_JNP && op != asBC_JLowZ && op != asBC_JLowNZ)
+                continue;
+
+            asDWORD* target = current + asBC_INTARG(current) + instruction_size(op);
+            if (std::none_of(info->labels.begin() + labels, info->labels.end(),
+                             [target](const LabelInfo& label) { return label.byte_code_address == target; }))
+            {
+                info->labels.push_back({target, info->assembler.newLabel()});
+            }
+        }
 
-        while (start < end)
+        for (info->address = candidate.begin; info->address < candidate.end;
+             info->address += instruction_size(info->instruction))
         {
-            asEBCInstr op = asEBCInstr(*(asBYTE*) start);
-            switch (op)
+            info->instruction = opcode_at(info->address);
+            switch (info->instruction)
             {
-                case asBC_JMP:
-                case asBC_JLowZ:
-                case asBC_JZ:
-                case asBC_JLowNZ:
-                case asBC_JNZ:
-                case asBC_JS:
-                case asBC_JNS:
-                case asBC_JP:
-                case asBC_JNP:
-                {
-                    info->labels.emplace_back();
-                    info->labels.back().byte_code_address = start + asBC_INTARG(start) + instruction_size(op);
-                    info->labels.back().label             = info->assembler.newLabel();
+                case asBC_JitEntry:
+                case asBC_SUSPEND:
+                    bind_label_if_required(info);
+                    break;
+
+                case asBC_RET:
+                    bind_label_if_required(info);
+                    if (arguments > 0)
+                        new_instruction(add(vm_stack_pointer, arguments));
+                    if (info->address + instruction_size(asBC_RET) < candidate.end)
+                        new_instruction(jmp(end));
                     break;
-                }
 
+                case asBC_LoadThisR:
+                    bind_label_if_required(info);
+                    new_instruction(mov(vm_value_q, qword_ptr(vm_stack_frame_pointer)));
+                    new_instruction(add(vm_value_q, arg_value_short(0)));
+                    break;
 
                 default:
+                    process_instruction(info);
                     break;
             }
-            start += instruction_size(op);
         }
+
+        new_instruction(bind(end));
+        new_instruction(mov(vm_stack_frame_pointer, qword_ptr(stack_pointer)));
+        new_instruction(add(stack_pointer, frame_size));
+
+        info->labels.erase(info->labels.begin() + labels, info->labels.end());
+        info->address     = address;
+        info->instruction = instruction;
+        info->inlined_size += candidate.size;
+        _M_statistics.inlined_calls += 1;
+        return true;
     }
 
-    void X86_64_Compiler::restore_registers(CompileInfo* info)
+    // First tier: the type of the object is recorded before the VM executes the call
+    void X86_64_Compiler::profile_call(CompileInfo* info)
     {
-        new_instruction(mov(restore_register, qword_ptr(base_pointer, vm_register_offset)));
+        if (info->tier == nullptr || info->optimized || info->address < info->begin || info->address >= info->end)
+            return;
 
-        new_instruction(
-                mov(vm_stack_frame_pointer, qword_ptr(restore_register, offsetof(asSVMRegisters, stackFramePointer))));
-        new_instruction(mov(vm_stack_pointer, qword_ptr(restore_register, offsetof(asSVMRegisters, stackPointer))));
-        new_instruction(mov(vm_value_q, qword_ptr(restore_register, offsetof(asSVMRegisters, valueRegister))));
-        new_instruction(mov(vm_object, qword_ptr(restore_register, offsetof(asSVMRegisters, objectRegister))));
-        new_instruction(mov(vm_object_type, qword_ptr(restore_register, offsetof(asSVMRegisters, objectType))));
+        CallProfile* profile = info->runtime_data->allocate<CallProfile>();
+        info->tier->calls[static_cast<asUINT>(info->address - info->begin)] = profile;
+
+        save_registers(info);
+        new_instruction(mov(qword_first_arg, qword_ptr(vm_stack_pointer)));
+        new_instruction(movabs(qword_second_arg, profile));
+        new_instruction(call(record_call));
+        restore_registers(info);
     }
 
-    void X86_64_Compiler::save_registers(CompileInfo* info, bool ret)
+    // Second tier: a call which only saw objects of one type is inlined behind a check of the type. Another type
+    // returns to the VM at the CALLINTF and counts as failure of the guard, too many failures invalidate the tier
+    bool X86_64_Compiler::speculate_call(CompileInfo* info, asIScriptFunction* function)
     {
-        new_instruction(mov(restore_register, qword_ptr(base_pointer, vm_register_offset)));
-        if (ret)
-        {
-            new_instruction(movabs(qword_free_1, info->address));
-            new_instruction(mov(qword_ptr(restore_register, offsetof(asSVMRegisters, programPointer)), qword_free_1));
-        }
+        if (!info->optimized || info->address < info->begin || info->address >= info->end)
+            return false;
 
-        new_instruction(
-                mov(qword_ptr(restore_register, offsetof(asSVMRegisters, stackFramePointer)), vm_stack_frame_pointer));
-        new_instruction(mov(qword_ptr(restore_register, offsetof(asSVMRegisters, stackPointer)), vm_stack_pointer));
-        new_instruction(mov(qword_ptr(restore_register, offsetof(asSVMRegisters, valueRegister)), vm_value_q));
-        new_instruction(mov(qword_ptr(restore_register, offsetof(asSVMRegisters, objectRegister)), vm_object));
-        new_instruction(mov(qword_ptr(restore_register, offsetof(asSVMRegisters, objectType)), vm_object_type));
+        const CallProfile* profile = info->tier->call(static_cast<asUINT>(info->address - info->begin));
+        if (profile == nullptr || profile->other != 0 || profile->calls < _M_tier.min_calls)
+            return false;
+
+        InlineCandidate candidate;
+        asIScriptFunction* implementation = find_implementation(profile->type, function);
+        if (implementation == nullptr ||
+            inline_candidate(info->function, implementation, _M_inline, _M_inline.max_growth - info->inlined_size,
+                             candidate) != nullptr)
+            return false;
+
+        Guard* guard            = info->runtime_data->allocate<Guard>();
+        guard->type             = profile->type;
+        guard->byte_code_offset = static_cast<asUINT>(info->address - info->begin) * sizeof(asDWORD);
+        info->tier->guards.push_back(guard);
+
+        Label speculated = info->assembler.newLabel();
+        Label exit       = info->assembler.newLabel();
+
+        new_instruction(mov(qword_free_1, qword_ptr(vm_stack_pointer)));
+        new_instruction(test(qword_free_1, qword_free_1));
+        new_instruction(je(exit));
+
+        save_registers(info);
+        new_instruction(mov(qword_first_arg, qword_free_1));
+        new_instruction(call(object_type));
+        restore_registers(info);
+
+        new_instruction(movabs(qword_free_2, profile->type));
+        new_instruction(cmp(qword_return, qword_free_2));
+        new_instruction(je(speculated));
+
+        fail_guard(info, guard, exit);
+
+        new_instruction(bind(speculated));
+        inline_call(info, implementation);
+        _M_statistics.speculated_calls++;
+        return true;
     }
 
-    void X86_64_Compiler::bind_label_if_required(CompileInfo* info)
+    // First tier: the function of the pointer is recorded before the VM executes the CallPtr
+    void X86_64_Compiler::profile_pointer_call(CompileInfo* info)
     {
-        for (LabelInfo& label_info : info->labels)
-        {
-            if (label_info.byte_code_address == info->address)
-            {
-                info->assembler.bind(label_info.label);
-                return;
-            }
-        }
+        if (info->tier == nullptr || info->optimized || info->address < info->begin || info->address >= info->end)
+            return;
+
+        CallProfile* profile = info->runtime_data->allocate<CallProfile>();
+        info->tier->calls[static_cast<asUINT>(info->address - info->begin)] = profile;
+
+        save_registers(info);
+        new_instruction(mov(qword_first_arg, qword_ptr(vm_stack_frame_pointer, arg_offset(0))));
+        new_instruction(movabs(qword_second_arg, profile));
+        new_instruction(call(record_function));
+        restore_registers(info);
     }
 
-    size_t X86_64_Compiler::find_label_for_jump(CompileInfo* info)
+    // Second tier: a CallPtr which only saw one script function of the module is inlined behind a comparison of the
+    // pointer, the module keeps the function alive as long as this code. Delegates and system functions are not
+    // speculated, they and any other pointer return to the VM at the CallPtr
+    bool X86_64_Compiler::speculate_pointer_call(CompileInfo* info)
     {
-        asDWORD* address = info->address + asBC_INTARG(info->address) + instruction_size(info->instruction);
+        if (!info->optimized || info->address < info->begin || info->address >= info->end)
+            return false;
 
-        size_t index = 0;
-        for (; index < info->labels.size(); index++)
-        {
-            if (info->labels[index].byte_code_address == address)
-                return index;
-        }
+        const CallProfile* profile = info->tier->call(static_cast<asUINT>(info->address - info->begin));
+        if (profile == nullptr || profile->other != 0 || profile->calls < _M_tier.min_calls)
+            return false;
 
-        throw std::runtime_error("Undefined label");
+        InlineCandidate candidate;
+        asIScriptFunction* function = profile->function;
+        if (function->GetFuncType() != asFUNC_SCRIPT || function->GetModule() != info->function->GetModule() ||
+            inline_candidate(info->function, function, _M_inline, _M_inline.max_growth - info->inlined_size,
+                             candidate) != nullptr)
+            return false;
+
+        Guard* guard            = info->runtime_data->allocate<Guard>();
+        guard->function         = function;
+        guard->byte_code_offset = static_cast<asUINT>(info->address - info->begin) * sizeof(asDWORD);
+        info->tier->guards.push_back(guard);
+
+        Label speculated = info->assembler.newLabel();
+        Label exit       = info->assembler.newLabel();
+
+        new_instruction(mov(qword_free_1, qword_ptr(vm_stack_frame_pointer, arg_offset(0))));
+        new_instruction(test(qword_free_1, qword_free_1));
+        new_instruction(je(exit));
+        new_instruction(movabs(qword_free_2, profile->function));
+        new_instruction(cmp(qword_free_1, qword_free_2));
+        new_instruction(je(speculated));
+
+        fail_guard(info, guard, exit);
+
+        new_instruction(bind(speculated));
+        inline_call(info, function);
+        _M_statistics.speculated_calls++;
+        return true;
+    }
+
+    // Counts a failure of the guard and returns to the VM at the speculated call, exit skips the count
+    void X86_64_Compiler::fail_guard(CompileInfo* info, Guard* guard, Label exit)
+    {
+        new_instruction(movabs(qword_free_1, guard));
+        new_instruction(inc(dword_ptr(qword_free_1, offsetof(Guard, failures))));
+        new_instruction(cmp(dword_ptr(qword_free_1, offsetof(Guard, failures)), _M_tier.max_guard_failures));
+        new_instruction(jb(exit));
+
+        // New entries of the function run in the first tier
+        new_instruction(movabs(qword_free_1, info->tier->state));
+        new_instruction(mov(qword_ptr(qword_free_1, offsetof(TierState, optimized)), 0));
+        new_instruction(inc(dword_ptr(qword_free_1, offsetof(TierState, invalidations))));
+
+        new_instruction(bind(exit));
+        exec_asBC_RET(info);
     }
 
     asUINT X86_64_Compiler::instruction_size(asEBCInstr instruction)
@@ -742,10 +2085,9 @@ namespace JIT
 
     void X86_64_Compiler::exec_asBC_PshGPtr(CompileInfo* info)
     {
-        asPWORD* value = (asPWORD*) asBC_PTRARG(info->address);
+        asPWORD ptr = arg_value_ptr();
         new_instruction(sub(vm_stack_pointer, ptr_size_1));
-        new_instruction(mov(qword_free_1, value));
-        new_instruction(mov(qword_free_1, qword_ptr(qword_free_1)));
+        new_instruction(mov(qword_free_1, qword_ptr(ptr)));
         new_instruction(mov(qword_ptr(vm_stack_pointer), qword_free_1));
     }
 
@@ -802,31 +2144,39 @@ namespace JIT
 
     void X86_64_Compiler::exec_asBC_PshG4(CompileInfo* info)
     {
-        CHECK_IT();
-        asDWORD value = *(asDWORD*) arg_value_ptr();
+        asPWORD ptr = arg_value_ptr();
 
         new_instruction(sub(vm_stack_pointer, half_ptr_size));
-        new_instruction(mov(dword_free_1, value));
+        new_instruction(mov(dword_free_1, dword_ptr(ptr)));
         new_instruction(mov(dword_ptr(vm_stack_pointer), dword_free_1));
     }
 
     void X86_64_Compiler::exec_asBC_LdGRdR4(CompileInfo* info)
     {
-        CHECK_IT();
+        asPWORD ptr  = arg_value_ptr();
         short offset = arg_offset(0);
-        new_instruction(mov(vm_value_q, arg_value_ptr()));
-        new_instruction(mov(dword_free_1, dword_ptr(vm_value_q)));
+
+        new_instruction(mov(vm_value_q, ptr));
+        new_instruction(mov(dword_free_1, dword_ptr(ptr)));
         new_instruction(mov(dword_ptr(vm_stack_frame_pointer, offset), dword_free_1));
     }
 
     void X86_64_Compiler::exec_asBC_CALL(CompileInfo* info)
     {
-        RETURN_CONTROL_TO_VM();
+        if (!inline_call(info, info->engine->GetFunctionById(arg_value_int())))
+            RETURN_CONTROL_TO_VM();
     }
 
     void X86_64_Compiler::exec_asBC_RET(CompileInfo* info)
     {
         save_registers(info, true);
+
+        if (info->usage)
+        {
+            new_instruction(movabs(qword_free_1, info->usage));
+            new_instruction(lock().dec(dword_ptr(qword_free_1, offsetof(CodeArena::Usage, active))));
+        }
+
         new_instruction(nop());
         new_instruction(leave());
         new_instruction(ret());
@@ -840,44 +2190,32 @@ namespace JIT
 
     void X86_64_Compiler::exec_asBC_JZ(CompileInfo* info)
     {
-        size_t label_index = find_label_for_jump(info);
-        new_instruction(cmp(vm_value_d, 0));
-        new_instruction(je(info->labels[label_index].label));
+        conditional_jump(info, x86::CondCode::kEqual);
     }
 
     void X86_64_Compiler::exec_asBC_JNZ(CompileInfo* info)
     {
-        size_t label_index = find_label_for_jump(info);
-        new_instruction(cmp(vm_value_d, 0));
-        new_instruction(jne(info->labels[label_index].label));
+        conditional_jump(info, x86::CondCode::kNotEqual);
     }
 
     void X86_64_Compiler::exec_asBC_JS(CompileInfo* info)
     {
-        size_t label_index = find_label_for_jump(info);
-        new_instruction(cmp(vm_value_d, 0));
-        new_instruction(jl(info->labels[label_index].label));
+        conditional_jump(info, x86::CondCode::kSignedLT);
     }
 
     void X86_64_Compiler::exec_asBC_JNS(CompileInfo* info)
     {
-        size_t label_index = find_label_for_jump(info);
-        new_instruction(cmp(vm_value_d, 0));
-        new_instruction(jge(info->labels[label_index].label));
+        conditional_jump(info, x86::CondCode::kSignedGE);
     }
 
     void X86_64_Compiler::exec_asBC_JP(CompileInfo* info)
     {
-        size_t label_index = find_label_for_jump(info);
-        new_instruction(cmp(vm_value_d, 0));
-        new_instruction(jg(info->labels[label_index].label));
+        conditional_jump(info, x86::CondCode::kSignedGT);
     }
 
     void X86_64_Compiler::exec_asBC_JNP(CompileInfo* info)
     {
-        size_t label_index = find_label_for_jump(info);
-        new_instruction(cmp(vm_value_d, 0));
-        new_instruction(jle(info->labels[label_index].label));
+        conditional_jump(info, x86::CondCode::kSignedLE);
     }
 
     void X86_64_Compiler::exec_asBC_TZ(CompileInfo* info)
@@ -1204,13 +2542,8 @@ namespace JIT
     void X86_64_Compiler::exec_asBC_RDSPtr(CompileInfo* info)
     {
         new_instruction(mov(qword_free_1, qword_ptr(vm_stack_pointer)));
-        new_instruction(cmp(qword_free_1, 0));
-        Label is_valid = info->assembler.newLabel();
+        check_null_pointer(info, qword_free_1);
 
-        new_instruction(jne(is_valid));
-        new_instruction(call(make_exception_nullptr_access));
-
-        new_instruction(bind(is_valid));
         new_instruction(mov(qword_free_1, qword_ptr(qword_free_1)));
         new_instruction(mov(qword_ptr(vm_stack_pointer), qword_free_1));
     }
@@ -1400,7 +2733,23 @@ namespace JIT
 
     void X86_64_Compiler::exec_asBC_JMPP(CompileInfo* info)
     {
-        NEED_IMPLEMENTATION();
+        auto table = std::find_if(info->jump_tables.begin(), info->jump_tables.end(),
+                                  [info](const JumpTable& table) { return table.byte_code_address == info->address; });
+
+        // The script compiler checks the range before the JMPP, an index out of the table is left to the VM
+        Label vm_exit = info->assembler.newLabel();
+        short offset  = arg_offset(0);
+        new_instruction(mov(dword_free_1, dword_ptr(vm_stack_frame_pointer, offset)));
+        new_instruction(cmp(dword_free_1, table->size));
+        new_instruction(jae(vm_exit));
+
+        new_instruction(lea(qword_free_2, x86::ptr(table->label)));
+        new_instruction(movsxd(qword_free_1, dword_ptr(qword_free_2, qword_free_1, 2)));
+        new_instruction(add(qword_free_1, qword_free_2));
+        new_instruction(jmp(qword_free_1));
+
+        new_instruction(bind(vm_exit));
+        RETURN_CONTROL_TO_VM();
     }
 
     void X86_64_Compiler::exec_asBC_PopRPtr(CompileInfo* info)
@@ -1428,25 +2777,107 @@ namespace JIT
 
     void X86_64_Compiler::exec_asBC_CALLBND(CompileInfo* info)
     {
+        // The VM reads the bound function from the import table of the engine at call time. The public interface can
+        // bind and unbind imports but cannot read a binding, so the code could not check that a function resolved at
+        // compile time is still bound, and a rebound import would call the old function. The VM executes the call
         RETURN_CONTROL_TO_VM();
     }
 
     void X86_64_Compiler::exec_asBC_SUSPEND(CompileInfo* info)
     {
-        if (_M_with_suspend)
+        if (_M_suspend_mode == SuspendMode::Exit)
         {
             RETURN_CONTROL_TO_VM();
         }
+
+        // The VM executes the SUSPEND itself, so the line callback is called and the context is suspended
+        if (_M_suspend_mode == SuspendMode::Poll)
+            exit_if_suspended(info, false);
+
+        if (_M_suspend_mode == SuspendMode::Trap)
+        {
+            // The accumulator loads from the absolute address, so the poll is a single instruction
+            SafepointStub safepoint{info->address, info->assembler.newLabel(), info->assembler.newLabel()};
+            new_instruction(bind(safepoint.poll));
+            new_instruction(mov(dword_free_1, dword_ptr(reinterpret_cast<uint64_t>(Safepoint::page()))));
+            info->safepoints.push_back(safepoint);
+        }
     }
 
     void X86_64_Compiler::exec_asBC_ALLOC(CompileInfo* info)
     {
-        RETURN_CONTROL_TO_VM();
+        asITypeInfo* type  = reinterpret_cast<asITypeInfo*>(arg_value_ptr());
+        int constructor_id = asBC_INTARG(info->address + sizeof(asPWORD) / sizeof(asDWORD));
+
+        if (!can_allocate_natively(type, constructor_id))
+        {
+            RETURN_CONTROL_TO_VM();
+        }
+
+        // Pop the address of the variable and store the address of the slot into it
+        if (is_stack_object(info))
+        {
+            int32_t slot = byte_code_offset - static_cast<int32_t>(info->stack_objects.size);
+            new_instruction(mov(qword_free_2, qword_ptr(vm_stack_pointer)));
+            new_instruction(add(vm_stack_pointer, ptr_size_1));
+            new_instruction(lea(qword_free_1, qword_ptr(base_pointer, slot)));
+            new_instruction(mov(qword_ptr(qword_free_2), qword_free_1));
+            return;
+        }
+
+        save_registers(info, true);
+        if (constructor_id == 0)
+        {
+            new_instruction(movabs(qword_first_arg, type));
+            new_instruction(call(allocate_object));
+        }
+        else
+        {
+            new_instruction(movabs(qword_first_arg, type->GetEngine()));
+            new_instruction(movabs(qword_second_arg, type));
+            new_instruction(call(create_object));
+        }
+        restore_registers(info);
+
+        // Pop the address of the variable and store the object into it
+        Label is_null = info->assembler.newLabel();
+        new_instruction(mov(qword_free_2, qword_ptr(vm_stack_pointer)));
+        new_instruction(add(vm_stack_pointer, ptr_size_1));
+        new_instruction(test(qword_free_2, qword_free_2));
+        new_instruction(je(is_null));
+        new_instruction(mov(qword_ptr(qword_free_2), qword_return));
+        new_instruction(bind(is_null));
+
+        // The constructor can raise an exception
+        exit_if_suspended(info);
     }
 
     void X86_64_Compiler::exec_asBC_FREE(CompileInfo* info)
     {
-        RETURN_CONTROL_TO_VM();
+        asITypeInfo* type = reinterpret_cast<asITypeInfo*>(arg_value_ptr());
+        short offset      = arg_offset(0);
+
+        // Reference types without reference counting and objects in the native frame have no release behaviour
+        if (((type->GetFlags() & asOBJ_REF) && (type->GetFlags() & asOBJ_NOCOUNT)) || is_stack_object(info))
+        {
+            new_instruction(mov(qword_ptr(vm_stack_frame_pointer, offset), 0));
+            return;
+        }
+
+        Label is_null = info->assembler.newLabel();
+        new_instruction(mov(qword_second_arg, qword_ptr(vm_stack_frame_pointer, offset)));
+        new_instruction(test(qword_second_arg, qword_second_arg));
+        new_instruction(je(is_null));
+
+        // The release can execute a script destructor, which needs the state of the context
+        save_registers(info, true);
+        new_instruction(movabs(qword_first_arg, type->GetEngine()));
+        new_instruction(movabs(qword_third_arg, type));
+        new_instruction(call(release_object));
+        restore_registers(info);
+
+        new_instruction(mov(qword_ptr(vm_stack_frame_pointer, offset), 0));
+        new_instruction(bind(is_null));
     }
 
     void X86_64_Compiler::exec_asBC_LOADOBJ(CompileInfo* info)
@@ -1481,11 +2912,17 @@ namespace JIT
 
     void X86_64_Compiler::exec_asBC_REFCPY(CompileInfo* info)
     {
-        RETURN_CONTROL_TO_VM();
+        // Pop the address of the destination, the source stays on the stack
+        new_instruction(mov(qword_first_arg, qword_ptr(vm_stack_pointer)));
+        new_instruction(add(vm_stack_pointer, ptr_size_1));
+        copy_handle(info, reinterpret_cast<asITypeInfo*>(arg_value_ptr()), asOBJ_NOCOUNT);
     }
 
     void X86_64_Compiler::exec_asBC_CHKREF(CompileInfo* info)
     {
+        if (skip_null_check(info))
+            return;
+
         new_instruction(mov(qword_free_1, qword_ptr(vm_stack_pointer)));
         Label is_valid = info->assembler.newLabel();
 
@@ -1566,15 +3003,9 @@ namespace JIT
     void X86_64_Compiler::exec_asBC_ADDSi(CompileInfo* info)
     {
         new_instruction(mov(qword_free_2, qword_ptr(vm_stack_pointer)));
-        new_instruction(cmp(qword_free_2, 0));
-
-        Label is_valid = info->assembler.newLabel();
-
-        new_instruction(jne(is_valid));
-        new_instruction(call(make_exception_nullptr_access));
+        check_null_pointer(info, qword_free_2);
 
         short offset = arg_value_short(0);
-        new_instruction(bind(is_valid));
         new_instruction(add(qword_free_2, offset));
         new_instruction(mov(qword_ptr(vm_stack_pointer), qword_free_2));
     }
@@ -1615,8 +3046,7 @@ namespace JIT
         short offset = arg_offset(0);
 
         new_instruction(mov(dword_free_1, dword_ptr(vm_stack_frame_pointer, offset)));
-        new_instruction(movabs(qword_free_2, ptr));
-        new_instruction(mov(dword_ptr(qword_free_2), dword_free_1));
+        new_instruction(mov(dword_ptr(ptr), dword_free_1));
     }
 
     void X86_64_Compiler::exec_asBC_CpyRtoV4(CompileInfo* info)
@@ -1635,8 +3065,7 @@ namespace JIT
     {
         asPWORD ptr  = arg_value_ptr();
         short offset = arg_offset(0);
-        new_instruction(movabs(qword_free_1, ptr));
-        new_instruction(mov(dword_free_1, dword_ptr(qword_free_1)));
+        new_instruction(mov(dword_free_1, dword_ptr(ptr)));
         new_instruction(mov(dword_ptr(vm_stack_frame_pointer, offset), dword_free_1));
     }
 
@@ -2104,12 +3533,15 @@ namespace JIT
     {
         asPWORD ptr   = arg_value_ptr();
         asDWORD value = asBC_DWORDARG(info->address + AS_PTR_SIZE);
-        new_instruction(movabs(qword_free_1, ptr));
-        new_instruction(mov(dword_ptr(qword_free_1), value));
+        new_instruction(mov(dword_free_1, value));
+        new_instruction(mov(dword_ptr(ptr), dword_free_1));
     }
 
     void X86_64_Compiler::exec_asBC_ChkRefS(CompileInfo* info)
     {
+        if (skip_null_check(info))
+            return;
+
         Label is_valid = info->assembler.newLabel();
 
         new_instruction(mov(qword_free_1, qword_ptr(vm_stack_pointer)));
@@ -2122,6 +3554,9 @@ namespace JIT
 
     void X86_64_Compiler::exec_asBC_ChkNullV(CompileInfo* info)
     {
+        if (skip_null_check(info))
+            return;
+
         short offset = arg_offset(0);
         new_instruction(mov(dword_free_1, dword_ptr(vm_stack_frame_pointer, offset)));
 
@@ -2134,6 +3569,11 @@ namespace JIT
 
     void X86_64_Compiler::exec_asBC_CALLINTF(CompileInfo* info)
     {
+        asIScriptFunction* function = info->engine->GetFunctionById(arg_value_int());
+        if (inline_call(info, function) || speculate_call(info, function))
+            return;
+
+        profile_call(info);
         RETURN_CONTROL_TO_VM();
     }
 
@@ -2168,7 +3608,28 @@ namespace JIT
 
     void X86_64_Compiler::exec_asBC_Cast(CompileInfo* info)
     {
-        RETURN_CONTROL_TO_VM();
+        asITypeInfo* target = info->engine->GetTypeInfoById(static_cast<int>(arg_value_dword(0)));
+        if (target == nullptr)
+            RETURN_CONTROL_TO_VM();
+
+        CastCache* cache = info->runtime_data->allocate<CastCache>();
+        cache->target    = target;
+
+        Label end = info->assembler.newLabel();
+        new_instruction(mov(qword_free_1, qword_ptr(vm_stack_pointer)));
+        new_instruction(add(vm_stack_pointer, ptr_size_1));
+        new_instruction(test(qword_free_1, qword_free_1));
+        new_instruction(je(end));
+        new_instruction(mov(qword_second_arg, qword_ptr(qword_free_1)));
+        new_instruction(test(qword_second_arg, qword_second_arg));
+        new_instruction(je(end));
+
+        save_registers(info);
+        new_instruction(mov(qword_first_arg, restore_register));
+        new_instruction(movabs(qword_third_arg, cache));
+        new_instruction(call(cast_object));
+        restore_registers(info);
+        new_instruction(bind(end));
     }
 
     void X86_64_Compiler::exec_asBC_i64TOi(CompileInfo* info)
@@ -2485,6 +3946,9 @@ namespace JIT
 
     void X86_64_Compiler::exec_asBC_ChkNullS(CompileInfo* info)
     {
+        if (skip_null_check(info))
+            return;
+
         short offset = arg_offset(0);
         new_instruction(cmp(qword_ptr(vm_stack_pointer, offset), 0));
         Label is_valid = info->assembler.newLabel();
@@ -2500,12 +3964,25 @@ namespace JIT
 
     void X86_64_Compiler::exec_asBC_JitEntry(CompileInfo* info)
     {
-        asDWORD offset               = static_cast<asDWORD>(info->assembler.offset()) - info->header_size;
-        asBC_DWORDARG(info->address) = offset;
+        // The object of the ALLOC before is on the heap if the VM gets here, the VM keeps the execution up to the FREE
+        if (is_stack_object(info))
+            return;
+
+        Label label = info->assembler.newLabel();
+        new_instruction(bind(label));
+        info->jit_entries.push_back({info->address, label});
     }
 
     void X86_64_Compiler::exec_asBC_CallPtr(CompileInfo* info)
     {
+        // Only the cached script function of the second tier runs here. Other script functions and delegates need a
+        // new VM frame (asCContext::CallScriptFunction) and system functions need the calling convention support of
+        // the VM, none of them is part of the public interface. The VM executes this instruction and enters the JIT
+        // code again at the JitEntry after it
+        if (speculate_pointer_call(info))
+            return;
+
+        profile_pointer_call(info);
         RETURN_CONTROL_TO_VM();
     }
 
@@ -2521,15 +3998,8 @@ namespace JIT
     {
         short value0 = arg_value_short(0);
 
-        Label is_valid = info->assembler.newLabel();
-
         new_instruction(mov(vm_value_q, qword_ptr(vm_stack_frame_pointer)));
-        new_instruction(cmp(vm_value_q, 0));
-
-        new_instruction(jne(is_valid));
-        new_instruction(call(make_exception_nullptr_access));
-
-        new_instruction(bind(is_valid));
+        check_null_pointer(info, vm_value_q);
         new_instruction(add(vm_value_q, value0));
     }
 
@@ -2595,17 +4065,10 @@ namespace JIT
         short offset0 = arg_offset(0);
         short offset1 = arg_value_short(1);
 
-        Label is_valid = info->assembler.newLabel();
-
         new_instruction(mov(qword_free_1, vm_stack_frame_pointer));
         new_instruction(add(qword_free_1, offset0));
         new_instruction(mov(vm_value_q, qword_ptr(qword_free_1)));
-        new_instruction(cmp(vm_value_q, 0));
-
-        new_instruction(jne(is_valid));
-        new_instruction(call(make_exception_nullptr_access));
-
-        new_instruction(bind(is_valid));
+        check_null_pointer(info, vm_value_q);
         new_instruction(add(vm_value_q, offset1));
     }
 
@@ -2620,28 +4083,48 @@ namespace JIT
 
     void X86_64_Compiler::exec_asBC_RefCpyV(CompileInfo* info)
     {
-        RETURN_CONTROL_TO_VM();
+        short offset = arg_offset(0);
+        new_instruction(lea(qword_first_arg, qword_ptr(vm_stack_frame_pointer, offset)));
+        copy_handle(info, reinterpret_cast<asITypeInfo*>(arg_value_ptr()), asOBJ_NOCOUNT | asOBJ_VALUE);
     }
 
     void X86_64_Compiler::exec_asBC_JLowZ(CompileInfo* info)
     {
-        size_t label_index = find_label_for_jump(info);
-        new_instruction(cmp(vm_value_b, 0));
-        new_instruction(je(info->labels[label_index].label));
+        conditional_jump(info, x86::CondCode::kEqual, true);
     }
 
     void X86_64_Compiler::exec_asBC_JLowNZ(CompileInfo* info)
     {
-        size_t label_index = find_label_for_jump(info);
-        new_instruction(cmp(vm_value_b, 0));
-        new_instruction(jne(info->labels[label_index].label));
+        conditional_jump(info, x86::CondCode::kNotEqual, true);
     }
 
     void X86_64_Compiler::exec_asBC_AllocMem(CompileInfo* info)
     {
-        // Since the virtual machine is used to clear the memory,
-        // the memory allocation must also be performed by the virtual machine
-        RETURN_CONTROL_TO_VM();
+        asDWORD size = arg_value_dword(0);
+        short offset = arg_offset(0);
+
+        save_registers(info);
+        new_instruction(mov(qword_first_arg, size));
+        new_instruction(call(allocate_list_buffer));
+        restore_registers(info);
+        new_instruction(mov(qword_ptr(vm_stack_frame_pointer, offset), qword_return));
+
+        if (size > inline_clear_limit)
+            return;
+
+        asDWORD position = 0;
+        for (; position + 8 <= size; position += 8)
+        {
+            new_instruction(mov(qword_ptr(qword_return, position), 0));
+        }
+        for (; position + 4 <= size; position += 4)
+        {
+            new_instruction(mov(dword_ptr(qword_return, position), 0));
+        }
+        for (; position < size; position++)
+        {
+            new_instruction(mov(byte_ptr(qword_return, position), 0));
+        }
     }
 
     void X86_64_Compiler::exec_asBC_SetListSize(CompileInfo* info)
@@ -2650,20 +4133,9 @@ namespace JIT
         asUINT off   = arg_value_dword(0);
         asUINT size  = arg_value_dword(1);
 
-        Label is_valid = info->assembler.newLabel();
-        Label end      = info->assembler.newLabel();
-
         new_instruction(mov(qword_free_1, qword_ptr(vm_stack_frame_pointer, offset)));
-
-        new_instruction(cmp(qword_free_1, 0));
-        new_instruction(jne(is_valid));
-        new_instruction(call(make_exception_nullptr_access));
-        new_instruction(jmp(end));
-
-        new_instruction(bind(is_valid));
+        check_null_pointer(info, qword_free_1);
         new_instruction(mov(dword_ptr(qword_free_1, off), size));
-
-        new_instruction(bind(end));
     }
 
     void X86_64_Compiler::exec_asBC_PshListElmnt(CompileInfo* info)
@@ -2671,22 +4143,12 @@ namespace JIT
         short offset = arg_offset(0);
         asUINT off   = arg_value_dword(0);
 
-        Label is_valid = info->assembler.newLabel();
-        Label end      = info->assembler.newLabel();
-
         new_instruction(mov(qword_free_1, qword_ptr(vm_stack_frame_pointer, offset)));
+        check_null_pointer(info, qword_free_1);
 
-        new_instruction(cmp(qword_free_1, 0));
-        new_instruction(jne(is_valid));
-        new_instruction(call(make_exception_nullptr_access));
-        new_instruction(jmp(end));
-
-        new_instruction(bind(is_valid));
         new_instruction(add(qword_free_1, off));
         new_instruction(sub(vm_stack_pointer, ptr_size_1));
         new_instruction(mov(qword_ptr(vm_stack_pointer), qword_free_1));
-
-        new_instruction(bind(end));
     }
 
     void X86_64_Compiler::exec_asBC_SetListType(CompileInfo* info)
@@ -2695,20 +4157,9 @@ namespace JIT
         asUINT type  = arg_value_dword(1);
         asUINT off   = arg_value_dword(0);
 
-        Label is_valid = info->assembler.newLabel();
-        Label end      = info->assembler.newLabel();
-
         new_instruction(mov(qword_free_1, qword_ptr(vm_stack_frame_pointer, offset)));
-
-        new_instruction(cmp(qword_free_1, 0));
-        new_instruction(jne(is_valid));
-        new_instruction(call(make_exception_nullptr_access));
-        new_instruction(jmp(end));
-
-        new_instruction(bind(is_valid));
+        check_null_pointer(info, qword_free_1);
         new_instruction(mov(dword_ptr(qword_free_1, off), type));
-
-        new_instruction(bind(end));
     }
 
     void X86_64_Compiler::exec_asBC_POWi(CompileInfo* info)
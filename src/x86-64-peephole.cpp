@@ -0,0 +1,1065 @@
+// MIT License
+
+// Copyright (c) 2023 Programier (Vladyslav Reminskyi)
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <algorithm>
+#include <x86-64/peephole.hpp>
+#include <vector>
+
+namespace JIT
+{
+    using namespace asmjit;
+
+    // Instructions without implicit operands, their writes are described by InstAPI::queryRWInfo
+    static bool is_known(const InstNode* inst)
+    {
+        switch (inst->id())
+        {
+            case x86::Inst::kIdImul:
+                return inst->opCount() >= 2;
+
+            case x86::Inst::kIdAdd:
+            case x86::Inst::kIdSub:
+            case x86::Inst::kIdAnd:
+            case x86::Inst::kIdOr:
+            case x86::Inst::kIdXor:
+            case x86::Inst::kIdCmp:
+            case x86::Inst::kIdTest:
+            case x86::Inst::kIdLea:
+            case x86::Inst::kIdNeg:
+            case x86::Inst::kIdNot:
+            case x86::Inst::kIdInc:
+            case x86::Inst::kIdDec:
+            case x86::Inst::kIdShl:
+            case x86::Inst::kIdShr:
+            case x86::Inst::kIdSar:
+            case x86::Inst::kIdMovabs:
+            case x86::Inst::kIdMovzx:
+            case x86::Inst::kIdMovsx:
+            case x86::Inst::kIdMovsxd:
+            case x86::Inst::kIdMovd:
+            case x86::Inst::kIdMovq:
+            case x86::Inst::kIdMovss:
+            case x86::Inst::kIdMovsd:
+            case x86::Inst::kIdMovdqu:
+            case x86::Inst::kIdCvtsi2ss:
+            case x86::Inst::kIdCvtsi2sd:
+            case x86::Inst::kIdCvttss2si:
+            case x86::Inst::kIdCvttsd2si:
+            case x86::Inst::kIdCvtss2sd:
+            case x86::Inst::kIdCvtsd2ss:
+            case x86::Inst::kIdAddss:
+            case x86::Inst::kIdSubss:
+            case x86::Inst::kIdMulss:
+            case x86::Inst::kIdDivss:
+            case x86::Inst::kIdAddsd:
+            case x86::Inst::kIdSubsd:
+            case x86::Inst::kIdMulsd:
+            case x86::Inst::kIdDivsd:
+            case x86::Inst::kIdComiss:
+            case x86::Inst::kIdComisd:
+            case x86::Inst::kIdUcomiss:
+            case x86::Inst::kIdUcomisd:
+            case x86::Inst::kIdXorps:
+            case x86::Inst::kIdPxor:
+            case x86::Inst::kIdNop:
+                return true;
+
+            default:
+                return false;
+        }
+    }
+
+    // Jumps write nothing, a jump target is a label which ends the block anyway
+    static bool is_jump(const InstNode* inst)
+    {
+        return inst->id() >= x86::Inst::kIdJa && inst->id() <= x86::Inst::kIdJz;
+    }
+
+    class X86_64_Peephole
+    {
+    private:
+        // The register holds the value of the memory operand, the sizes of both are equal
+        struct Fact {
+            x86::Mem mem;
+            uint32_t reg;
+        };
+
+        x86::Builder& _M_builder;
+        x86::Gp _M_stack;
+        const PeepholeOptions& _M_options;
+        PeepholeStatistics& _M_statistics;
+        std::vector<Fact> _M_facts;
+
+        // The native frame (rsp, rbp) and the memory of the VM never overlap. The frame of an inlined callee lies on
+        // the native stack, but rsp is adjusted around it, which drops the facts about the native frame. The objects
+        // in the slot of the native frame are only accessed through pointers, never relative to rsp or rbp
+        static bool is_frame(const x86::Mem& mem)
+        {
+            return mem.hasBaseReg() && (mem.baseId() == x86::Gp::kIdSp || mem.baseId() == x86::Gp::kIdBp);
+        }
+
+        static bool may_alias(const x86::Mem& a, const x86::Mem& b)
+        {
+            if (!a.hasBaseReg() || !b.hasBaseReg() || a.hasIndex() || b.hasIndex())
+                return true;
+            if (is_frame(a) != is_frame(b))
+                return false;
+            if (a.baseId() != b.baseId())
+                return true;
+            return a.offset() < b.offset() + b.size() && b.offset() < a.offset() + a.size();
+        }
+
+        static bool uses_register(const x86::Mem& mem, uint32_t reg)
+        {
+            return (mem.hasBaseReg() && mem.baseId() == reg) || (mem.hasIndexReg() && mem.indexId() == reg);
+        }
+
+        static bool is_stack_adjustment(const InstNode* inst, const x86::Gp& stack)
+        {
+            return (inst->id() == x86::Inst::kIdAdd || inst->id() == x86::Inst::kIdSub) && inst->opCount() == 2 &&
+                   inst->op(0).isReg() && inst->op(0).id() == stack.id() && inst->op(1).isImm();
+        }
+
+        static int64_t stack_adjustment(const InstNode* inst)
+        {
+            int64_t value = inst->op(1).as<Imm>().value();
+            return inst->id() == x86::Inst::kIdAdd ? value : -value;
+        }
+
+        const Fact* find(const x86::Mem& mem) const
+        {
+            for (const Fact& fact : _M_facts)
+            {
+                if (fact.mem.equals(mem))
+                    return &fact;
+            }
+            return nullptr;
+        }
+
+        void forget_register(uint32_t reg)
+        {
+            std::erase_if(_M_facts,
+                          [reg](const Fact& fact) { return fact.reg == reg || uses_register(fact.mem, reg); });
+        }
+
+        void forget_memory(const x86::Mem& mem)
+        {
+            std::erase_if(_M_facts, [&mem](const Fact& fact) { return may_alias(fact.mem, mem); });
+        }
+
+        // High byte registers share the id with the full register, they are never remembered
+        void remember(const x86::Mem& mem, const x86::Gp& reg)
+        {
+            if (!reg.isGpbHi() && !uses_register(mem, reg.id()))
+                _M_facts.push_back({mem, reg.id()});
+        }
+
+        // Merges the following adjustments of the VM stack pointer into this one. No handler reads the flags of
+        // these adjustments, so changing them is safe. Returns false if the adjustments cancel each other out
+        bool fold_stack(InstNode* inst)
+        {
+            int64_t value = stack_adjustment(inst);
+            BaseNode* next = inst->next();
+
+            while (next && next->isInst() && is_stack_adjustment(next->as<InstNode>(), _M_stack))
+            {
+                value += stack_adjustment(next->as<InstNode>());
+                BaseNode* following = next->next();
+                _M_builder.removeNode(next);
+                _M_statistics.folded_stack += 1;
+                next = following;
+            }
+
+            if (value == 0)
+                return false;
+
+            inst->setId(value > 0 ? x86::Inst::kIdAdd : x86::Inst::kIdSub);
+            inst->setOp(1, Imm(value > 0 ? value : -value));
+            return true;
+        }
+
+        void visit_mov(InstNode* inst)
+        {
+            const Operand& destination = inst->op(0);
+            const Operand& source      = inst->op(1);
+
+            if (destination.isReg() && source.isReg())
+            {
+                if (_M_options.redundant_moves && destination.id() == source.id() &&
+                    destination.as<x86::Reg>().isGpq() && source.as<x86::Reg>().isGpq())
+                {
+                    _M_builder.removeNode(inst);
+                    _M_statistics.removed_moves += 1;
+                    return;
+                }
+
+                forget_register(destination.id());
+                return;
+            }
+
+            if (destination.isReg() && destination.as<x86::Reg>().isGp() && source.isMem())
+            {
+                x86::Gp reg  = destination.as<x86::Gp>();
+                x86::Mem mem = source.as<x86::Mem>();
+
+                if (mem.size() == reg.size() && !reg.isGpbHi() && _M_options.load_forwarding)
+                {
+                    if (const Fact* fact = find(mem))
+                    {
+                        _M_statistics.forwarded_loads += 1;
+                        if (fact->reg == reg.id())
+                        {
+                            _M_builder.removeNode(inst);
+                            return;
+                        }
+
+                        inst->setOp(1, x86::Gp::fromTypeAndId(reg.type(), fact->reg));
+                    }
+                }
+
+                forget_register(reg.id());
+                if (mem.size() == reg.size())
+                    remember(mem, reg);
+                return;
+            }
+
+            if (destination.isMem() && source.isReg() && source.as<x86::Reg>().isGp())
+            {
+                x86::Mem mem = destination.as<x86::Mem>();
+                x86::Gp reg  = source.as<x86::Gp>();
+
+                if (mem.size() == reg.size())
+                {
+                    const Fact* fact = find(mem);
+                    if (fact && fact->reg == reg.id() && _M_options.redundant_moves)
+                    {
+                        _M_builder.removeNode(inst);
+                        _M_statistics.removed_moves += 1;
+                        return;
+                    }
+                }
+
+                forget_memory(mem);
+                if (mem.size() == reg.size())
+                    remember(mem, reg);
+                return;
+            }
+
+            visit_other(inst);
+        }
+
+        void visit_other(InstNode* inst)
+        {
+            if (is_jump(inst))
+                return;
+
+            InstRWInfo rw;
+            if (!is_known(inst) || inst->options() != InstOptions::kNone ||
+                InstAPI::queryRWInfo(_M_builder.arch(), inst->baseInst(), inst->operands(), inst->opCount(), &rw) !=
+                        kErrorOk)
+            {
+                _M_facts.clear();
+                return;
+            }
+
+            for (uint32_t index = 0; index < inst->opCount(); index++)
+            {
+                const Operand& operand = inst->op(index);
+                const OpRWInfo& info   = rw.operand(index);
+
+                if (operand.isReg() && info.isWrite() && operand.as<BaseReg>().isGp())
+                    forget_register(operand.id());
+                else if (operand.isMem() && info.isWrite())
+                    forget_memory(operand.as<x86::Mem>());
+            }
+        }
+
+    public:
+        X86_64_Peephole(x86::Builder& builder, const x86::Gp& stack, const PeepholeOptions& options,
+                        PeepholeStatistics& statistics)
+            : _M_builder(builder), _M_stack(stack), _M_options(options), _M_statistics(statistics)
+        {}
+
+        void run()
+        {
+            BaseNode* node = _M_builder.firstNode();
+            while (node)
+            {
+                if (!node->isInst())
+                {
+                    _M_facts.clear();
+                    node = node->next();
+                    continue;
+                }
+
+                InstNode* inst = node->as<InstNode>();
+                if (_M_options.stack_folding && is_stack_adjustment(inst, _M_stack) && !fold_stack(inst))
+                {
+                    node = node->next();
+                    _M_builder.removeNode(inst);
+                    _M_statistics.folded_stack += 1;
+                    continue;
+                }
+
+                // The node can be removed by the visitors, the next node must be read before
+                node = node->next();
+
+                if (inst->id() == x86::Inst::kIdMov && inst->opCount() == 2 && inst->options() == InstOptions::kNone)
+                    visit_mov(inst);
+                else
+                    visit_other(inst);
+            }
+        }
+    };
+
+    class X86_64_LoopRegisters
+    {
+    private:
+        static constexpr inline uint32_t no_register = 0xFFFFFFFF;
+
+        // Variable of the VM frame, the address is the offset from the frame pointer, or global variable with an
+        // absolute address
+        struct Variable {
+            bool global;
+            int64_t address;
+            uint32_t size;
+            uint32_t accesses   = 0;
+            uint32_t replacable = 0;
+            bool written        = false;
+            bool cacheable      = true;
+            uint32_t reg        = no_register;
+        };
+
+        // Memory operand which refers to a variable. address is the movabs which loads the address of a global,
+        // it is removed together with the access, globals accessed through an absolute memory operand have none
+        struct Access {
+            InstNode* inst;
+            uint32_t operand;
+            size_t variable;
+            InstNode* address;
+        };
+
+        struct Loop {
+            LabelNode* header;
+            InstNode* back_edge;
+
+            std::vector<Variable> variables;
+            std::vector<Access> accesses;
+
+            std::vector<InstNode*> outer_jumps;
+            std::vector<InstNode*> exits;
+            std::vector<InstNode*> leaves;
+            std::vector<InstNode*> reloads;
+            std::vector<size_t> entries;
+            std::vector<size_t> polls;
+
+            uint64_t used_registers = 0;
+            bool has_call           = false;
+            bool unknown_read       = false;
+            bool unknown_write      = false;
+        };
+
+        x86::Builder& _M_builder;
+        const LoopRegisters& _M_registers;
+        std::vector<Label>& _M_entries;
+        std::vector<LoopPoll>& _M_polls;
+        PeepholeStatistics& _M_statistics;
+        bool _M_frame_escapes = false;
+
+        static uint64_t register_bit(uint32_t id)
+        {
+            return id < 64 ? uint64_t(1) << id : 0;
+        }
+
+        static uint32_t label_of(const Operand& operand)
+        {
+            if (operand.isLabel())
+                return operand.id();
+            if (operand.isMem() && operand.as<x86::Mem>().hasBaseLabel())
+                return operand.as<x86::Mem>().baseId();
+            return Globals::kInvalidId;
+        }
+
+        static bool is_address(const InstNode* inst)
+        {
+            return (inst->id() == x86::Inst::kIdMovabs || inst->id() == x86::Inst::kIdMov) && inst->opCount() == 2 &&
+                   inst->op(0).isReg() && inst->op(0).as<x86::Reg>().isGpq() && inst->op(1).isImm();
+        }
+
+        // Instructions whose memory operand can be replaced by a general purpose register of the same size,
+        // movss and movsd become movd and movq
+        static bool is_replaceable(const InstNode* inst, uint32_t size)
+        {
+            if (inst->options() != InstOptions::kNone)
+                return false;
+
+            switch (inst->id())
+            {
+                case x86::Inst::kIdMov:
+                case x86::Inst::kIdAdd:
+                case x86::Inst::kIdSub:
+                case x86::Inst::kIdAnd:
+                case x86::Inst::kIdOr:
+                case x86::Inst::kIdXor:
+                case x86::Inst::kIdCmp:
+                case x86::Inst::kIdTest:
+                case x86::Inst::kIdInc:
+                case x86::Inst::kIdDec:
+                case x86::Inst::kIdNeg:
+                case x86::Inst::kIdNot:
+                case x86::Inst::kIdShl:
+                case x86::Inst::kIdShr:
+                case x86::Inst::kIdSar:
+                case x86::Inst::kIdMovsxd:
+                case x86::Inst::kIdCvtsi2ss:
+                case x86::Inst::kIdCvtsi2sd:
+                case x86::Inst::kIdMovd:
+                case x86::Inst::kIdMovq:
+                    return true;
+
+                case x86::Inst::kIdImul:
+                    return inst->opCount() >= 2;
+
+                case x86::Inst::kIdMovss:
+                    return size == 4 && inst->opCount() == 2;
+
+                case x86::Inst::kIdMovsd:
+                    return size == 8 && inst->opCount() == 2;
+
+                default:
+                    return false;
+            }
+        }
+
+        static bool is_supported(const InstNode* inst)
+        {
+            uint32_t id = inst->id();
+            return is_known(inst) || id == x86::Inst::kIdMov || id == x86::Inst::kIdCdq || id == x86::Inst::kIdCqo ||
+                   id == x86::Inst::kIdIdiv || id == x86::Inst::kIdDiv ||
+                   (id >= x86::Inst::kIdSeta && id <= x86::Inst::kIdSetz) ||
+                   (id >= x86::Inst::kIdCmova && id <= x86::Inst::kIdCmovz);
+        }
+
+        static x86::Gp register_of(const Variable& variable)
+        {
+            return variable.size == 4 ? x86::Gp(x86::gpd(variable.reg)) : x86::Gp(x86::gpq(variable.reg));
+        }
+
+        static x86::Mem memory_of(const x86::Gp& base, int64_t offset, uint32_t size)
+        {
+            return x86::ptr(base, static_cast<int32_t>(offset), size);
+        }
+
+        // The address of a variable escapes if the frame pointer is copied or used by lea. The store of the frame
+        // pointer into the VM registers by save_registers does not count, calls write the variables back anyway
+        bool frame_escapes() const
+        {
+            for (BaseNode* node = _M_builder.firstNode(); node; node = node->next())
+            {
+                if (!node->isInst())
+                    continue;
+
+                const InstNode* inst = node->as<InstNode>();
+                bool is_mov          = inst->id() == x86::Inst::kIdMov && inst->opCount() == 2;
+
+                for (uint32_t index = 0; index < inst->opCount(); index++)
+                {
+                    const Operand& operand = inst->op(index);
+                    if (operand.isReg() && operand.as<x86::Reg>().isGp() && operand.id() == _M_registers.frame)
+                    {
+                        if (is_mov && index == 0)
+                            continue;
+                        if (is_mov && inst->op(0).isMem() && inst->op(0).as<x86::Mem>().hasBaseReg() &&
+                            inst->op(0).as<x86::Mem>().baseId() == _M_registers.vm_registers)
+                            continue;
+                        return true;
+                    }
+
+                    if (operand.isMem() && inst->id() == x86::Inst::kIdLea && operand.as<x86::Mem>().hasBaseReg() &&
+                        operand.as<x86::Mem>().baseId() == _M_registers.frame)
+                        return true;
+                }
+            }
+            return false;
+        }
+
+        void use_registers(Loop& loop, const InstNode* inst)
+        {
+            for (uint32_t index = 0; index < inst->opCount(); index++)
+            {
+                const Operand& operand = inst->op(index);
+                if (operand.isReg() && operand.as<x86::Reg>().isGp())
+                {
+                    loop.used_registers |= register_bit(operand.id());
+                }
+                else if (operand.isMem())
+                {
+                    const x86::Mem& mem = operand.as<x86::Mem>();
+                    if (mem.hasBaseReg())
+                        loop.used_registers |= register_bit(mem.baseId());
+                    if (mem.hasIndexReg())
+                        loop.used_registers |= register_bit(mem.indexId());
+                }
+            }
+        }
+
+        void record(Loop& loop, bool global, int64_t address, uint32_t size, InstNode* inst, uint32_t operand,
+                    bool write, InstNode* address_node)
+        {
+            size_t index = 0;
+            while (index < loop.variables.size() &&
+                   (loop.variables[index].global != global || loop.variables[index].address != address ||
+                    loop.variables[index].size != size))
+            {
+                index++;
+            }
+
+            if (index == loop.variables.size())
+                loop.variables.push_back({global, address, size});
+
+            Variable& variable = loop.variables[index];
+            variable.accesses += 1;
+            variable.written = variable.written || write;
+
+            if (size != 4 && size != 8)
+                variable.cacheable = false;
+
+            if (global)
+            {
+                // Only loads which overwrite the address register can drop the movabs, other reads stay in memory
+                const Operand& destination = inst->op(0);
+                if (write)
+                {
+                    variable.cacheable = false;
+                }
+                else if (address_node == nullptr)
+                {
+                    if (is_replaceable(inst, size))
+                    {
+                        variable.replacable += 1;
+                        loop.accesses.push_back({inst, operand, index, nullptr});
+                    }
+                }
+                else if (inst->id() == x86::Inst::kIdMov && inst->options() == InstOptions::kNone && operand == 1 &&
+                         destination.isReg() && destination.as<x86::Reg>().isGp() &&
+                         destination.id() == address_node->op(0).id() && destination.as<x86::Reg>().size() == size)
+                {
+                    variable.replacable += 1;
+                    loop.accesses.push_back({inst, operand, index, address_node});
+                }
+            }
+            else if (is_replaceable(inst, size))
+            {
+                variable.replacable += 1;
+                loop.accesses.push_back({inst, operand, index, nullptr});
+            }
+            else
+            {
+                variable.cacheable = false;
+            }
+        }
+
+        // Returns false if the instruction cannot be part of a cached loop. After a call the frame pointer is
+        // invalid until restore_registers loads it again, the variables are loaded after that instruction
+        bool scan(Loop& loop, InstNode* inst, bool& pending, InstNode*& address)
+        {
+            InstNode* previous = address;
+            address            = nullptr;
+            uint32_t id        = inst->id();
+
+            use_registers(loop, inst);
+
+            if (id == x86::Inst::kIdJecxz)
+                return false;
+
+            if (is_jump(inst))
+                return !pending && inst->opCount() == 1 && inst->op(0).isLabel();
+
+            if (id == x86::Inst::kIdCall)
+            {
+                if (pending || inst->opCount() != 1 || inst->op(0).isMem())
+                    return false;
+
+                loop.leaves.push_back(inst);
+                loop.has_call = true;
+                pending       = true;
+                return true;
+            }
+
+            if (id == x86::Inst::kIdRet)
+            {
+                if (pending)
+                    return false;
+
+                loop.leaves.push_back(inst);
+                return true;
+            }
+
+            if (id == x86::Inst::kIdLeave)
+                return !pending;
+
+            if (!is_supported(inst) ||
+                (inst->options() != InstOptions::kNone && inst->options() != InstOptions::kX86_Lock))
+                return false;
+
+            if (id == x86::Inst::kIdCdq || id == x86::Inst::kIdCqo || id == x86::Inst::kIdIdiv ||
+                id == x86::Inst::kIdDiv)
+                loop.used_registers |= register_bit(x86::Gp::kIdAx) | register_bit(x86::Gp::kIdDx);
+
+            InstRWInfo rw;
+            if (InstAPI::queryRWInfo(_M_builder.arch(), inst->baseInst(), inst->operands(), inst->opCount(), &rw) !=
+                kErrorOk)
+                return false;
+
+            bool uses_frame = false;
+            for (uint32_t index = 0; index < inst->opCount(); index++)
+            {
+                const Operand& operand = inst->op(index);
+                if (operand.isReg() && operand.as<x86::Reg>().isGp() && operand.id() == _M_registers.frame)
+                {
+                    // Only restore_registers may write the frame pointer
+                    bool is_restore = id == x86::Inst::kIdMov && index == 0 && inst->op(1).isMem() &&
+                                      inst->op(1).as<x86::Mem>().hasBaseReg() &&
+                                      inst->op(1).as<x86::Mem>().baseId() == _M_registers.vm_registers;
+
+                    if (rw.operand(index).isWrite() && !is_restore)
+                        return false;
+
+                    if (is_restore)
+                    {
+                        if (pending)
+                            loop.reloads.push_back(inst);
+                        pending = false;
+                        return true;
+                    }
+
+                    uses_frame = true;
+                }
+                else if (operand.isMem() && operand.as<x86::Mem>().hasBaseReg() &&
+                         operand.as<x86::Mem>().baseId() == _M_registers.frame)
+                {
+                    uses_frame = true;
+                }
+            }
+
+            if (pending && uses_frame)
+                return false;
+
+            for (uint32_t index = 0; index < inst->opCount() && id != x86::Inst::kIdLea; index++)
+            {
+                if (!inst->op(index).isMem())
+                    continue;
+
+                const x86::Mem& mem  = inst->op(index).as<x86::Mem>();
+                const OpRWInfo& info = rw.operand(index);
+
+                if (mem.hasBaseLabel() || mem.baseType() == RegType::kX86_Rip)
+                    continue;
+
+                if (mem.hasBaseReg() && mem.baseId() == _M_registers.frame)
+                {
+                    if (mem.hasIndex())
+                        return false;
+                    record(loop, false, mem.offset(), mem.size(), inst, index, info.isWrite(), nullptr);
+                }
+                else if (mem.hasBaseReg() && !mem.hasIndex() && previous && previous->op(0).id() == mem.baseId())
+                {
+                    uint64_t value = previous->op(1).as<Imm>().valueAs<uint64_t>();
+                    record(loop, true, static_cast<int64_t>(value) + mem.offset(), mem.size(), inst, index,
+                           info.isWrite(), previous);
+                }
+                else if (!mem.hasBaseReg() && !mem.hasIndex())
+                {
+                    record(loop, true, mem.offset(), mem.size(), inst, index, info.isWrite(), nullptr);
+                }
+                else if (!mem.hasBaseReg() ||
+                         (mem.baseId() != _M_registers.stack && mem.baseId() != _M_registers.vm_registers &&
+                          mem.baseId() != x86::Gp::kIdSp && mem.baseId() != x86::Gp::kIdBp))
+                {
+                    loop.unknown_read  = loop.unknown_read || info.isRead();
+                    loop.unknown_write = loop.unknown_write || info.isWrite();
+                }
+            }
+
+            if (is_address(inst))
+                address = inst;
+            return true;
+        }
+
+        bool analyse(Loop& loop)
+        {
+            uint32_t label_count = static_cast<uint32_t>(_M_builder.code()->labelCount());
+            std::vector<uint8_t> inside(label_count, 0);
+            std::vector<uint8_t> entry(label_count, 0);
+            std::vector<uint8_t> poll(label_count, 0);
+            std::vector<uint32_t> references(label_count, 0);
+
+            BaseNode* node = loop.header;
+            for (; node && node != loop.back_edge; node = node->next())
+            {
+                if (node->isLabel() && node->as<LabelNode>()->labelId() < label_count)
+                    inside[node->as<LabelNode>()->labelId()] = 1;
+            }
+
+            if (node == nullptr)
+                return false;
+
+            for (const Label& label : _M_entries)
+            {
+                if (label.id() < label_count)
+                    entry[label.id()] = 1;
+            }
+
+            for (const LoopPoll& safepoint : _M_polls)
+            {
+                if (safepoint.poll.id() < label_count)
+                    poll[safepoint.poll.id()] = 1;
+            }
+
+            // Jumps into the loop must target the header, jumps out of it are exits
+            bool in_loop = false;
+            for (node = _M_builder.firstNode(); node; node = node->next())
+            {
+                if (node == loop.header)
+                    in_loop = true;
+
+                if (node->isInst())
+                {
+                    InstNode* inst = node->as<InstNode>();
+                    for (uint32_t index = 0; index < inst->opCount(); index++)
+                    {
+                        uint32_t id = label_of(inst->op(index));
+                        if (id >= label_count)
+                            continue;
+
+                        references[id] += 1;
+                        if (inside[id] && !in_loop)
+                        {
+                            if (id != loop.header->labelId() || !is_jump(inst))
+                                return false;
+                            loop.outer_jumps.push_back(inst);
+                        }
+                        else if (!inside[id] && in_loop && is_jump(inst))
+                        {
+                            loop.exits.push_back(inst);
+                        }
+                    }
+                }
+                else if (node->isEmbedLabel())
+                {
+                    uint32_t id = node->as<EmbedLabelNode>()->labelId();
+                    if (id < label_count && inside[id])
+                        return false;
+                }
+                else if (node->isEmbedLabelDelta())
+                {
+                    uint32_t id   = node->as<EmbedLabelDeltaNode>()->labelId();
+                    uint32_t base = node->as<EmbedLabelDeltaNode>()->baseLabelId();
+                    if ((id < label_count && inside[id]) || (base < label_count && inside[base]))
+                        return false;
+                }
+
+                if (node == loop.back_edge)
+                    in_loop = false;
+            }
+
+            // A label without references can only be entered by the VM through a JitEntry or mark a safepoint poll
+            for (uint32_t id = 0; id < label_count; id++)
+            {
+                if (inside[id] && references[id] == 0 && !entry[id] && !poll[id])
+                    return false;
+            }
+
+            for (size_t index = 0; index < _M_entries.size(); index++)
+            {
+                if (_M_entries[index].id() < label_count && inside[_M_entries[index].id()])
+                    loop.entries.push_back(index);
+            }
+
+            for (size_t index = 0; index < _M_polls.size(); index++)
+            {
+                if (_M_polls[index].poll.id() < label_count && inside[_M_polls[index].poll.id()])
+                    loop.polls.push_back(index);
+            }
+
+            bool pending      = false;
+            bool after_poll   = false;
+            InstNode* address = nullptr;
+
+            for (node = loop.header;; node = node->next())
+            {
+                if (node->isLabel())
+                {
+                    if (pending)
+                        return false;
+                    uint32_t id = node->as<LabelNode>()->labelId();
+                    address     = nullptr;
+                    after_poll  = id < label_count && poll[id];
+                }
+                else if (after_poll && node->isInst())
+                {
+                    // The load of a poll reads the guard page through an absolute address, it is not a global
+                    use_registers(loop, node->as<InstNode>());
+                    after_poll = false;
+                }
+                else if (!node->isInst() || !scan(loop, node->as<InstNode>(), pending, address))
+                {
+                    return false;
+                }
+
+                if (node == loop.back_edge)
+                    break;
+            }
+
+            return !pending;
+        }
+
+        // Assigns the registers which no instruction of the loop uses, the most accessed variables first
+        size_t select(Loop& loop)
+        {
+            std::vector<Variable>& variables = loop.variables;
+
+            for (size_t first = 0; first < variables.size(); first++)
+            {
+                for (size_t second = first + 1; second < variables.size(); second++)
+                {
+                    Variable& a = variables[first];
+                    Variable& b = variables[second];
+
+                    int64_t a_end = a.address + (a.size ? a.size : 16);
+                    int64_t b_end = b.address + (b.size ? b.size : 16);
+                    if (a.global == b.global && a.address < b_end && b.address < a_end)
+                        a.cacheable = b.cacheable = false;
+                }
+            }
+
+            std::vector<size_t> order;
+            for (size_t index = 0; index < variables.size(); index++)
+            {
+                Variable& variable = variables[index];
+                if (variable.global && (loop.has_call || loop.unknown_write))
+                    variable.cacheable = false;
+                if (!variable.global && _M_frame_escapes && (loop.unknown_read || loop.unknown_write))
+                    variable.cacheable = false;
+
+                if (variable.cacheable && variable.replacable > 0)
+                    order.push_back(index);
+            }
+
+            std::stable_sort(order.begin(), order.end(), [&variables](size_t a, size_t b) {
+                return variables[a].replacable > variables[b].replacable;
+            });
+
+            size_t assigned = 0;
+            for (uint32_t reg : _M_registers.cache)
+            {
+                if (assigned == order.size())
+                    break;
+
+                if ((loop.used_registers & register_bit(reg)) == 0)
+                    variables[order[assigned++]].reg = reg;
+            }
+            return assigned;
+        }
+
+        void emit_loads(const Loop& loop)
+        {
+            x86::Gp frame = x86::gpq(_M_registers.frame);
+            for (const Variable& variable : loop.variables)
+            {
+                if (variable.reg == no_register)
+                    continue;
+
+                if (variable.global)
+                {
+                    _M_builder.movabs(x86::gpq(variable.reg), static_cast<uint64_t>(variable.address));
+                    _M_builder.mov(register_of(variable), memory_of(x86::gpq(variable.reg), 0, variable.size));
+                }
+                else
+                {
+                    _M_builder.mov(register_of(variable), memory_of(frame, variable.address, variable.size));
+                }
+            }
+        }
+
+        void emit_stores(const Loop& loop)
+        {
+            x86::Gp frame = x86::gpq(_M_registers.frame);
+            for (const Variable& variable : loop.variables)
+            {
+                if (variable.reg != no_register && variable.written)
+                    _M_builder.mov(memory_of(frame, variable.address, variable.size), register_of(variable));
+            }
+        }
+
+        void rewrite(Loop& loop)
+        {
+            // Loads on the way into the loop, jumps from outside skip the loads of the fall through path otherwise
+            _M_builder.setCursor(loop.header->prev());
+            if (!loop.outer_jumps.empty())
+            {
+                Label preheader = _M_builder.newLabel();
+                _M_builder.bind(preheader);
+
+                for (InstNode* jump : loop.outer_jumps)
+                {
+                    jump->setOp(0, preheader);
+                }
+            }
+            emit_loads(loop);
+
+            for (InstNode* leave : loop.leaves)
+            {
+                _M_builder.setCursor(leave->prev());
+                emit_stores(loop);
+            }
+
+            for (InstNode* reload : loop.reloads)
+            {
+                _M_builder.setCursor(reload);
+                emit_loads(loop);
+            }
+
+            // Exit and entry stubs follow the back edge, the fall through path of a conditional back edge skips them
+            _M_builder.setCursor(loop.back_edge);
+
+            bool falls_through = loop.back_edge->id() != x86::Inst::kIdJmp;
+            Label skip;
+
+            if (falls_through)
+            {
+                emit_stores(loop);
+                if (!loop.exits.empty() || !loop.entries.empty() || !loop.polls.empty())
+                {
+                    skip = _M_builder.newLabel();
+                    _M_builder.jmp(skip);
+                }
+            }
+
+            std::vector<std::pair<uint32_t, Label>> stubs;
+            for (InstNode* exit : loop.exits)
+            {
+                uint32_t target = exit->op(0).id();
+                auto stub       = std::find_if(stubs.begin(), stubs.end(),
+                                               [target](auto& entry) { return entry.first == target; });
+
+                if (stub == stubs.end())
+                {
+                    stubs.emplace_back(target, _M_builder.newLabel());
+                    stub = stubs.end() - 1;
+
+                    _M_builder.bind(stub->second);
+                    emit_stores(loop);
+                    _M_builder.jmp(Label(target));
+                }
+
+                exit->setOp(0, stub->second);
+            }
+
+            for (size_t index : loop.entries)
+            {
+                Label stub = _M_builder.newLabel();
+                _M_builder.bind(stub);
+                emit_loads(loop);
+                _M_builder.jmp(_M_entries[index]);
+                _M_entries[index] = stub;
+            }
+
+            // The VM continues at the SUSPEND of a poll with the variables in the frame
+            for (size_t index : loop.polls)
+            {
+                Label stub = _M_builder.newLabel();
+                _M_builder.bind(stub);
+                emit_stores(loop);
+                _M_builder.jmp(_M_polls[index].stub);
+                _M_polls[index].stub = stub;
+            }
+
+            if (skip.isValid())
+                _M_builder.bind(skip);
+
+            for (Access& access : loop.accesses)
+            {
+                const Variable& variable = loop.variables[access.variable];
+                if (variable.reg == no_register)
+                    continue;
+
+                access.inst->setOp(access.operand, register_of(variable));
+                if (access.inst->id() == x86::Inst::kIdMovss)
+                    access.inst->setId(x86::Inst::kIdMovd);
+                else if (access.inst->id() == x86::Inst::kIdMovsd)
+                    access.inst->setId(x86::Inst::kIdMovq);
+
+                if (access.address)
+                    _M_builder.removeNode(access.address);
+                _M_statistics.replaced_accesses += 1;
+            }
+        }
+
+    public:
+        X86_64_LoopRegisters(x86::Builder& builder, const LoopRegisters& registers, std::vector<Label>& entries,
+                             std::vector<LoopPoll>& polls, PeepholeStatistics& statistics)
+            : _M_builder(builder), _M_registers(registers), _M_entries(entries), _M_polls(polls),
+              _M_statistics(statistics)
+        {}
+
+        void run(const std::vector<LoopRegion>& regions)
+        {
+            _M_frame_escapes = frame_escapes();
+
+            for (const LoopRegion& region : regions)
+            {
+                Loop loop;
+                if (_M_builder.labelNodeOf(&loop.header, region.header) != kErrorOk || !region.back_edge ||
+                    !region.back_edge->isInst() || !is_jump(region.back_edge->as<InstNode>()))
+                    continue;
+
+                loop.back_edge = region.back_edge->as<InstNode>();
+                if (!analyse(loop))
+                    continue;
+
+                size_t cached = select(loop);
+                if (cached == 0)
+                    continue;
+
+                rewrite(loop);
+                _M_statistics.cached_loops += 1;
+                _M_statistics.cached_variables += cached;
+            }
+
+            _M_builder.setCursor(_M_builder.lastNode());
+        }
+    };
+
+    void run_peephole(x86::Builder& builder, const x86::Gp& stack_register, const PeepholeOptions& options,
+                      PeepholeStatistics& statistics)
+    {
+        X86_64_Peephole(builder, stack_register, options, statistics).run();
+    }
+
+    void run_loop_registers(x86::Builder& builder, const std::vector<LoopRegion>& loops, const LoopRegisters& registers,
+                            std::vector<Label>& entries, std::vector<LoopPoll>& polls, PeepholeStatistics& statistics)
+    {
+        X86_64_LoopRegisters(builder, registers, entries, polls, statistics).run(loops);
+    }
+}// namespace JIT